@@ -0,0 +1,226 @@
+#!/usr/bin/env python3
+#
+# Compare the write-ahead log fsync policies.
+#
+# Starts the broker once per policy (no log, always, interval, never) on a
+# unix socket and measures QoS 1 publish throughput and PUBACK latency, both
+# saturated (pipelined publishers) and with a single message in flight.
+#
+# Usage: bench/wal_fsync.py <path-to-sol> [messages] [publishers]
+
+import os
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+POLICIES = ('none', 'always', 'interval', 'never')
+PAYLOAD = b'x' * 64
+
+
+def enc_len(n):
+    out = b''
+    while True:
+        d, n = n % 128, n // 128
+        out += bytes([d | 128 if n else d])
+        if not n:
+            return out
+
+
+def s(x):
+    x = x.encode() if isinstance(x, str) else x
+    return struct.pack('>H', len(x)) + x
+
+
+def packet(b, body):
+    return bytes([b]) + enc_len(len(body)) + body
+
+
+def recvn(c, n):
+    buf = b''
+    while len(buf) < n:
+        d = c.recv(n - len(buf))
+        if not d:
+            raise ConnectionError('broker closed the connection')
+        buf += d
+    return buf
+
+
+def read_packet(c):
+    h = recvn(c, 1)[0]
+    n, mul = 0, 1
+    while True:
+        b = recvn(c, 1)[0]
+        n += (b & 127) * mul
+        mul *= 128
+        if not b & 128:
+            break
+    return h, recvn(c, n)
+
+
+def connect(path, cid):
+    c = socket.socket(socket.AF_UNIX)
+    c.connect(path)
+    vh = s('MQTT') + bytes([4, 2]) + struct.pack('>H', 60)
+    c.sendall(packet(0x10, vh + s(cid)))
+    read_packet(c)
+    return c
+
+
+def subscribe(c, topic, qos=0):
+    c.sendall(packet(0x82, struct.pack('>H', 1) + s(topic) + bytes([qos])))
+    read_packet(c)
+
+
+def publish(pid, topic):
+    return packet(0x32, s(topic) + struct.pack('>H', pid) + PAYLOAD)
+
+
+def percentiles(lat):
+    lat.sort()
+    return lat[len(lat) // 2] * 1000, lat[int(len(lat) * .99)] * 1000
+
+
+class Drain(threading.Thread):
+    """QoS 0 subscriber reading everything published on bench/#."""
+
+    def __init__(self, path):
+        super().__init__()
+        self.c = connect(path, 'bench-sub')
+        subscribe(self.c, 'bench/#')
+        self.c.settimeout(0.2)
+        self.stop = False
+
+    def run(self):
+        while not self.stop:
+            try:
+                self.c.recv(1 << 20)
+            except socket.timeout:
+                pass
+        self.c.close()
+
+
+def saturated(path, n, k):
+    lat, lock = [], threading.Lock()
+
+    def publisher(i):
+        c = connect(path, 'bench-pub-%d' % i)
+        sent = {}
+
+        def reader():
+            for _ in range(n):
+                _, body = read_packet(c)
+                t = time.perf_counter()
+                with lock:
+                    lat.append(t - sent[struct.unpack('>H', body)[0]])
+
+        r = threading.Thread(target=reader)
+        r.start()
+        for pid in range(1, n + 1):
+            sent[pid] = time.perf_counter()
+            c.sendall(publish(pid, 'bench/%d' % (pid % 10)))
+        r.join()
+        c.close()
+
+    start = time.perf_counter()
+    ts = [threading.Thread(target=publisher, args=(i,)) for i in range(k)]
+    for t in ts:
+        t.start()
+    for t in ts:
+        t.join()
+    elapsed = time.perf_counter() - start
+    return (len(lat) / elapsed,) + percentiles(lat)
+
+
+def ping_pong(path, n):
+    c = connect(path, 'bench-pp')
+    lat = []
+    for pid in range(1, n + 1):
+        t = time.perf_counter()
+        c.sendall(publish(pid, 'bench/1'))
+        read_packet(c)
+        lat.append(time.perf_counter() - t)
+    c.close()
+    return (len(lat) / sum(lat),) + percentiles(lat)
+
+
+def wal_stats(path):
+    """Latest $SOL/broker/wal counters, published once a second."""
+    c = connect(path, 'bench-stats')
+    subscribe(c, '$SOL/broker/wal/#')
+    stats = {}
+    deadline = time.time() + 2.5
+    c.settimeout(0.5)
+    while time.time() < deadline:
+        try:
+            h, body = read_packet(c)
+        except socket.timeout:
+            continue
+        if h >> 4 != 3:
+            continue
+        tlen = struct.unpack('>H', body[:2])[0]
+        topic = body[2:2 + tlen].decode()
+        stats[topic.rsplit('/', 1)[-1]] = int(body[2 + tlen:] or 0)
+    c.close()
+    return stats
+
+
+def run(sol, policy, n, k):
+    tmp = tempfile.mkdtemp(prefix='sol-bench-')
+    path = os.path.join(tmp, 'sol.sock')
+    conf = os.path.join(tmp, 'sol.conf')
+    with open(conf, 'w') as f:
+        f.write('unix_socket %s\nlog_level ERROR\n' % path)
+        f.write('log_path %s\n' % os.path.join(tmp, 'sol.log'))
+        f.write('stats_publish_interval 1s\n')
+        if policy != 'none':
+            f.write('wal_dir %s\nwal_fsync %s\n' %
+                    (os.path.join(tmp, 'wal'), policy))
+            f.write('wal_fsync_interval 10\n')
+    broker = subprocess.Popen([sol, '-c', conf], stdout=subprocess.DEVNULL,
+                              stderr=subprocess.DEVNULL)
+    try:
+        for _ in range(50):
+            if os.path.exists(path):
+                break
+            time.sleep(0.1)
+        drain = Drain(path)
+        drain.start()
+        sat = saturated(path, n, k)
+        stats = wal_stats(path) if policy != 'none' else {}
+        pp = ping_pong(path, 3000)
+        drain.stop = True
+        drain.join()
+    finally:
+        broker.terminate()
+        broker.wait()
+        shutil.rmtree(tmp)
+    syncs = stats.get('syncs', 0)
+    per_sync = '%.1f' % (stats['records'] / syncs) if syncs else '-'
+    return sat, pp, per_sync
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit('usage: %s <path-to-sol> [messages] [publishers]' %
+                 sys.argv[0])
+    sol = sys.argv[1]
+    n = int(sys.argv[2]) if len(sys.argv) > 2 else 20000
+    k = int(sys.argv[3]) if len(sys.argv) > 3 else 8
+    print('%d publishers x %d QoS 1 messages, then 3000 with one in flight'
+          % (k, n))
+    print('%-9s %10s %8s %8s %12s %10s %8s %8s' %
+          ('policy', 'msg/s', 'p50 ms', 'p99 ms', 'rec/sync',
+           '1-fl msg/s', 'p50 ms', 'p99 ms'))
+    for policy in POLICIES:
+        sat, pp, per_sync = run(sol, policy, n, k)
+        print('%-9s %10.0f %8.2f %8.2f %12s %10.0f %8.3f %8.3f' %
+              ((policy,) + sat + (per_sync,) + pp))
+
+
+if __name__ == '__main__':
+    main()
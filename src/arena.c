@@ -0,0 +1,106 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdalign.h>
+#include "arena.h"
+
+static inline size_t arena_align(size_t size) {
+    size_t align = alignof(max_align_t);
+    return (size + align - 1) & ~(align - 1);
+}
+
+static struct arena_block *arena_block_create(size_t size) {
+    if (size < ARENA_BLOCK_SIZE)
+        size = ARENA_BLOCK_SIZE;
+    struct arena_block *block = malloc(sizeof(*block) + size);
+    if (!block)
+        return NULL;
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+    size = arena_align(size);
+    struct arena_block *block = arena->current;
+    if (block && block->size - block->used >= size)
+        goto bump;
+
+    /*
+     * Move on to the next free block, a new one is linked right after the
+     * current if it's too small, so blocks are always walked in the same
+     * order and a request of the same shape reuses the same ones
+     */
+    struct arena_block *next = block ? block->next : arena->head;
+    if (next && next->size >= size) {
+        block = next;
+        block->used = 0;
+    } else {
+        struct arena_block *created = arena_block_create(size);
+        if (!created)
+            return NULL;
+        created->next = next;
+        if (block)
+            block->next = created;
+        else
+            arena->head = created;
+        block = created;
+    }
+    arena->current = block;
+bump:
+    block->used += size;
+    return block->data + block->used - size;
+}
+
+char *arena_strndup(struct arena *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    if (!copy)
+        return NULL;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+void arena_reset(struct arena *arena) {
+    /* Blocks of larger allocations are freed, they'd stay resident otherwise */
+    struct arena_block **link = &arena->head;
+    while (*link) {
+        struct arena_block *block = *link;
+        if (block->size > ARENA_BLOCK_SIZE) {
+            *link = block->next;
+            free(block);
+        } else {
+            link = &block->next;
+        }
+    }
+    arena->current = arena->head;
+    if (arena->head)
+        arena->head->used = 0;
+}
+
+void arena_release(struct arena *arena) {
+    struct arena_block *block = arena->head;
+    while (block) {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = arena->current = NULL;
+}
+
+struct arena_mark arena_mark(const struct arena *arena) {
+    struct arena_mark mark = {
+        arena->current,
+        arena->current ? arena->current->used : 0
+    };
+    return mark;
+}
+
+void arena_rewind(struct arena *arena, struct arena_mark mark) {
+    if (!mark.block) {
+        arena_reset(arena);
+        return;
+    }
+    arena->current = mark.block;
+    mark.block->used = mark.used;
+}
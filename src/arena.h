@@ -0,0 +1,61 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump arena for request-scoped allocations, the unpacked packet, the
+ * replies being packed and any transient copy made by the handlers. Each
+ * allocation just moves a cursor forward, nothing is released alone: the
+ * whole arena is reset once the request is done.
+ *
+ * Memory comes in a chain of blocks kept across resets, after the first few
+ * requests an arena serves everything without touching the allocator. Only
+ * the blocks of allocations larger than ARENA_BLOCK_SIZE are freed on reset.
+ */
+
+/* Size of the blocks of an arena, larger allocations get their own block */
+#define ARENA_BLOCK_SIZE    16384
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    unsigned char data[];
+};
+
+struct arena {
+    struct arena_block *head;
+    /* Block allocations are served from, the following ones are free */
+    struct arena_block *current;
+};
+
+/* Position of an arena, everything allocated after it can be rewound */
+struct arena_mark {
+    struct arena_block *block;
+    size_t used;
+};
+
+#define ARENA_INITIALIZER { NULL, NULL }
+
+/* Allocate memory aligned like malloc'ed one, valid till the next reset */
+void *arena_alloc(struct arena *, size_t);
+
+/* Copy len bytes to the arena, NUL terminated */
+char *arena_strndup(struct arena *, const char *, size_t);
+
+/*
+ * Release every allocation at once, blocks are kept for the next ones except
+ * the oversize ones
+ */
+void arena_reset(struct arena *);
+
+/* Free the blocks of the arena */
+void arena_release(struct arena *);
+
+struct arena_mark arena_mark(const struct arena *);
+
+/* Release the allocations made after a mark, in LIFO order to other marks */
+void arena_rewind(struct arena *, struct arena_mark);
+
+#endif
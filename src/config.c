@@ -29,8 +29,9 @@ static const struct llevel lmap[5] = {
 
 static size_t read_memory_with_mul(const char *memory_string) {
 
-    /* Extract digit part */
-    size_t num = parse_int(memory_string);
+    /* Extract digit part, negative values count as 0 */
+    int n = parse_int(memory_string);
+    size_t num = n > 0 ? n : 0;
     int mul = 1;
 
     /* Move the pointer forward till the first non-digit char */
@@ -49,8 +50,9 @@ static size_t read_memory_with_mul(const char *memory_string) {
 
 static size_t read_time_with_mul(const char *time_string) {
 
-    /* Extract digit part */
-    size_t num = parse_int(time_string);
+    /* Extract digit part, negative values count as 0 */
+    int n = parse_int(time_string);
+    size_t num = n > 0 ? n : 0;
     int mul = 1;
 
     /* Move the pointer forward till the first non-digit char */
@@ -72,6 +74,50 @@ static size_t read_time_with_mul(const char *time_string) {
     return num * mul;
 }
 
+static const struct {
+    const char *name;
+    int policy;
+} memory_policies[3] = {
+    {"reject_connections", MEMORY_REJECT_CONNECTIONS},
+    {"drop_qos0", MEMORY_DROP_QOS0},
+    {"evict_retained", MEMORY_EVICT_RETAINED}
+};
+
+static const struct {
+    const char *name;
+    int mode;
+} huge_pages_modes[3] = {
+    {"off", HUGE_PAGES_OFF},
+    {"madvise", HUGE_PAGES_MADVISE},
+    {"hugetlb", HUGE_PAGES_HUGETLB}
+};
+
+static const struct {
+    const char *name;
+    int policy;
+} wal_fsync_policies[3] = {
+    {"always", WAL_FSYNC_ALWAYS},
+    {"interval", WAL_FSYNC_INTERVAL},
+    {"never", WAL_FSYNC_NEVER}
+};
+
+/* Read a comma separated list of memory policies, "none" disables them */
+static int read_memory_policy(const char *policy_string) {
+    int policy = 0;
+    while (*policy_string) {
+        size_t len = strcspn(policy_string, ",");
+        for (int i = 0; i < 3; i++) {
+            if (strlen(memory_policies[i].name) == len &&
+                STREQ(memory_policies[i].name, policy_string, len) == true)
+                policy |= memory_policies[i].policy;
+        }
+        policy_string += len;
+        if (*policy_string == ',')
+            policy_string++;
+    }
+    return policy;
+}
+
 /* Format a memory in bytes to a more human-readable form, e.g. 64b or 18Kb
  * instead of huge numbers like 130230234 bytes */
 char *memory_to_string(size_t memory) {
@@ -162,13 +208,75 @@ static void add_config_value(const char *key, const char *value) {
         strcpy(config.port, value);
     } else if (STREQ("max_memory", key, klen) == true) {
         config.max_memory = read_memory_with_mul(value);
+    } else if (STREQ("max_memory_policy", key, klen) == true) {
+        config.memory_policy = read_memory_policy(value);
+    } else if (STREQ("slow_consumer_bytes", key, klen) == true) {
+        config.slow_consumer_bytes = read_memory_with_mul(value);
+    } else if (STREQ("huge_pages", key, klen) == true) {
+        for (int i = 0; i < 3; i++) {
+            if (strlen(huge_pages_modes[i].name) == vlen &&
+                STREQ(huge_pages_modes[i].name, value, vlen) == true)
+                config.huge_pages = huge_pages_modes[i].mode;
+        }
     } else if (STREQ("max_request_size", key, klen) == true) {
         config.max_request_size = read_memory_with_mul(value);
+    } else if (STREQ("max_retained_memory", key, klen) == true) {
+        config.max_retained_memory = read_memory_with_mul(value);
     } else if (STREQ("tcp_backlog", key, klen) == true) {
         int tcp_backlog = parse_int(value);
         config.tcp_backlog = tcp_backlog <= SOMAXCONN ? tcp_backlog : SOMAXCONN;
+    } else if (STREQ("max_inflight", key, klen) == true) {
+        int max_inflight = parse_int(value);
+        if (max_inflight < 1)
+            max_inflight = 1;
+        config.max_inflight = max_inflight <= MAX_INFLIGHT_LIMIT ?
+            max_inflight : MAX_INFLIGHT_LIMIT;
+    } else if (STREQ("inflight_retry_time", key, klen) == true) {
+        config.inflight_retry_time = read_time_with_mul(value);
+    } else if (STREQ("max_queued_messages", key, klen) == true) {
+        int max_queued = parse_int(value);
+        if (max_queued > 0)
+            config.max_queued_messages = max_queued;
+        else
+            sol_warning("WARNING: Invalid max_queued_messages %s. "
+                        "Fallback to default.", value);
+    } else if (STREQ("max_queued_bytes", key, klen) == true) {
+        config.max_queued_bytes = read_memory_with_mul(value);
+    } else if (STREQ("queue_drop_policy", key, klen) == true) {
+        if (STREQ("drop_newest", value, vlen) == true)
+            config.queue_drop_policy = QUEUE_DROP_NEWEST;
+        else if (STREQ("drop_oldest", value, vlen) == true)
+            config.queue_drop_policy = QUEUE_DROP_OLDEST;
+    } else if (STREQ("wal_dir", key, klen) == true) {
+        strcpy(config.wal_dir, value);
+    } else if (STREQ("wal_fsync", key, klen) == true) {
+        for (int i = 0; i < 3; i++) {
+            if (strlen(wal_fsync_policies[i].name) == vlen &&
+                STREQ(wal_fsync_policies[i].name, value, vlen) == true)
+                config.wal_fsync = wal_fsync_policies[i].policy;
+        }
+    } else if (STREQ("wal_fsync_interval", key, klen) == true) {
+        int interval = parse_int(value);
+        if (interval > 0)
+            config.wal_fsync_interval = interval;
+        else
+            sol_warning("WARNING: Invalid wal_fsync_interval %s. "
+                        "Fallback to default.", value);
+    } else if (STREQ("wal_segment_size", key, klen) == true) {
+        config.wal_segment_size = read_memory_with_mul(value);
     } else if (STREQ("stats_publish_interval", key, klen) == true) {
         config.stats_pub_interval = read_time_with_mul(value);
+    } else if (STREQ("idle_release_time", key, klen) == true) {
+        config.idle_release_time = read_time_with_mul(value);
+    } else if (STREQ("fanout_workers", key, klen) == true) {
+        int workers = parse_int(value);
+        if (workers < 0)
+            workers = 0;
+        config.fanout_workers = workers <= FANOUT_MAX_WORKERS ?
+            workers : FANOUT_MAX_WORKERS;
+    } else if (STREQ("fanout_threshold", key, klen) == true) {
+        int threshold = parse_int(value);
+        config.fanout_threshold = threshold > 1 ? threshold : 1;
     }
 }
 
@@ -239,9 +347,28 @@ void config_set_default(void) {
     config.epoll_timeout = -1;
     config.run = eventfd(0, EFD_NONBLOCK);
     config.max_memory = read_memory_with_mul(DEFAULT_MAX_MEMORY);
+    config.memory_policy = read_memory_policy(DEFAULT_MEMORY_POLICY);
+    config.slow_consumer_bytes =
+        read_memory_with_mul(DEFAULT_SLOW_CONSUMER_BYTES);
+    config.huge_pages = DEFAULT_HUGE_PAGES;
     config.max_request_size = read_memory_with_mul(DEFAULT_MAX_REQUEST_SIZE);
+    config.max_retained_memory =
+        read_memory_with_mul(DEFAULT_MAX_RETAINED_MEMORY);
     config.tcp_backlog = SOMAXCONN;
     config.stats_pub_interval = read_time_with_mul(DEFAULT_STATS_INTERVAL);
+    config.idle_release_time = read_time_with_mul(DEFAULT_IDLE_RELEASE_TIME);
+    config.max_inflight = DEFAULT_MAX_INFLIGHT;
+    config.inflight_retry_time =
+        read_time_with_mul(DEFAULT_INFLIGHT_RETRY_TIME);
+    config.max_queued_messages = DEFAULT_MAX_QUEUED_MESSAGES;
+    config.max_queued_bytes = read_memory_with_mul(DEFAULT_MAX_QUEUED_BYTES);
+    config.queue_drop_policy = DEFAULT_QUEUE_DROP_POLICY;
+    strcpy(config.wal_dir, DEFAULT_WAL_DIR);
+    config.wal_fsync = DEFAULT_WAL_FSYNC;
+    config.wal_fsync_interval = DEFAULT_WAL_FSYNC_INTERVAL;
+    config.wal_segment_size = read_memory_with_mul(DEFAULT_WAL_SEGMENT_SIZE);
+    config.fanout_workers = DEFAULT_FANOUT_WORKERS;
+    config.fanout_threshold = DEFAULT_FANOUT_THRESHOLD;
 }
 
 void config_print(void) {
@@ -269,7 +396,37 @@ void config_print(void) {
         sol_info("\tlogpath: %s", config.logpath);
         const char *human_memory = memory_to_string(config.max_memory);
         sol_info("Max memory: %s", human_memory);
+        for (int i = 0; i < 3; i++) {
+            if (config.memory_policy & memory_policies[i].policy)
+                sol_info("\tPolicy: %s", memory_policies[i].name);
+        }
+        sol_info("Huge pages: %s", huge_pages_modes[config.huge_pages].name);
+        const char *human_retained =
+            memory_to_string(config.max_retained_memory);
+        sol_info("Max retained memory: %s", human_retained);
+        sol_info("Fan-out workers: %d (over %lu subscribers)",
+                 config.fanout_workers, config.fanout_threshold);
+        sol_info("Idle release time: %lus", config.idle_release_time);
+        sol_info("Max inflight: %u (retried every %lus)",
+                 config.max_inflight, config.inflight_retry_time);
+        const char *human_queued = memory_to_string(config.max_queued_bytes);
+        sol_info("Session queue: %lu messages, %s (%s)",
+                 config.max_queued_messages, human_queued,
+                 config.queue_drop_policy == QUEUE_DROP_NEWEST ?
+                 "drop_newest" : "drop_oldest");
+        free((char *) human_queued);
+        if (config.wal_dir[0] != '\0') {
+            const char *human_segment =
+                memory_to_string(config.wal_segment_size);
+            sol_info("Write-ahead log: %s (fsync %s, segments of %s)",
+                     config.wal_dir, wal_fsync_policies[config.wal_fsync].name,
+                     human_segment);
+            if (config.wal_fsync == WAL_FSYNC_INTERVAL)
+                sol_info("\tfsync interval: %lums", config.wal_fsync_interval);
+            free((char *) human_segment);
+        }
         free((char *) human_memory);
+        free((char *) human_retained);
         free((char *) human_rsize);
     }
 }
\ No newline at end of file
@@ -14,7 +14,58 @@
 #define DEFAULT_PORT                "1883"
 #define DEFAULT_MAX_MEMORY          "2GB"
 #define DEFAULT_MAX_REQUEST_SIZE    "2MB"
+#define DEFAULT_MAX_RETAINED_MEMORY "256MB"
 #define DEFAULT_STATS_INTERVAL      "10s"
+#define DEFAULT_IDLE_RELEASE_TIME   "30s"
+#define DEFAULT_FANOUT_WORKERS      4
+#define DEFAULT_FANOUT_THRESHOLD    10000
+#define DEFAULT_MEMORY_POLICY       "reject_connections,drop_qos0,evict_retained"
+#define DEFAULT_SLOW_CONSUMER_BYTES "64KB"
+#define DEFAULT_HUGE_PAGES          HUGE_PAGES_OFF
+#define DEFAULT_MAX_INFLIGHT        32
+#define DEFAULT_INFLIGHT_RETRY_TIME "20s"
+#define DEFAULT_MAX_QUEUED_MESSAGES 1000
+#define DEFAULT_MAX_QUEUED_BYTES    "1MB"
+#define DEFAULT_QUEUE_DROP_POLICY   QUEUE_DROP_OLDEST
+#define DEFAULT_WAL_DIR             ""
+#define DEFAULT_WAL_FSYNC           WAL_FSYNC_ALWAYS
+#define DEFAULT_WAL_FSYNC_INTERVAL  10
+#define DEFAULT_WAL_SEGMENT_SIZE    "64MB"
+
+/* Upper bound of the inflight window, a power of 2 */
+#define MAX_INFLIGHT_LIMIT          0x8000
+
+/* Upper bound of the fan-out worker threads */
+#define FANOUT_MAX_WORKERS          64
+
+/* Policies applied once max_memory is exceeded */
+#define MEMORY_REJECT_CONNECTIONS   (1 << 0)
+#define MEMORY_DROP_QOS0            (1 << 1)
+#define MEMORY_EVICT_RETAINED       (1 << 2)
+
+/* Message dropped from a full session queue */
+#define QUEUE_DROP_OLDEST           0
+#define QUEUE_DROP_NEWEST           1
+
+/* Backing of the pools, from the most to the least strict */
+enum huge_pages {
+    /* Plain heap memory */
+    HUGE_PAGES_OFF,
+    /* Transparent huge pages, requested with madvise */
+    HUGE_PAGES_MADVISE,
+    /* Reserved huge pages, falling back to transparent ones */
+    HUGE_PAGES_HUGETLB
+};
+
+/* When the records of the write-ahead log are synced to disk */
+enum wal_fsync {
+    /* After every batch written, acks wait for the sync */
+    WAL_FSYNC_ALWAYS,
+    /* At most every wal_fsync_interval milliseconds */
+    WAL_FSYNC_INTERVAL,
+    /* Left to the OS, records are acked once written */
+    WAL_FSYNC_NEVER
+};
 
 struct config {
     /* Sol version <MAJOR.MINOR.PATCH> */
@@ -38,12 +89,48 @@ struct config {
     /* Max memory to be used, after which the system starts to reclaim back by
      * freeing older items stored */
     size_t max_memory;
+    /* MEMORY_* policies applied over max_memory */
+    int memory_policy;
+    /* Bytes pending on the socket of a client over which it's considered a
+     * slow consumer, QoS 0 messages to it are dropped over max_memory */
+    size_t slow_consumer_bytes;
+    /* Huge pages backing the pools, one of HUGE_PAGES_* */
+    int huge_pages;
     /* Max memory request can allocate */
     size_t max_request_size;
+    /* Max memory the retained messages store can take, new retained
+     * messages are refused once reached */
+    size_t max_retained_memory;
     /* TCP backlog size */
     int tcp_backlog;
+    /* Unacknowledged QoS 1 and 2 messages a client can have, new ones are
+     * dropped once reached */
+    unsigned max_inflight;
+    /* Time after which an unacknowledged message is sent again */
+    size_t inflight_retry_time;
+    /* Messages and payload bytes the queue of a persistent session can
+     * hold while its client is offline or its inflight window is full */
+    size_t max_queued_messages;
+    size_t max_queued_bytes;
+    /* QUEUE_DROP_* message dropped once the queue is full */
+    int queue_drop_policy;
+    /* Directory of the write-ahead log, empty to keep everything in memory */
+    char wal_dir[0xFF];
+    /* WAL_FSYNC_* policy and interval in milliseconds of the interval one */
+    int wal_fsync;
+    size_t wal_fsync_interval;
+    /* Size over which a new segment of the log is started */
+    size_t wal_segment_size;
     /* Delay between every automatic publish of broker stats on topic */
     size_t stats_pub_interval;
+    /* Time without traffic after which the buffers of a connection go back
+     * to their pools */
+    size_t idle_release_time;
+    /* Worker threads sending out publishes to large subscriber sets, 0
+     * disables them and every publish is sent out by the event loop */
+    int fanout_workers;
+    /* Subscribers of a publish over which the fan-out goes to the workers */
+    size_t fanout_threshold;
 };
 
 extern struct config *conf;
@@ -1,10 +1,157 @@
+#define _POSIX_C_SOURCE 200809L
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include "core.h"
+#include "pool.h"
+#include "memory.h"
+#include "epoch.h"
+#include "config.h"
+#include "network.h"
 
-static int compare_cid(void *c1, void *c2) {
-    return strcmp(((struct subscriber *) c1)->client->client_id,
-                  ((struct subscriber *) c2)->client->client_id);
+/*
+ * Number of members probed when the share group member next in turn has
+ * bytes still pending on its socket, the least loaded among them is chosen
+ */
+#define SHARE_GROUP_PROBES 4
+
+struct message *message_create(unsigned char qos,
+                               size_t payloadlen,
+                               unsigned char *payload) {
+    struct message *m = malloc(sizeof(*m));
+    atomic_init(&m->refs, 1);
+    m->qos = qos;
+    m->id = 0;
+    m->payloadlen = payloadlen;
+    m->payload = payload;
+    return m;
+}
+
+struct message *message_ref(struct message *m) {
+    atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+    return m;
+}
+
+void message_release(struct message *m) {
+    if (!m)
+        return;
+    if (atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) > 1)
+        return;
+    free(m->payload);
+    free(m);
+}
+
+size_t message_size(const struct message *m) {
+    return sizeof(*m) + m->payloadlen;
+}
+
+struct session *session_create(void) {
+    struct session *s = memory_alloc(MEMORY_CLIENTS, sizeof(*s));
+    if (!s)
+        return NULL;
+    s->queue = NULL;
+    s->head = s->len = s->capacity = 0;
+    s->bytes = 0;
+    return s;
+}
+
+void session_free(struct session *s) {
+    if (!s)
+        return;
+    while (s->len > 0)
+        session_dequeue(s);
+    memory_free(MEMORY_QUEUED, s->queue,
+                s->capacity * sizeof(struct queued_message));
+    memory_free(MEMORY_CLIENTS, s, sizeof(*s));
+}
+
+/* Double the ring, moving the messages at its start */
+static bool session_grow(struct session *s) {
+    size_t capacity = s->capacity ? s->capacity * 2 : 8;
+    if (capacity > conf->max_queued_messages)
+        capacity = conf->max_queued_messages;
+    struct queued_message *queue =
+        memory_alloc(MEMORY_QUEUED, capacity * sizeof(*queue));
+    if (!queue)
+        return false;
+    for (size_t i = 0; i < s->len; i++)
+        queue[i] = s->queue[(s->head + i) % s->capacity];
+    memory_free(MEMORY_QUEUED, s->queue, s->capacity * sizeof(*queue));
+    s->queue = queue;
+    s->head = 0;
+    s->capacity = capacity;
+    return true;
+}
+
+size_t session_enqueue(struct session *s, struct message *m,
+                       struct topic *t, unsigned char qos) {
+    size_t dropped = 0;
+    if (conf->max_queued_messages == 0 ||
+        m->payloadlen > conf->max_queued_bytes)
+        return 1;
+    while (s->len == conf->max_queued_messages ||
+           s->bytes + m->payloadlen > conf->max_queued_bytes) {
+        if (conf->queue_drop_policy == QUEUE_DROP_NEWEST)
+            return dropped + 1;
+        session_dequeue(s);
+        dropped++;
+    }
+    if (s->len == s->capacity && !session_grow(s))
+        return dropped + 1;
+    struct queued_message *q = &s->queue[(s->head + s->len) % s->capacity];
+    q->msg = message_ref(m);
+    topic_ref(t);
+    q->topic = t;
+    q->qos = qos;
+    s->len++;
+    s->bytes += m->payloadlen;
+    memory_add(MEMORY_QUEUED, message_size(m));
+    return dropped;
+}
+
+struct queued_message *session_peek(struct session *s) {
+    return s->len > 0 ? &s->queue[s->head] : NULL;
+}
+
+void session_dequeue(struct session *s) {
+    struct queued_message *q = &s->queue[s->head];
+    s->bytes -= q->msg->payloadlen;
+    memory_sub(MEMORY_QUEUED, message_size(q->msg));
+    message_release(q->msg);
+    topic_unref(q->topic);
+    s->head = (s->head + 1) % s->capacity;
+    s->len--;
+}
+
+/* Messages after the one removed move back a slot, keeping their order */
+bool session_remove(struct session *s, uint64_t id) {
+    for (size_t i = 0; i < s->len; i++) {
+        struct queued_message *q = &s->queue[(s->head + i) % s->capacity];
+        if (q->msg->id != id)
+            continue;
+        struct queued_message removed = *q;
+        for (size_t j = i; j + 1 < s->len; j++)
+            s->queue[(s->head + j) % s->capacity] =
+                s->queue[(s->head + j + 1) % s->capacity];
+        s->len--;
+        s->bytes -= removed.msg->payloadlen;
+        memory_sub(MEMORY_QUEUED, message_size(removed.msg));
+        message_release(removed.msg);
+        topic_unref(removed.topic);
+        return true;
+    }
+    return false;
+}
+
+void session_map(struct session *s,
+                 void (*func)(struct queued_message *, void *), void *arg) {
+    for (size_t i = 0; i < s->len; i++)
+        func(&s->queue[(s->head + i) % s->capacity], arg);
+}
+
+/* Release function for retained messages retired through the epoch module */
+static void retained_release(void *ptr) {
+    message_release(ptr);
 }
 
 struct topic *topic_create(const char *name) {
@@ -13,40 +160,788 @@ struct topic *topic_create(const char *name) {
     return t;
 }
 
+/* Initial number of slots of the interned topics table, a power of 2 */
+#define TOPIC_TABLE_INITIAL_SIZE 64
+
+/* Marker of a deleted slot of the interned topics table */
+static struct topic tombstone;
+
+/* Generation of the topic hints of the topics with a given hash */
+static inline atomic_ulong *topic_generation(const struct sol *sol,
+                                             uint32_t hash) {
+    return &sol->topic_generations[hash & (TOPIC_GENERATIONS - 1)];
+}
+
+/* Drop the trailing '/' if present, it's not part of the interning key */
+static size_t topic_key_len(const char *name, size_t len) {
+    return len > 0 && name[len - 1] == '/' ? len - 1 : len;
+}
+
+/* FNV-1a parameters */
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME  16777619u
+
+/* FNV-1a hash of the topic name */
+static uint32_t topic_hash(const char *name, size_t len) {
+    uint32_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
 void topic_init(struct topic *t, const char *name) {
     t->name = name;
-    t->subscribers = list_create(NULL);
+    t->len = topic_key_len(name, strlen(name));
+    t->hash = topic_hash(name, t->len);
+
+    /* Record level offsets, a level starts after every '/' */
+    t->nlevels = 1;
+    for (size_t i = 0; i < t->len; i++)
+        if (name[i] == '/')
+            t->nlevels++;
+    t->levels = malloc(t->nlevels * sizeof(*t->levels));
+    t->levels[0] = 0;
+    for (size_t i = 0, l = 1; i < t->len; i++)
+        if (name[i] == '/')
+            t->levels[l++] = i + 1;
+    atomic_init(&t->subscribers, NULL);
+    atomic_init(&t->shared, NULL);
+    atomic_init(&t->retained, NULL);
+    t->retained_prev = t->retained_next = NULL;
+    atomic_init(&t->refs, 0);
+    t->nsubscribers = 0;
+    t->nwildcards = 0;
+    atomic_init(&t->wildcards, NULL);
 }
 
-void topic_add_subscriber(struct topic *t,
-                          struct sol_client *client,
-                          unsigned qos,
-                          bool cleansession) {
-    struct subscriber *sub = malloc(sizeof(*sub));
+void topic_ref(struct topic *t) {
+    atomic_fetch_add_explicit(&t->refs, 1, memory_order_relaxed);
+}
+
+void topic_unref(struct topic *t) {
+    atomic_fetch_sub_explicit(&t->refs, 1, memory_order_relaxed);
+}
+
+/* Counter of the subscribed topics filter for the i-th hash of a topic */
+static size_t topic_filter_slot(uint32_t hash, int i) {
+    uint32_t step = (hash * 0x9e3779b1u) >> 15 | 1;
+    return (hash + i * step) & (TOPIC_FILTER_SIZE - 1);
+}
+
+/* Filter key of a topic, wildcard filters are hashed apart from names */
+static uint32_t topic_filter_key(uint32_t hash, bool wildcard) {
+    return wildcard ? hash ^ TOPIC_FILTER_WILDCARD : hash;
+}
+
+static bool topic_filter_probe(const struct sol *sol, uint32_t key) {
+    for (int i = 0; i < TOPIC_FILTER_HASHES; i++) {
+        size_t slot = topic_filter_slot(key, i);
+        if (atomic_load_explicit(&sol->subscribed[slot],
+                                 memory_order_acquire) == 0)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Counters are updated by writers only, a saturated counter is never
+ * decremented again as its real count is lost, at worst leading to false
+ * positives
+ */
+static void topic_filter_add(struct sol *sol, uint32_t key) {
+    for (int i = 0; i < TOPIC_FILTER_HASHES; i++) {
+        atomic_uchar *c = &sol->subscribed[topic_filter_slot(key, i)];
+        unsigned char count = atomic_load_explicit(c, memory_order_relaxed);
+        if (count < UCHAR_MAX)
+            atomic_store_explicit(c, count + 1, memory_order_release);
+    }
+}
+
+static void topic_filter_del(struct sol *sol, uint32_t key) {
+    for (int i = 0; i < TOPIC_FILTER_HASHES; i++) {
+        atomic_uchar *c = &sol->subscribed[topic_filter_slot(key, i)];
+        unsigned char count = atomic_load_explicit(c, memory_order_relaxed);
+        if (count > 0 && count < UCHAR_MAX)
+            atomic_store_explicit(c, count - 1, memory_order_release);
+    }
+}
+
+/* Subscriber entries, released through the epoch module */
+static struct pool subscriber_pool = POOL_INITIALIZER("subscribers",
+                                                      struct subscriber);
+
+static void subscriber_free(void *sub) {
+    memory_sub(MEMORY_SUBSCRIPTIONS, sizeof(struct subscriber));
+    pool_free(&subscriber_pool, sub);
+}
+
+/* Link a new subscriber entry in the index of its client */
+static struct subscriber *subscriber_create(struct sol_client *client,
+                                            struct topic *t,
+                                            struct share_group *g,
+                                            unsigned qos,
+                                            bool wildcard) {
+    struct subscriber *sub = pool_alloc(&subscriber_pool);
+    memory_add(MEMORY_SUBSCRIPTIONS, sizeof(*sub));
     sub->client = client;
     sub->qos = qos;
-    t->subscribers = list_push(t->subscribers, sub);
+    sub->wildcard = wildcard;
+    sub->prev = NULL;
+    atomic_init(&sub->next, NULL);
+    sub->topic = t;
+    sub->group = g;
+    topic_ref(t);
+    if (wildcard)
+        t->nwildcards++;
+    else
+        t->nsubscribers++;
+    sub->client_prev = NULL;
+    sub->client_next = client->subscribed;
+    if (client->subscribed)
+        client->subscribed->client_prev = sub;
+    client->subscribed = sub;
+    return sub;
+}
+
+/* Find the entry of a client on a topic or on a share group of the topic */
+static struct subscriber *subscriber_find(const struct sol_client *client,
+                                          const struct topic *t,
+                                          const struct share_group *g,
+                                          bool wildcard) {
+    struct subscriber *sub = client->subscribed;
+    for (; sub; sub = sub->client_next)
+        if (sub->topic == t && sub->group == g && sub->wildcard == wildcard)
+            return sub;
+    return NULL;
+}
+
+/* Topic list of a subscriber entry, the exact or the wildcard one */
+static struct subscriber *_Atomic *subscriber_list(struct subscriber *sub) {
+    return sub->wildcard ? &sub->topic->wildcards : &sub->topic->subscribers;
+}
 
-    // It must be added to the session if cleansession is false
-    if (!cleansession)
-        client->session.subscriptions =
-            list_push(client->session.subscriptions, t);
+/*
+ * Add a subscriber entry on a topic list, a new subscription on the same
+ * filter replaces the previous one. Return NULL in that case.
+ */
+static struct subscriber *topic_link_subscriber(struct topic *t,
+                                                struct sol_client *client,
+                                                unsigned qos,
+                                                bool wildcard) {
+    struct subscriber *sub = subscriber_find(client, t, NULL, wildcard);
+    if (sub) {
+        sub->qos = qos;
+        return NULL;
+    }
+    sub = subscriber_create(client, t, NULL, qos, wildcard);
+    struct subscriber *_Atomic *list = subscriber_list(sub);
+    struct subscriber *head = atomic_load_explicit(list, memory_order_relaxed);
+    atomic_store_explicit(&sub->next, head, memory_order_relaxed);
+    if (head)
+        head->prev = sub;
 
+    /* Publish the new head, readers see the subscriber fully initialized */
+    atomic_store_explicit(list, sub, memory_order_release);
+    return sub;
 }
 
-void topic_del_subscriber(struct topic *t,
+/* Subscriptions of a persistent session survive with the client itself */
+void topic_add_subscriber(struct topic *t,
                           struct sol_client *client,
-                          bool cleansession) {
-    list_remove_node(t->subscribers, client, compare_cid);
+                          unsigned qos) {
+    topic_link_subscriber(t, client, qos, false);
+}
+
+/* Unlink a subscriber from a topic list, readers on it can still move on */
+static void topic_unlink_subscriber(struct subscriber *sub) {
+    struct subscriber *next =
+        atomic_load_explicit(&sub->next, memory_order_relaxed);
+    if (sub->prev)
+        atomic_store_explicit(&sub->prev->next, next, memory_order_release);
+    else
+        atomic_store_explicit(subscriber_list(sub), next,
+                              memory_order_release);
+    if (next)
+        next->prev = sub->prev;
+}
+
+/*
+ * Share group members are stored in an immutable array, removing a member
+ * publishes a copy without it and retires the old one
+ */
+static void share_group_unlink_member(struct share_group *g,
+                                      struct subscriber *sub) {
+    struct subscriber_set *old =
+        atomic_load_explicit(&g->members, memory_order_relaxed);
+    struct subscriber_set *set =
+        malloc(sizeof(*set) + (old->len - 1) * sizeof(struct subscriber *));
+    set->len = 0;
+    for (size_t i = 0; i < old->len; i++)
+        if (old->members[i] != sub)
+            set->members[set->len++] = old->members[i];
+    atomic_store_explicit(&g->members, set, memory_order_release);
+    epoch_retire(old, free);
+}
+
+/*
+ * Remove a subscriber entry from its topic list or share group and from the
+ * index of its client, the memory is released once no reader can see it
+ */
+static void subscriber_del(struct sol *sol, struct subscriber *sub) {
+    struct topic *t = sub->topic;
+    if (sub->group)
+        share_group_unlink_member(sub->group, sub);
+    else
+        topic_unlink_subscriber(sub);
+    if (sub->client_prev)
+        sub->client_prev->client_next = sub->client_next;
+    else
+        sub->client->subscribed = sub->client_next;
+    if (sub->client_next)
+        sub->client_next->client_prev = sub->client_prev;
+    if (!sub->wildcard && --t->nsubscribers == 0)
+        topic_filter_del(sol, topic_filter_key(t->hash, false));
+    if (sub->wildcard && --t->nwildcards == 0) {
+        topic_filter_del(sol, topic_filter_key(t->hash, true));
+        atomic_fetch_sub(&sol->wildcards, 1);
+    }
+    atomic_fetch_add_explicit(&sol->generation, 1, memory_order_release);
+    topic_unref(t);
+    epoch_retire(sub, subscriber_free);
+}
+
+static struct share_group *topic_share_group(struct topic *t,
+                                             const char *name,
+                                             bool wildcard) {
+    struct share_group *g =
+        atomic_load_explicit(&t->shared, memory_order_relaxed);
+    for (; g; g = atomic_load_explicit(&g->next, memory_order_relaxed))
+        if (g->wildcard == wildcard && strcmp(g->name, name) == 0)
+            return g;
+    g = memory_alloc(MEMORY_SUBSCRIPTIONS, sizeof(*g));
+    g->name = strdup(name);
+    memory_add(MEMORY_SUBSCRIPTIONS, strlen(name) + 1);
+    g->wildcard = wildcard;
+    atomic_init(&g->members, NULL);
+    atomic_init(&g->cursor, 0);
+    atomic_init(&g->next, atomic_load(&t->shared));
+    atomic_store_explicit(&t->shared, g, memory_order_release);
+    return g;
+}
+
+/*
+ * Share group members are stored in an immutable array, adding a member
+ * publishes a new copy and retires the old one
+ */
+static void topic_link_shared_subscriber(struct topic *t,
+                                         const char *group,
+                                         struct sol_client *client,
+                                         unsigned qos,
+                                         bool wildcard) {
+    struct share_group *g = topic_share_group(t, group, wildcard);
+    struct subscriber *sub = subscriber_find(client, t, g, wildcard);
+    if (sub) {
+        sub->qos = qos;
+        return;
+    }
+    sub = subscriber_create(client, t, g, qos, wildcard);
+    struct subscriber_set *old =
+        atomic_load_explicit(&g->members, memory_order_relaxed);
+    size_t len = old ? old->len : 0;
+    struct subscriber_set *set =
+        malloc(sizeof(*set) + (len + 1) * sizeof(struct subscriber *));
+    if (old)
+        memcpy(set->members, old->members, len * sizeof(struct subscriber *));
+    set->members[len] = sub;
+    set->len = len + 1;
+    atomic_store_explicit(&g->members, set, memory_order_release);
+    if (old)
+        epoch_retire(old, free);
+}
+
+void topic_add_shared_subscriber(struct topic *t,
+                                 const char *group,
+                                 struct sol_client *client,
+                                 unsigned qos) {
+    topic_link_shared_subscriber(t, group, client, qos, false);
+}
+
+/*
+ * Round-robin first: if the member in turn has no output queued it is
+ * selected right away, otherwise a small window of following members is
+ * probed and the one with the least bytes queued wins. Probing a bounded
+ * number of members keeps the selection cost constant on large groups.
+ */
+struct subscriber *share_group_select(struct share_group *g) {
+    struct subscriber_set *set =
+        atomic_load_explicit(&g->members, memory_order_acquire);
+    if (!set || set->len == 0)
+        return NULL;
+    unsigned long start =
+        atomic_fetch_add_explicit(&g->cursor, 1, memory_order_relaxed);
+    struct subscriber *best = set->members[start % set->len];
+    ssize_t best_pending = -1;
+    for (size_t i = 0; i < SHARE_GROUP_PROBES && i < set->len; i++) {
+        struct subscriber *sub = set->members[(start + i) % set->len];
+        struct sol_client *c = sub->client;
+        pthread_mutex_lock(&c->write_lock);
+        ssize_t pending = c->fd >= 0 ? (ssize_t) c->queued : -1;
+        pthread_mutex_unlock(&c->write_lock);
+
+        /* Member offline, keeping its session, skip it */
+        if (pending >= 0 && (best_pending < 0 || pending < best_pending)) {
+            best = sub;
+            best_pending = pending;
+        }
+        if (pending == 0)
+            break;
+    }
+    return best;
+}
+
+static struct topic_table *topic_table_create(size_t size) {
+    struct topic_table *tt =
+        malloc(sizeof(*tt) + size * sizeof(struct topic *));
+    tt->size = size;
+    tt->used = 0;
+    for (size_t i = 0; i < size; i++)
+        atomic_init(&tt->slots[i], NULL);
+    return tt;
+}
+
+/* Linear probing, stop at the first empty slot */
+static struct topic *topic_table_find(struct topic_table *tt, const char *name,
+                                      size_t len, uint32_t hash) {
+    size_t mask = tt->size - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct topic *t =
+            atomic_load_explicit(&tt->slots[i], memory_order_acquire);
+        if (!t)
+            return NULL;
+        if (t != &tombstone && t->hash == hash &&
+            t->len == len && memcmp(t->name, name, len) == 0)
+            return t;
+    }
+}
+
+/* Store a topic in the first free slot, writers only */
+static void topic_table_insert(struct topic_table *tt, struct topic *t) {
+    size_t mask = tt->size - 1;
+    size_t i = t->hash & mask;
+    while (atomic_load_explicit(&tt->slots[i], memory_order_relaxed))
+        i = (i + 1) & mask;
+    atomic_store_explicit(&tt->slots[i], t, memory_order_release);
+    tt->used++;
+}
+
+/*
+ * Add a topic to the interned table, when over half of the slots are taken
+ * a new table is filled and published, dropping deleted slots as well
+ */
+static void sol_topic_intern_put(struct sol *sol, struct topic *t) {
+    struct topic_table *tt =
+        atomic_load_explicit(&sol->interned, memory_order_relaxed);
+    if ((tt->used + 1) * 2 > tt->size) {
+        size_t live = 0;
+        for (size_t i = 0; i < tt->size; i++) {
+            struct topic *cur = atomic_load(&tt->slots[i]);
+            if (cur && cur != &tombstone)
+                live++;
+        }
+        size_t size = tt->size;
+        while ((live + 1) * 4 > size)
+            size *= 2;
+        struct topic_table *new_tt = topic_table_create(size);
+        for (size_t i = 0; i < tt->size; i++) {
+            struct topic *cur = atomic_load(&tt->slots[i]);
+            if (cur && cur != &tombstone)
+                topic_table_insert(new_tt, cur);
+        }
+        atomic_store_explicit(&sol->interned, new_tt, memory_order_release);
+        epoch_retire(tt, free);
+        tt = new_tt;
+    }
+    topic_table_insert(tt, t);
+}
 
-    // TODO remomve in case of cleansession == false
+/* Replace the slot of an interned topic with a tombstone, writers only */
+static void sol_topic_intern_del(struct sol *sol, struct topic *t) {
+    struct topic_table *tt =
+        atomic_load_explicit(&sol->interned, memory_order_relaxed);
+    size_t mask = tt->size - 1;
+    for (size_t i = t->hash & mask;; i = (i + 1) & mask) {
+        struct topic *cur = atomic_load(&tt->slots[i]);
+        if (!cur)
+            return;
+        if (cur == t) {
+            atomic_store_explicit(&tt->slots[i], &tombstone,
+                                  memory_order_release);
+            return;
+        }
+    }
+}
+
+void sol_client_unsubscribe(struct sol *sol, struct sol_client *client,
+                            const char *group, const char *filter,
+                            size_t len, bool wildcard) {
+    struct subscriber *sub = client->subscribed;
+    while (sub) {
+        struct subscriber *next = sub->client_next;
+        const struct topic *t = sub->topic;
+        bool match = true;
+        if (filter) {
+            match = sub->wildcard == wildcard && t->len == len &&
+                memcmp(t->name, filter, len) == 0;
+            if (group)
+                match = match && sub->group &&
+                    strcmp(sub->group->name, group) == 0;
+            else
+                match = match && !sub->group;
+        }
+        if (match)
+            subscriber_del(sol, sub);
+        sub = next;
+    }
+}
+
+void sol_topic_subscribe(struct sol *sol, struct topic *t, const char *group,
+                         struct sol_client *client, unsigned qos,
+                         bool wildcard) {
+    unsigned nsubscribers = t->nsubscribers;
+    unsigned nwildcards = t->nwildcards;
+    if (group)
+        topic_link_shared_subscriber(t, group, client, qos, wildcard);
+    else
+        topic_link_subscriber(t, client, qos, wildcard);
+    if (nsubscribers == 0 && t->nsubscribers > 0)
+        topic_filter_add(sol, topic_filter_key(t->hash, false));
+    if (nwildcards == 0 && t->nwildcards > 0) {
+        topic_filter_add(sol, topic_filter_key(t->hash, true));
+        atomic_fetch_add(&sol->wildcards, 1);
+    }
+    atomic_fetch_add_explicit(&sol->generation, 1, memory_order_release);
+}
+
+/*
+ * The name is hashed a level at a time, FNV-1a being incremental the hash of
+ * every level prefix comes for free and is probed as a wildcard filter, only
+ * if some wildcard subscription exists at all
+ */
+bool sol_topic_subscribed(const struct sol *sol, const char *name, size_t len) {
+    len = topic_key_len(name, len);
+    if (topic_filter_probe(sol, topic_filter_key(topic_hash(name, len), false)))
+        return true;
+    if (atomic_load_explicit(&sol->wildcards, memory_order_relaxed) == 0)
+        return false;
+    uint32_t hash = FNV_OFFSET;
+    for (size_t i = 0; i <= len; i++) {
+        if (i == len || name[i] == '/')
+            if (topic_filter_probe(sol, topic_filter_key(hash, true)))
+                return true;
+        if (i < len) {
+            hash ^= (unsigned char) name[i];
+            hash *= FNV_PRIME;
+        }
+    }
+    return false;
+}
+
+static void retained_unlink(struct sol *sol, struct topic *t) {
+    if (t->retained_prev)
+        t->retained_prev->retained_next = t->retained_next;
+    else
+        sol->retained_oldest = t->retained_next;
+    if (t->retained_next)
+        t->retained_next->retained_prev = t->retained_prev;
+    else
+        sol->retained_newest = t->retained_prev;
+    t->retained_prev = t->retained_next = NULL;
+}
+
+static void retained_append(struct sol *sol, struct topic *t) {
+    t->retained_prev = sol->retained_newest;
+    t->retained_next = NULL;
+    if (sol->retained_newest)
+        sol->retained_newest->retained_next = t;
+    else
+        sol->retained_oldest = t;
+    sol->retained_newest = t;
+}
+
+/*
+ * Swap the retained message of a topic, keeping the eviction order, must be
+ * called holding the retained lock. Return the size of the replaced message.
+ */
+static size_t retained_swap(struct sol *sol, struct topic *t,
+                            struct message *m) {
+    struct message *old = atomic_exchange(&t->retained, m);
+    if (old)
+        retained_unlink(sol, t);
+    if (m)
+        retained_append(sol, t);
+    if (m && !old)
+        topic_ref(t);
+    else if (!m && old)
+        topic_unref(t);
+    if (!old)
+        return 0;
+    size_t size = message_size(old);
+    memory_sub(MEMORY_RETAINED, size);
+    epoch_retire(old, retained_release);
+    return size;
+}
+
+/*
+ * Readers deliver the retained message on subscription taking a reference on
+ * it inside an epoch section, so the reference held by the store on the
+ * replaced message is dropped only after the grace period.
+ */
+bool sol_topic_retain(struct sol *sol, struct topic *t, struct message *m) {
+    size_t size = m ? message_size(m) : 0;
+    pthread_mutex_lock(&sol->retained_lock);
+
+    /* The message replaced on the topic makes room for the new one */
+    struct message *old = atomic_load(&t->retained);
+    size_t replaced = old ? message_size(old) : 0;
+    if (size > replaced && memory_category_used(MEMORY_RETAINED) +
+        size - replaced > conf->max_retained_memory) {
+        pthread_mutex_unlock(&sol->retained_lock);
+        return false;
+    }
+    if (m) {
+        message_ref(m);
+        memory_add(MEMORY_RETAINED, size);
+    }
+    retained_swap(sol, t, m);
+    pthread_mutex_unlock(&sol->retained_lock);
+    return true;
+}
+
+size_t sol_retained_evict(struct sol *sol, size_t bytes,
+                          void (*func)(struct topic *, void *), void *arg) {
+    size_t released = 0;
+    pthread_mutex_lock(&sol->retained_lock);
+    while (released < bytes && sol->retained_oldest) {
+        struct topic *t = sol->retained_oldest;
+        if (func)
+            func(t, arg);
+        released += retained_swap(sol, t, NULL);
+    }
+    pthread_mutex_unlock(&sol->retained_lock);
+    return released;
+}
+
+void sol_retained_map(struct sol *sol,
+                      void (*func)(struct topic *, struct message *, void *),
+                      void *arg) {
+    pthread_mutex_lock(&sol->retained_lock);
+    for (struct topic *t = sol->retained_oldest; t; t = t->retained_next)
+        func(t, atomic_load(&t->retained), arg);
+    pthread_mutex_unlock(&sol->retained_lock);
+}
+
+/* Memory taken by a topic, excluding the nodes of the topic tree */
+static size_t topic_size(struct topic *t) {
+    return sizeof(*t) + t->len + 2 + t->nlevels * sizeof(*t->levels);
+}
+
+/* Memory taken by the share groups of a topic */
+static size_t topic_groups_size(struct topic *t) {
+    size_t size = 0;
+    struct share_group *g =
+        atomic_load_explicit(&t->shared, memory_order_relaxed);
+    for (; g; g = atomic_load_explicit(&g->next, memory_order_relaxed))
+        size += sizeof(*g) + strlen(g->name) + 1;
+    return size;
+}
+
+/*
+ * Retire the memory owned by a deleted topic, the topic structure itself is
+ * retired by the topic tree. An unreferenced topic has no subscribers nor
+ * retained message, just the share groups left empty by their members.
+ */
+static void topic_retire(struct topic *t) {
+    struct share_group *g =
+        atomic_load_explicit(&t->shared, memory_order_relaxed);
+    while (g) {
+        struct share_group *next =
+            atomic_load_explicit(&g->next, memory_order_relaxed);
+        epoch_retire((void *) g->name, free);
+        epoch_retire(atomic_load(&g->members), free);
+        epoch_retire(g, free);
+        g = next;
+    }
+    epoch_retire(t->levels, free);
+    epoch_retire((void *) t->name, free);
+}
+
+/*
+ * Topics are created on every publish on a new name, the collector visits the
+ * interned table a few slots at a time, so the work done on each loop
+ * iteration is bounded regardless of the number of topics.
+ */
+size_t sol_topic_gc(struct sol *sol, size_t slots) {
+    size_t reclaimed = 0;
+    pthread_mutex_lock(&sol->lock);
+    struct topic_table *tt =
+        atomic_load_explicit(&sol->interned, memory_order_relaxed);
+    for (size_t n = 0; n < slots && n < tt->size; n++) {
+        size_t i = sol->gc_cursor++ & (tt->size - 1);
+        struct topic *t = atomic_load_explicit(&tt->slots[i],
+                                               memory_order_relaxed);
+        if (!t || t == &tombstone || atomic_load(&t->refs) > 0)
+            continue;
+        size_t groups = topic_groups_size(t);
+        memory_sub(MEMORY_TOPICS, topic_size(t));
+        memory_sub(MEMORY_SUBSCRIPTIONS, groups);
+        reclaimed += topic_size(t) + groups;
+        sol_topic_intern_del(sol, t);
+        trie_delete(&sol->topics, t->name);
+        topic_retire(t);
+        atomic_fetch_add_explicit(topic_generation(sol, t->hash), 1,
+                                  memory_order_release);
+    }
+    pthread_mutex_unlock(&sol->lock);
+    return reclaimed;
+}
+
+/* The registry doesn't own the clients, entries are just unlinked */
+static int client_entry_unlink(struct hashtable_entry *entry) {
+    (void) entry;
+    return HASHTABLE_OK;
+}
+
+static void client_registry_init(struct client_registry *reg) {
+    atomic_init(&reg->size, 0);
+    for (int i = 0; i < CLIENT_STRIPES; i++) {
+        pthread_rwlock_init(&reg->stripes[i].lock, NULL);
+        reg->stripes[i].clients = hashtable_create(client_entry_unlink);
+    }
+}
+
+static struct client_stripe *client_stripe(struct sol *sol, uint32_t hash) {
+    return &sol->clients.stripes[hash & (CLIENT_STRIPES - 1)];
+}
+
+struct sol_client *sol_client_get(struct sol *sol, const char *id) {
+    struct client_stripe *stripe =
+        client_stripe(sol, topic_hash(id, strlen(id)));
+    pthread_rwlock_rdlock(&stripe->lock);
+    struct sol_client *client = hashtable_get(stripe->clients, id);
+    pthread_rwlock_unlock(&stripe->lock);
+    return client;
+}
+
+/*
+ * Lookup and replacement happen under the write lock of the stripe, two
+ * connections racing with the same id see each other, the last one wins
+ * and gets the first one back to close it
+ */
+struct sol_client *sol_client_takeover(struct sol *sol,
+                                       struct sol_client *client) {
+    client->id_hash = topic_hash(client->client_id, strlen(client->client_id));
+    struct client_stripe *stripe = client_stripe(sol, client->id_hash);
+    pthread_rwlock_wrlock(&stripe->lock);
+    struct sol_client *old = hashtable_get(stripe->clients, client->client_id);
+    hashtable_put(stripe->clients, client->client_id, client);
+    pthread_rwlock_unlock(&stripe->lock);
+    if (!old)
+        atomic_fetch_add(&sol->clients.size, 1);
+    return old;
+}
+
+bool sol_client_remove(struct sol *sol, struct sol_client *client) {
+    struct client_stripe *stripe = client_stripe(sol, client->id_hash);
+    pthread_rwlock_wrlock(&stripe->lock);
+    bool removed = hashtable_get(stripe->clients, client->client_id) == client;
+    if (removed)
+        hashtable_del(stripe->clients, client->client_id);
+    pthread_rwlock_unlock(&stripe->lock);
+    if (removed)
+        atomic_fetch_sub(&sol->clients.size, 1);
+    return removed;
+}
+
+/* Function pointers can't be passed as void *, wrap them */
+struct client_clear {
+    void (*func)(struct sol_client *);
+};
+
+static int client_clear_entry(struct hashtable_entry *entry, void *arg) {
+    ((struct client_clear *) arg)->func(entry->val);
+    return HASHTABLE_OK;
+}
+
+void sol_client_clear(struct sol *sol, void (*func)(struct sol_client *)) {
+    struct client_clear arg = { func };
+    for (int i = 0; i < CLIENT_STRIPES; i++) {
+        struct client_stripe *stripe = &sol->clients.stripes[i];
+        pthread_rwlock_wrlock(&stripe->lock);
+        hashtable_map2(stripe->clients, client_clear_entry, &arg);
+        hashtable_release(stripe->clients);
+        stripe->clients = hashtable_create(client_entry_unlink);
+        pthread_rwlock_unlock(&stripe->lock);
+    }
+    atomic_store(&sol->clients.size, 0);
+}
+
+struct client_map {
+    void (*func)(struct sol_client *, void *);
+    void *arg;
+};
+
+static int client_map_entry(struct hashtable_entry *entry, void *arg) {
+    struct client_map *map = arg;
+    map->func(entry->val, map->arg);
+    return HASHTABLE_OK;
+}
+
+void sol_client_map(struct sol *sol,
+                    void (*func)(struct sol_client *, void *), void *arg) {
+    struct client_map map = { func, arg };
+    for (int i = 0; i < CLIENT_STRIPES; i++) {
+        struct client_stripe *stripe = &sol->clients.stripes[i];
+        pthread_rwlock_rdlock(&stripe->lock);
+        hashtable_map2(stripe->clients, client_map_entry, &map);
+        pthread_rwlock_unlock(&stripe->lock);
+    }
+}
+
+void sol_init(struct sol *sol) {
+    trie_init(&sol->topics);
+    sol->topics.retire = epoch_retire;
+    atomic_init(&sol->interned, topic_table_create(TOPIC_TABLE_INITIAL_SIZE));
+    sol->retained_oldest = sol->retained_newest = NULL;
+    pthread_mutex_init(&sol->retained_lock, NULL);
+    sol->gc_cursor = 0;
+    sol->subscribed = calloc(TOPIC_FILTER_SIZE, sizeof(*sol->subscribed));
+    atomic_init(&sol->wildcards, 0);
+    atomic_init(&sol->generation, 0);
+    sol->topic_generations =
+        malloc(TOPIC_GENERATIONS * sizeof(*sol->topic_generations));
+    for (size_t i = 0; i < TOPIC_GENERATIONS; i++)
+        atomic_init(&sol->topic_generations[i], 0);
+    sol->matches = malloc(MATCH_CACHE_SIZE * sizeof(*sol->matches));
+    for (size_t i = 0; i < MATCH_CACHE_SIZE; i++)
+        atomic_init(&sol->matches[i], NULL);
+    pthread_mutex_init(&sol->lock, NULL);
+    client_registry_init(&sol->clients);
 }
 
 void sol_topic_put(struct sol *sol, struct topic *t) {
     trie_insert(&sol->topics, t->name, t);
+    sol_topic_intern_put(sol, t);
+    memory_add(MEMORY_TOPICS, topic_size(t));
 }
 
 void sol_topic_del(struct sol *sol, const char *name) {
+    struct topic *t = sol_topic_lookup(sol, name, strlen(name));
+    if (t) {
+        sol_topic_intern_del(sol, t);
+        memory_sub(MEMORY_TOPICS, topic_size(t));
+    }
     trie_delete(&sol->topics, name);
 }
 
@@ -54,4 +949,212 @@ struct topic *sol_topic_get(struct sol *sol, const char *name) {
     struct topic *ret_topic;
     trie_find(&sol->topics, name, (void *) &ret_topic);
     return ret_topic;
-}
\ No newline at end of file
+}
+
+struct topic *sol_topic_lookup(struct sol *sol, const char *name, size_t len) {
+    len = topic_key_len(name, len);
+    struct topic_table *tt =
+        atomic_load_explicit(&sol->interned, memory_order_acquire);
+    return topic_table_find(tt, name, len, topic_hash(name, len));
+}
+
+struct topic *sol_topic_intern(struct sol *sol, const char *name, size_t len) {
+    struct topic *t = sol_topic_lookup(sol, name, len);
+    if (t)
+        return t;
+    pthread_mutex_lock(&sol->lock);
+
+    /* Check again, another writer could have created it in the meanwhile */
+    t = sol_topic_lookup(sol, name, len);
+    if (!t) {
+
+        /* Canonical names on the topic tree always end with a '/' */
+        len = topic_key_len(name, len);
+        char *canonical = malloc(len + 2);
+        memcpy(canonical, name, len);
+        canonical[len] = '/';
+        canonical[len + 1] = '\0';
+        t = topic_create(canonical);
+        sol_topic_put(sol, t);
+    }
+    pthread_mutex_unlock(&sol->lock);
+    return t;
+}
+
+/* Growable array of candidates to a match set */
+struct match_candidates {
+    size_t len;
+    size_t capacity;
+    void **items;
+};
+
+static void match_candidates_push(struct match_candidates *c, void *item) {
+    if (c->len == c->capacity) {
+        c->capacity = c->capacity ? c->capacity * 2 : 16;
+        c->items = realloc(c->items, c->capacity * sizeof(void *));
+    }
+    c->items[c->len++] = item;
+}
+
+/* Collect subscribers and share groups of a topic, exact or wildcard ones */
+static void match_collect(struct topic *t, bool wildcard,
+                          struct match_candidates *subs,
+                          struct match_candidates *groups) {
+    struct subscriber *sub =
+        atomic_load_explicit(wildcard ? &t->wildcards : &t->subscribers,
+                             memory_order_acquire);
+    for (; sub; sub = atomic_load_explicit(&sub->next, memory_order_acquire))
+        match_candidates_push(subs, sub);
+    struct share_group *g =
+        atomic_load_explicit(&t->shared, memory_order_acquire);
+    for (; g; g = atomic_load_explicit(&g->next, memory_order_acquire))
+        if (g->wildcard == wildcard)
+            match_candidates_push(groups, g);
+}
+
+/* Fan-out shards of match sets, a single one if there's no worker */
+static size_t fanout_shards(void) {
+    return conf->fanout_workers > 0 ? (size_t) conf->fanout_workers : 1;
+}
+
+size_t sol_client_shard(const struct sol_client *client) {
+    return client->id_hash % fanout_shards();
+}
+
+/* Order subscribers by shard, then by client, the highest QoS first */
+static int subscriber_cmp(const void *a, const void *b) {
+    const struct subscriber *sa = *(struct subscriber *const *) a;
+    const struct subscriber *sb = *(struct subscriber *const *) b;
+    size_t sha = sol_client_shard(sa->client);
+    size_t shb = sol_client_shard(sb->client);
+    if (sha != shb)
+        return sha < shb ? -1 : 1;
+    uintptr_t ca = (uintptr_t) sa->client;
+    uintptr_t cb = (uintptr_t) sb->client;
+    if (ca != cb)
+        return ca < cb ? -1 : 1;
+    return (int) sb->qos - (int) sa->qos;
+}
+
+/*
+ * Resolve the subscribers of a topic walking its own subscriptions and the
+ * wildcard ones on every level prefix of its name, a client subscribed by
+ * more than one filter is kept once with the highest QoS requested, then
+ * split by fan-out shard
+ */
+static struct match_set *match_resolve(struct sol *sol, struct topic *t,
+                                       unsigned long generation) {
+    struct match_candidates subs = { 0, 0, NULL };
+    struct match_candidates groups = { 0, 0, NULL };
+    match_collect(t, false, &subs, &groups);
+    if (atomic_load_explicit(&sol->wildcards, memory_order_relaxed) > 0) {
+        for (size_t i = 1; i <= t->len; i++) {
+            if (i < t->len && t->name[i] != '/')
+                continue;
+            struct topic *prefix = sol_topic_lookup(sol, t->name, i);
+            if (prefix)
+                match_collect(prefix, true, &subs, &groups);
+        }
+    }
+    if (subs.len > 1)
+        qsort(subs.items, subs.len, sizeof(void *), subscriber_cmp);
+    size_t nshards = fanout_shards();
+    struct match_set *set = malloc(sizeof(*set) +
+                                   (nshards + 1) * sizeof(size_t) +
+                                   (subs.len + groups.len) * sizeof(void *));
+    set->topic = t;
+    set->generation = generation;
+    set->nshards = nshards;
+    set->shards = (size_t *) (set + 1);
+    set->subscribers = (struct subscriber **) (set->shards + nshards + 1);
+    set->groups = (struct share_group **) (set->subscribers + subs.len);
+    set->nsubscribers = 0;
+    size_t shard = 0;
+    set->shards[0] = 0;
+    for (size_t i = 0; i < subs.len; i++) {
+        struct subscriber *sub = subs.items[i];
+        if (set->nsubscribers > 0 &&
+            set->subscribers[set->nsubscribers - 1]->client == sub->client)
+            continue;
+        while (shard < sol_client_shard(sub->client))
+            set->shards[++shard] = set->nsubscribers;
+        set->subscribers[set->nsubscribers++] = sub;
+    }
+    while (shard < nshards)
+        set->shards[++shard] = set->nsubscribers;
+    set->ngroups = groups.len;
+    for (size_t i = 0; i < groups.len; i++)
+        set->groups[i] = groups.items[i];
+    free(subs.items);
+    free(groups.items);
+    topic_ref(t);
+    return set;
+}
+
+/* Release a match set retired from the cache, unpinning its topic */
+static void match_set_free(void *ptr) {
+    struct match_set *set = ptr;
+    topic_unref(set->topic);
+    free(set);
+}
+
+/*
+ * Each cached set pins its topic, so a topic can't be collected and its
+ * address reused while a set refers to it. Hot topics with a stable set of
+ * subscribers are resolved once per generation.
+ */
+const struct match_set *sol_topic_match(struct sol *sol, struct topic *t) {
+    unsigned long generation =
+        atomic_load_explicit(&sol->generation, memory_order_acquire);
+    struct match_set *_Atomic *slot =
+        &sol->matches[t->hash & (MATCH_CACHE_SIZE - 1)];
+    struct match_set *set = atomic_load_explicit(slot, memory_order_acquire);
+    if (set && set->topic == t && set->generation == generation)
+        return set;
+    set = match_resolve(sol, t, generation);
+    struct match_set *old = atomic_exchange(slot, set);
+    if (old)
+        epoch_retire(old, match_set_free);
+    return set;
+}
+
+void sol_match_invalidate(struct sol *sol) {
+    atomic_fetch_add_explicit(&sol->generation, 1, memory_order_release);
+}
+
+/*
+ * A deleted topic is retired through the epoch module, if the generation of
+ * its slot still matches the one of the hint the topic is alive till the end
+ * of the epoch section of the caller, and so are its name bytes
+ */
+struct topic *topic_hint_find(const struct sol *sol, struct topic_hint *hints,
+                              const char *name, size_t len) {
+    len = topic_key_len(name, len);
+    for (int i = 0; i < TOPIC_HINTS; i++) {
+        struct topic *t = hints[i].topic;
+        if (!t || hints[i].generation !=
+            atomic_load_explicit(topic_generation(sol, hints[i].hash),
+                                 memory_order_acquire) ||
+            t->len != len || memcmp(t->name, name, len) != 0)
+            continue;
+
+        /* Move the hint in front, devices mostly alternate between few */
+        if (i > 0) {
+            struct topic_hint hint = hints[i];
+            memmove(&hints[1], &hints[0], i * sizeof(*hints));
+            hints[0] = hint;
+        }
+        return t;
+    }
+    return NULL;
+}
+
+void topic_hint_store(const struct sol *sol, struct topic_hint *hints,
+                      struct topic *t) {
+    memmove(&hints[1], &hints[0], (TOPIC_HINTS - 1) * sizeof(*hints));
+    hints[0].topic = t;
+    hints[0].hash = t->hash;
+    hints[0].generation =
+        atomic_load_explicit(topic_generation(sol, t->hash),
+                             memory_order_acquire);
+}
@@ -1,53 +1,469 @@
 #ifndef CORE_H
 #define CORE_H
 
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "trie.h"
 #include "list.h"
 #include "hashtable.h"
 
+/* Prefix of shared subscription filters, $share/<group>/<filter> */
+#define SHARE_PREFIX        "$share/"
+#define SHARE_PREFIX_LEN    7
+
+/* Interned table slots visited by every step of the topic collector */
+#define TOPIC_GC_STEP       32
+
+/* Counters of the subscribed topics filter, a power of 2, and hashes used */
+#define TOPIC_FILTER_SIZE   (1 << 16)
+#define TOPIC_FILTER_HASHES 3
+
+/* Seed separating wildcard filters from topic names in the filter */
+#define TOPIC_FILTER_WILDCARD 0x9747b28cu
+
+/* Slots of the publish match cache, a power of 2 */
+#define MATCH_CACHE_SIZE    1024
+
+/* Last topics published by a client, checked before any lookup */
+#define TOPIC_HINTS         2
+
+/* Generations of the topic hints, by topic hash, a power of 2 */
+#define TOPIC_GENERATIONS   1024
+
+/* Client ids stored inline in struct sol_client, longer ones are allocated */
+#define CLIENT_ID_INLINE    24
+
+/* Stripes of the client registry, a power of 2 */
+#define CLIENT_STRIPES      64
+
+/*
+ * Reference counted application message, the payload is taken over from the
+ * received packet and shared by reference by every holder, e.g. the retained
+ * store, without copies
+ */
+struct message {
+    atomic_uint refs;
+    unsigned char qos;
+    /* Id of the write-ahead log record of the message, 0 if not logged */
+    uint64_t id;
+    size_t payloadlen;
+    unsigned char *payload;
+};
+
+/*
+ * Topic lists are RCU-like: publishers walk them without locks inside an
+ * epoch_enter/epoch_exit section, while writers (subscribe and unsubscribe)
+ * serialize on the `lock` of struct sol, link fully initialized nodes with a
+ * release store and retire unlinked ones through the epoch module.
+ */
 struct topic {
     const char *name;
-    List *subscribers;
+    /* Length of the name, not counting the trailing '/' if present */
+    size_t len;
+    /* Precomputed hash of the name, key on the interned topics table */
+    uint32_t hash;
+    /* Number of levels of the name and offset of the start of each one */
+    unsigned short nlevels;
+    unsigned short *levels;
+    struct subscriber *_Atomic subscribers;
+    /*
+     * Subscribers of the <name>/# filter, matched at publish time against
+     * every level prefix of the published topic, so topics created after the
+     * subscription are covered as well
+     */
+    struct subscriber *_Atomic wildcards;
+    /* Shared subscription groups ($share/<group>/<filter>) on the topic */
+    struct share_group *_Atomic shared;
+    /* Last retained message published on the topic, if any */
+    struct message *_Atomic retained;
+    /* Topics with a retained message, oldest first, for eviction */
+    struct topic *retained_prev;
+    struct topic *retained_next;
+    /*
+     * Subscriber entries and retained message referencing the topic, once
+     * it drops to 0 the topic can be collected
+     */
+    atomic_uint refs;
+    /* Subscriber entries, plain and shared ones, writers only */
+    unsigned nsubscribers;
+    unsigned nwildcards;
+};
+
+/*
+ * Interned topics, open addressing table mapping each distinct topic name to
+ * its canonical struct topic. Readers probe it lock-free, writers replace the
+ * whole table when it needs to grow.
+ */
+struct topic_table {
+    size_t size;
+    /* Slots in use, counting deleted ones as well */
+    size_t used;
+    struct topic *_Atomic slots[];
+};
+
+/*
+ * Connected clients by client id, split in stripes by the hash of the id,
+ * each one with its own table and lock. Connects and disconnects of different
+ * clients rarely contend, lookups take just the read side of a single stripe.
+ */
+struct client_stripe {
+    pthread_rwlock_t lock;
+    HashTable *clients;
+};
+
+struct client_registry {
+    atomic_size_t size;
+    struct client_stripe stripes[CLIENT_STRIPES];
 };
 
 /*
  * Main structure, a global instance will be instantiated at start, tracking
- * topics, connected clients and registered closures.
+ * topics, connected clients and registered closures. Topic tree writers must
+ * hold `lock`, readers just need to be inside an epoch section.
  */
 struct sol {
-    HashTable *clients;
-    HashTable *closures;
+    struct client_registry clients;
     Trie topics;
+    struct topic_table *_Atomic interned;
+    /*
+     * Topics holding a retained message, in the order their message was
+     * retained, the oldest ones are evicted first over max_memory
+     */
+    struct topic *retained_oldest;
+    struct topic *retained_newest;
+    pthread_mutex_t retained_lock;
+    /* Next slot of the interned table to be visited by the collector */
+    size_t gc_cursor;
+    /*
+     * Counting Bloom filter of the subscribed topics and of the prefixes of
+     * wildcard filters, probing the name of a topic and its level prefixes
+     * tells whether a publish can be dropped
+     */
+    atomic_uchar *subscribed;
+    /* Topics with wildcard subscribers, level prefixes are probed if any */
+    atomic_uint wildcards;
+    /* Bumped on every subscription change, invalidates the match cache */
+    atomic_ulong generation;
+    /*
+     * Bumped on the deletion of a topic, at the slot of its hash, invalidates
+     * the topic hints of the topics in the same slot only
+     */
+    atomic_ulong *topic_generations;
+    /* Direct mapped cache of match sets, indexed by topic hash */
+    struct match_set *_Atomic *matches;
+    pthread_mutex_t lock;
 };
 
+/* QoS 1 or 2 message waiting in the queue of a session */
+struct queued_message {
+    struct message *msg;
+    struct topic *topic;
+    unsigned char qos;
+};
+
+/*
+ * State of a client asking for a persistent session, the client stays in the
+ * registry with its subscriptions and inflight window after a disconnection
+ * and gets them back on reconnect. QoS 1 and 2 messages which can't be sent
+ * right away, the client being offline or its inflight window full, wait on
+ * a ring till they can enter the window, bounded by max_queued_messages and
+ * max_queued_bytes. Messages and topics are held by reference.
+ */
 struct session {
-    List *subscriptions;
-    // TODO add pending confirmed messages
+    /* Ring of queued messages, allocated and grown on demand */
+    struct queued_message *queue;
+    /* Slot of the oldest message, messages queued and slots of the ring */
+    size_t head;
+    size_t len;
+    size_t capacity;
+    /* Payload bytes of the messages queued */
+    size_t bytes;
+};
+
+/*
+ * Topic a client published to, valid as long as the generation of the slot
+ * of its hash didn't change since it was stored. The hash is kept aside, the
+ * topic can't be read before the hint is known to be valid.
+ */
+struct topic_hint {
+    struct topic *topic;
+    uint32_t hash;
+    unsigned long generation;
 };
 
 /*
  * Wrapper structure around a connected client, each client can be a publisher
  * or a subscriber, it can be used to track sessions too.
+ *
+ * Most clients are idle devices pinging once in a while, the structure holds
+ * just what every connection needs, the rest is allocated on first use: the
+ * session only for clients asking for a persistent one, the topic hints on
+ * the first publish, released again once the client goes idle, the inflight
+ * window on the first QoS 1 or 2 message sent to it.
  */
 struct sol_client {
     char *client_id;
+    /* Storage of short client ids, the MQTT v3.1.1 limit being 23 bytes */
+    char id_buf[CLIENT_ID_INLINE];
+    /* Hash of the client id, set once registered, fixes its fan-out shard */
+    uint32_t id_hash;
     int fd;
-    struct session session;
+    /* Set on every packet received, cleared by the idle sweep */
+    bool active;
+    /* Handle of the connection of the client on the closure table */
+    uint64_t conn;
+    /* Persistent session, NULL for clean session clients */
+    struct session *session;
+    /* Every subscriber entry of the client, linked through `client_next` */
+    struct subscriber *subscribed;
+    /* TOPIC_HINTS most recently used topics first, NULL till a publish */
+    struct topic_hint *hints;
+    /* Outbound QoS 1 and 2 publishes, NULL till the first one */
+    struct inflight *inflight;
+    /* Inbound QoS 2 publishes waiting for their PUBREL, a bitmap of ids */
+    uint64_t *pubrec_ids;
+    /* Output queued to the socket, NULL till the first write */
+    struct reply *out;
+    /* Bytes of the output queue not written yet, under the write lock */
+    size_t queued;
+    /*
+     * Serializes writes on the socket and on the output queue between the
+     * event loop and the fan-out workers, a closed connection has its fd set
+     * to -1 under the lock
+     */
+    pthread_mutex_t write_lock;
 };
 
+/*
+ * Subscriber of a topic, linked in the topic list, readers only ever follow
+ * `next` while `prev` is reserved to writers for O(1) unlinking.
+ *
+ * Each entry is also linked in the index of its client together with the
+ * topic and the share group it belongs to, unsubscribing and disconnecting
+ * remove entries without scanning topics.
+ */
 struct subscriber {
     unsigned qos;
+    bool wildcard;
     struct sol_client *client;
+    struct subscriber *_Atomic next;
+    struct subscriber *prev;
+    struct topic *topic;
+    struct share_group *group;
+    struct subscriber *client_next;
+    struct subscriber *client_prev;
 };
 
+/*
+ * Subscribers a publish on a topic is delivered to, resolved from the exact
+ * and the wildcard subscriptions matching it: a single entry per client, the
+ * one with the highest QoS, and every share group to select a member from.
+ * Valid as long as the generation of the broker doesn't change.
+ *
+ * Subscribers are grouped by fan-out shard, the ones of shard i are in the
+ * range [shards[i], shards[i + 1]) of the array.
+ */
+struct match_set {
+    struct topic *topic;
+    unsigned long generation;
+    size_t nsubscribers;
+    size_t ngroups;
+    size_t nshards;
+    struct subscriber **subscribers;
+    struct share_group **groups;
+    size_t *shards;
+};
+
+/* Immutable array of subscribers, replaced as a whole on every change */
+struct subscriber_set {
+    size_t len;
+    struct subscriber *members[];
+};
+
+/*
+ * Shared subscription group, every message published on the topic is
+ * delivered to just one member of the group instead of all of them. Members
+ * are selected in round-robin order, falling back to the one with the least
+ * outstanding bytes when the next in turn is lagging behind.
+ */
+struct share_group {
+    const char *name;
+    /* Group subscribed to <topic>/# rather than to the topic alone */
+    bool wildcard;
+    struct subscriber_set *_Atomic members;
+    /* Round-robin counter, the next member to be probed */
+    atomic_ulong cursor;
+    struct share_group *_Atomic next;
+};
+
+/* Create a message taking ownership of the payload, with 1 reference */
+struct message *message_create(unsigned char, size_t, unsigned char *);
+struct message *message_ref(struct message *);
+
+/* Drop a reference, the message and its payload are freed on the last one */
+void message_release(struct message *);
+
+/* Memory accounted for a message */
+size_t message_size(const struct message *);
+
+/* Create an empty session, accounted to MEMORY_CLIENTS */
+struct session *session_create(void);
+
+/* Release a session and every message still queued */
+void session_free(struct session *);
+
+/*
+ * Queue a message to a session, referencing message and topic, a full queue
+ * drops its oldest messages or the new one according to queue_drop_policy.
+ * Return the number of messages dropped.
+ */
+size_t session_enqueue(struct session *, struct message *, struct topic *,
+                       unsigned char);
+
+/* Oldest message queued, NULL if empty */
+struct queued_message *session_peek(struct session *);
+
+/* Remove the oldest message from the queue, releasing its references */
+void session_dequeue(struct session *);
+
+/* Remove the message with the given id from the queue, false if not found */
+bool session_remove(struct session *, uint64_t);
+
+/* Call a function on every message queued, oldest first */
+void session_map(struct session *,
+                 void (*)(struct queued_message *, void *), void *);
+
 struct topic *topic_create(const char *);
+
+/* Pin a topic, a referenced topic is never collected */
+void topic_ref(struct topic *);
+void topic_unref(struct topic *);
 void topic_init(struct topic *, const char *);
-void topic_add_subscriber(struct topic *, struct sol_client *, unsigned, bool);
-void topic_del_subscriber(struct topic *, struct sol_client *, bool);
+void topic_add_subscriber(struct topic *, struct sol_client *, unsigned);
+void topic_add_shared_subscriber(struct topic *, const char *,
+                                 struct sol_client *, unsigned);
+
+/* Return the connected client with the given id, or NULL */
+struct sol_client *sol_client_get(struct sol *, const char *);
+
+/*
+ * Register a connected client, atomically replacing the client already
+ * connected with the same id, if any. The replaced client is returned, its
+ * connection must be closed by the caller.
+ */
+struct sol_client *sol_client_takeover(struct sol *, struct sol_client *);
+
+/*
+ * Remove a client from the registry, unless another client took over its id
+ * in the meanwhile. Return true if removed.
+ */
+bool sol_client_remove(struct sol *, struct sol_client *);
+
+/* Remove every client from the registry, calling a function on each one */
+void sol_client_clear(struct sol *, void (*)(struct sol_client *));
+
+/*
+ * Call a function on every client of the registry, holding the lock of its
+ * stripe for reading
+ */
+void sol_client_map(struct sol *, void (*)(struct sol_client *, void *),
+                    void *);
+
+/* Fan-out shard of a client, every write to it happens on the same shard */
+size_t sol_client_shard(const struct sol_client *);
+
+/* Select the member of a share group that will receive the next message */
+struct subscriber *share_group_select(struct share_group *);
+
+/*
+ * Remove the subscriptions of a client matching a filter, a topic name or
+ * the <name>/# filter if wildcard is set, restricted to the share group if
+ * one is given. A NULL filter removes every subscription of the client.
+ */
+void sol_client_unsubscribe(struct sol *, struct sol_client *, const char *,
+                            const char *, size_t, bool);
+
+/*
+ * Subscribe a client to a topic, or to the topic and all its subtopics if
+ * wildcard is set, as a plain subscriber or as a member of the share group if
+ * one is given, keeping the subscribed topics filter updated
+ */
+void sol_topic_subscribe(struct sol *, struct topic *, const char *,
+                         struct sol_client *, unsigned, bool);
+
+/*
+ * Probe the subscribed topics filter with a topic name, false means that no
+ * client is subscribed to it, true that some client could be
+ */
+bool sol_topic_subscribed(const struct sol *, const char *, size_t);
+
+/*
+ * Replace the retained message of a topic, a NULL message clears it. Return
+ * false if the retained store has no room left for the message.
+ */
+bool sol_topic_retain(struct sol *, struct topic *, struct message *);
+
+/*
+ * Clear the oldest retained messages till at least the given number of bytes
+ * is released, calling a function, if any, on each topic cleared while
+ * holding the retained lock. Return the bytes released.
+ */
+size_t sol_retained_evict(struct sol *, size_t,
+                          void (*)(struct topic *, void *), void *);
+
+/*
+ * Call a function on every topic with a retained message, oldest first,
+ * holding the retained lock
+ */
+void sol_retained_map(struct sol *,
+                      void (*)(struct topic *, struct message *, void *),
+                      void *);
+
+/*
+ * Visit a bounded number of slots of the interned table, deleting topics with
+ * no references left. Return the bytes reclaimed.
+ */
+size_t sol_topic_gc(struct sol *, size_t);
+
+void sol_init(struct sol *);
 void sol_topic_put(struct sol *, struct topic *);
 void sol_topic_del(struct sol *, const char *);
 
 /* Find a topic by name and return it */
 struct topic *sol_topic_get(struct sol *, const char *);
 
+/*
+ * Find the interned topic of a name with a single hashed lookup on the raw
+ * bytes, a trailing '/' is not significant. Return NULL if not found.
+ */
+struct topic *sol_topic_lookup(struct sol *, const char *, size_t);
+
+/*
+ * Return the interned topic of a name like sol_topic_lookup, creating and
+ * storing it under the writer lock on the first use
+ */
+struct topic *sol_topic_intern(struct sol *, const char *, size_t);
+
+/*
+ * Return the match set of a topic from the cache, resolving it again if the
+ * subscriptions changed since it was cached. The set is valid till the end
+ * of the epoch section of the caller.
+ */
+const struct match_set *sol_topic_match(struct sol *, struct topic *);
+
+/* Resolve every match set again, e.g. once a client moved to a new connection */
+void sol_match_invalidate(struct sol *);
+
+/*
+ * Check the topic hints of a client against a topic name with a plain byte
+ * comparison, return the topic if found and still valid or NULL. Must be
+ * called inside an epoch section.
+ */
+struct topic *topic_hint_find(const struct sol *, struct topic_hint *,
+                              const char *, size_t);
+
+/* Store a topic as the most recent hint, tagged with its generation */
+void topic_hint_store(const struct sol *, struct topic_hint *, struct topic *);
+
 #endif
\ No newline at end of file
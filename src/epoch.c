@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "epoch.h"
+
+/* Per-thread reader state, the epoch observed on the last epoch_enter */
+struct epoch_slot {
+    atomic_ulong epoch;
+    atomic_bool active;
+};
+
+/* Retired pointer, waiting for the grace period to expire */
+struct retired {
+    void *ptr;
+    void (*release)(void *);
+    struct retired *next;
+};
+
+static struct epoch_slot slots[EPOCH_MAX_THREADS];
+
+static atomic_int nslots;
+
+static atomic_ulong global_epoch;
+
+/* Pins held on each of the last three epochs, they count as active readers */
+static atomic_ulong pins[3];
+
+/* Number of retired pointers not yet released, avoid locking when zero */
+static atomic_ulong pending;
+
+/*
+ * Limbo lists, one for each of the last three epochs. Pointers retired on
+ * epoch e are safe to release once the global epoch moves to e + 2
+ */
+static struct retired *limbo[3];
+
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local int slot = -1;
+
+int epoch_register(void) {
+    if (slot >= 0)
+        return slot;
+    int id = atomic_fetch_add(&nslots, 1);
+    if (id >= EPOCH_MAX_THREADS)
+        return -1;
+    slot = id;
+    return slot;
+}
+
+void epoch_enter(void) {
+    if (slot < 0 && epoch_register() < 0)
+        abort();
+    atomic_store(&slots[slot].active, true);
+    atomic_store(&slots[slot].epoch, atomic_load(&global_epoch));
+}
+
+void epoch_exit(void) {
+    atomic_store_explicit(&slots[slot].active, false, memory_order_release);
+}
+
+unsigned long epoch_pin(void) {
+    unsigned long e = atomic_load(&slots[slot].epoch);
+    atomic_fetch_add(&pins[e % 3], 1);
+    return e;
+}
+
+void epoch_unpin(unsigned long e) {
+    atomic_fetch_sub_explicit(&pins[e % 3], 1, memory_order_release);
+}
+
+void epoch_retire(void *ptr, void (*release)(void *)) {
+    struct retired *r = malloc(sizeof(*r));
+    r->ptr = ptr;
+    r->release = release;
+    pthread_mutex_lock(&limbo_lock);
+    unsigned long e = atomic_load(&global_epoch);
+    r->next = limbo[e % 3];
+    limbo[e % 3] = r;
+    pthread_mutex_unlock(&limbo_lock);
+    atomic_fetch_add(&pending, 1);
+}
+
+void epoch_reclaim(void) {
+    if (atomic_load_explicit(&pending, memory_order_relaxed) == 0)
+        return;
+    pthread_mutex_lock(&limbo_lock);
+    unsigned long e = atomic_load(&global_epoch);
+
+    /* Every active reader must have observed the current epoch */
+    int n = atomic_load(&nslots);
+    for (int i = 0; i < n && i < EPOCH_MAX_THREADS; i++) {
+        if (atomic_load(&slots[i].active) &&
+            atomic_load(&slots[i].epoch) != e) {
+            pthread_mutex_unlock(&limbo_lock);
+            return;
+        }
+    }
+
+    /*
+     * Pins behave like readers that entered on the epoch they were taken, a
+     * pin on e - 1 is held by a reader that didn't observe the current one
+     */
+    if (atomic_load(&pins[(e + 2) % 3]) > 0) {
+        pthread_mutex_unlock(&limbo_lock);
+        return;
+    }
+    atomic_store(&global_epoch, e + 1);
+
+    /* The oldest limbo list holds pointers retired on epoch e - 2 */
+    struct retired *r = limbo[(e + 1) % 3];
+    limbo[(e + 1) % 3] = NULL;
+    pthread_mutex_unlock(&limbo_lock);
+    while (r) {
+        struct retired *next = r->next;
+        r->release(r->ptr);
+        free(r);
+        atomic_fetch_sub(&pending, 1);
+        r = next;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch based memory reclamation, allows readers to traverse shared
+ * structures without taking any lock while writers unlink nodes and defer
+ * their release until no reader can hold a reference to them anymore.
+ *
+ * Readers wrap every traversal between epoch_enter and epoch_exit, writers
+ * hand unlinked nodes to epoch_retire. Retired nodes are released by
+ * epoch_reclaim two epochs later, once every active reader has observed the
+ * current epoch.
+ */
+
+/* Max number of threads that can be registered as readers */
+#define EPOCH_MAX_THREADS 64
+
+/* Register the calling thread as a reader, return -1 if out of slots */
+int epoch_register(void);
+
+/* Begin a read-side critical section */
+void epoch_enter(void);
+
+/* End a read-side critical section */
+void epoch_exit(void);
+
+/*
+ * Extend the read-side critical section of the caller past its epoch_exit,
+ * till epoch_unpin is called with the returned token, possibly by another
+ * thread. Must be called inside a critical section, it allows to hand the
+ * pointers read in it to a different thread without copying them.
+ */
+unsigned long epoch_pin(void);
+
+/* Release a pin taken with epoch_pin */
+void epoch_unpin(unsigned long);
+
+/*
+ * Defer the release of an unlinked pointer, the function passed will be
+ * called on it once it's safe to do so
+ */
+void epoch_retire(void *, void (*)(void *));
+
+/*
+ * Try to advance the global epoch and release all nodes that can't be
+ * referenced anymore by any reader. Must be called outside of read-side
+ * critical sections.
+ */
+void epoch_reclaim(void);
+
+#endif
@@ -2,112 +2,376 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <assert.h>
+#include <sys/random.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
 #include "util.h"
 #include "hashtable.h"
 
-/* Hashtable definition */
-struct hashtable {
+/*
+ * Open addressing table laid out like a SwissTable: every slot has a control
+ * byte, either EMPTY, DELETED or the lowest 7 bits of the hash of the key
+ * stored in it. Probing loads 16 control bytes at a time and compares them in
+ * parallel against the 7 bits of the key searched, keys are compared only on
+ * the slots whose control byte matches, so with a good hash a lookup usually
+ * touches a single group of control bytes and a single entry.
+ *
+ * The first GROUP_WIDTH - 1 control bytes are mirrored after the last one, a
+ * group can be loaded from any slot without wrapping around.
+ */
+#define GROUP_WIDTH     16
+
+#define CTRL_EMPTY      ((int8_t) -128)
+#define CTRL_DELETED    ((int8_t) -2)
+
+/*
+ * Slots of the table, control bytes and entries. While the table is resized
+ * the new slots and the old ones coexist, entries are moved a few at a time
+ * by every put and del so no single operation pays for the whole resize.
+ */
+struct slots {
+    /* Number of slots, a power of 2 not less than GROUP_WIDTH */
     size_t table_size;
     size_t size;
-    int (*destructor)(struct hashtable_entry *);
+    /* Slots marked as DELETED, they still count against the max load */
+    size_t deleted;
+    int8_t *ctrl;
     struct hashtable_entry *entries;
 };
 
-const int INITIAL_SIZE = 4;
-const int MAX_CHAIN_LENGTH = 8;
-const unsigned long KNUTH_PRIME = 2654435761;
-static unsigned long crc32(const uint8_t *, unsigned int);
+/* Hashtable definition */
+struct hashtable {
+    struct slots cur;
+    /* Slots being emptied into `cur`, ctrl is NULL if no resize is running */
+    struct slots old;
+    /* Next slot of `old` to be moved */
+    size_t rehash_cursor;
+    int (*destructor)(struct hashtable_entry *);
+};
+
+const int INITIAL_SIZE = GROUP_WIDTH;
+
+/* Slots of the old table moved by every put and del during a resize */
+const size_t REHASH_STEP = 16;
 
 /*
- * Hashing function for a string
+ * Keys are hashed 8 bytes at a time, with the crc32 instruction of SSE4.2
+ * if the CPU has it, checked once at runtime, or with a multiply-xorshift
+ * mix otherwise. Both are seeded at random on the first table created, so
+ * colliding client ids can't be crafted ahead of time.
  */
-static uint64_t hashtable_hash_int(HashTable *m, const uint8_t *keystr) {
-    assert(m && keystr);
-    uint64_t key = crc32(keystr, strlen((const char *) keystr));
+#define HASH_MUL1 0x9e3779b97f4a7c15ULL
+#define HASH_MUL2 0xbf58476d1ce4e5b9ULL
+
+static uint64_t hash_seed;
 
-    /* Robert Jenkins' 32 bit Mix Function */
-    key += (key << 12);
-    key ^= (key >> 22);
-    key += (key << 4);
-    key ^= (key >> 9);
-    key += (key << 10);
-    key ^= (key >> 2);
-    key += (key << 7);
-    key ^= (key >> 12);
+static uint64_t (*hash_bytes)(const uint8_t *, size_t);
 
-    /* Knuth's Multiplicative Method */
-    key = (key >> 3) * KNUTH_PRIME;
+/* Spread the bits of a 32 or 64 bit value over the whole 64 bits */
+static inline uint64_t hash_fold(uint64_t h) {
+    h ^= h >> 31;
+    h *= HASH_MUL2;
+    return h ^ (h >> 29);
+}
 
-    return key % m->table_size;
+/* Load up to 8 trailing bytes, the order doesn't matter for hashing */
+static inline uint64_t hash_tail(const uint8_t *key, size_t len) {
+    uint64_t w = 0;
+    memcpy(&w, key, len);
+    return w;
+}
+
+static uint64_t hash_scalar(const uint8_t *key, size_t len) {
+    uint64_t h = hash_seed ^ (len * HASH_MUL1);
+    for (; len >= 8; key += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, key, 8);
+        h = (h ^ w) * HASH_MUL1;
+        h ^= h >> 32;
+    }
+    h = (h ^ hash_tail(key, len)) * HASH_MUL1;
+    return hash_fold(h);
+}
+
+#ifdef __x86_64__
+__attribute__((target("sse4.2")))
+static uint64_t hash_crc32c(const uint8_t *key, size_t len) {
+    uint64_t crc = hash_seed ^ len;
+    for (; len >= 8; key += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, key, 8);
+        crc = _mm_crc32_u64(crc, w);
+    }
+    if (len > 0)
+        crc = _mm_crc32_u64(crc, hash_tail(key, len));
+
+    /* crc32c is 32 bits wide, the seed fills the high ones */
+    return hash_fold(crc ^ (hash_seed & 0xffffffff00000000ULL));
+}
+#endif
+
+/* Select the hash function and draw the seed, once */
+static void hash_init(void) {
+    if (hash_bytes)
+        return;
+    if (getrandom(&hash_seed, sizeof(hash_seed), GRND_NONBLOCK) !=
+        sizeof(hash_seed))
+        hash_seed = ((uint64_t) time(NULL) * HASH_MUL1) ^
+            (uintptr_t) &hash_seed;
+    hash_bytes = hash_scalar;
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        hash_bytes = hash_crc32c;
+#endif
 }
 
 /*
- * Return the integer of the location in entries to store the point to the item
- * or -HASHTABLE_FULL.
+ * Hashing function for a string, the lowest 7 bits are stored in the control
+ * byte of the slot, the remaining ones select the first group to probe
  */
-static int hashtable_hash(HashTable *table, const uint8_t *key) {
-    assert(table && key);
+static inline uint64_t hashtable_hash_int(const char *key, size_t len) {
+    return hash_bytes((const uint8_t *) key, len);
+}
 
-    /* If full, return immediately */
-    if (table->size >= (table->table_size / 2))
-        return -HASHTABLE_FULL;
-
-    /* Find the best index */
-    uint64_t curr = hashtable_hash_int(table, key);
-    char *k, *currk;
-
-    /* Linear probing */
-    for (int i = 0; i < MAX_CHAIN_LENGTH; i++) {
-        if (table->entries[curr].taken == false)
-            return curr;
-        k = (char *) table->entries[curr].key;
-        currk = (char *) key;
-        if (table->entries[curr].taken == true &&
-            STREQ(k, currk, strlen(k)) == true)
-            return curr;
-        curr = (curr + 1) % table->table_size;
-    }
-    return -HASHTABLE_FULL;
+static inline size_t hash_h1(uint64_t hash) {
+    return hash >> 7;
+}
+
+static inline int8_t hash_h2(uint64_t hash) {
+    return hash & 0x7f;
+}
+
+/* Max slots in use, live or deleted, 87.5% of the table */
+static inline size_t max_load(size_t table_size) {
+    return table_size - table_size / 8;
+}
+
+/* Bitmask of the slots of the group starting at ctrl matching a byte */
+static inline unsigned group_match(const int8_t *ctrl, int8_t byte) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++)
+        if (ctrl[i] == byte)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+/* Bitmask of the EMPTY or DELETED slots of a group, their sign bit is set */
+static inline unsigned group_match_free(const int8_t *ctrl) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return _mm_movemask_epi8(group);
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++)
+        if (ctrl[i] < 0)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+static inline void set_ctrl(struct slots *table, size_t i, int8_t byte) {
+    table->ctrl[i] = byte;
+    if (i < GROUP_WIDTH - 1)
+        table->ctrl[table->table_size + i] = byte;
 }
 
 /*
- * Doubles the size of the hashtable, and rehashes all the elements
+ * Probe sequence, groups are visited with a triangular stride which visits
+ * every slot of a power of 2 table
  */
-static int hashtable_rehash(HashTable *table) {
-    assert(table);
-    size_t old_size;
-    struct hashtable_entry *curr;
+struct probe {
+    size_t pos;
+    size_t stride;
+    size_t mask;
+};
 
-    /* Setup the new elements */
-    struct hashtable_entry *temp =
-        calloc(2 * table->table_size, sizeof(*temp));
-    if (!temp)
-        return -HASHTABLE_ERR;
+static inline void probe_init(struct probe *p, const struct slots *table,
+                              uint64_t hash) {
+    p->mask = table->table_size - 1;
+    p->pos = hash_h1(hash) & p->mask;
+    p->stride = 0;
+}
+
+static inline void probe_next(struct probe *p) {
+    p->stride += GROUP_WIDTH;
+    p->pos = (p->pos + p->stride) & p->mask;
+}
+
+/*
+ * Return the slot holding a key, or -1 if not found. Entries carry the length
+ * of their key, most of the candidates are discarded without reading it.
+ */
+static ssize_t slots_find(const struct slots *table,
+                          const char *key, size_t len, uint64_t hash) {
+    struct probe p;
+    int8_t h2 = hash_h2(hash);
+    for (probe_init(&p, table, hash); ; probe_next(&p)) {
+        const int8_t *group = table->ctrl + p.pos;
+        unsigned match = group_match(group, h2);
+        while (match) {
+            size_t i = (p.pos + __builtin_ctz(match)) & p.mask;
+            if (table->entries[i].keylen == len &&
+                memcmp(table->entries[i].key, key, len) == 0)
+                return i;
+            match &= match - 1;
+        }
+
+        /* An EMPTY slot ends the chain, the key would have been put there */
+        if (group_match(group, CTRL_EMPTY))
+            return -1;
+    }
+}
 
-    /* Update the array */
-    curr = table->entries;
-    table->entries = temp;
+/* Return the first EMPTY or DELETED slot on the probe sequence of a hash */
+static size_t slots_find_free(const struct slots *table, uint64_t hash) {
+    struct probe p;
+    for (probe_init(&p, table, hash); ; probe_next(&p)) {
+        unsigned match = group_match_free(table->ctrl + p.pos);
+        if (match)
+            return (p.pos + __builtin_ctz(match)) & p.mask;
+    }
+}
 
-    /* Update the size */
-    old_size = table->table_size;
-    table->table_size = 2 * table->table_size;
+/* Store an entry on a free slot */
+static void slots_insert(struct slots *table, size_t slot, uint64_t hash,
+                         const char *key, size_t len, void *val) {
+    if (table->ctrl[slot] == CTRL_DELETED)
+        table->deleted--;
+    set_ctrl(table, slot, hash_h2(hash));
+    table->entries[slot].key = key;
+    table->entries[slot].keylen = len;
+    table->entries[slot].val = val;
+    table->entries[slot].taken = true;
+    table->size++;
+}
+
+/*
+ * Free a slot, it goes back to EMPTY if its group has an EMPTY slot already,
+ * as no probe sequence can run through it, it's marked DELETED otherwise
+ */
+static void slots_erase(struct slots *table, size_t index) {
+    size_t before = (index - GROUP_WIDTH) & (table->table_size - 1);
+    unsigned empty_after = group_match(table->ctrl + index, CTRL_EMPTY);
+    unsigned empty_before = group_match(table->ctrl + before, CTRL_EMPTY);
+
+    /*
+     * The slot can go back to EMPTY only if no full group of 16 slots around
+     * it, which a probe could have skipped as a whole, covers it
+     */
+    if (empty_after && empty_before &&
+        __builtin_ctz(empty_after) + __builtin_clz(empty_before) - 16
+        < GROUP_WIDTH) {
+        set_ctrl(table, index, CTRL_EMPTY);
+    } else {
+        set_ctrl(table, index, CTRL_DELETED);
+        table->deleted++;
+    }
+    table->entries[index].taken = false;
+    table->size--;
+}
+
+static int slots_alloc(struct slots *table, size_t table_size) {
+    int8_t *ctrl = malloc(table_size + GROUP_WIDTH - 1);
+    struct hashtable_entry *entries = calloc(table_size, sizeof(*entries));
+    if (!ctrl || !entries) {
+        free(ctrl);
+        free(entries);
+        return -HASHTABLE_OOM;
+    }
+    memset(ctrl, CTRL_EMPTY, table_size + GROUP_WIDTH - 1);
+    table->ctrl = ctrl;
+    table->entries = entries;
+    table->table_size = table_size;
     table->size = 0;
+    table->deleted = 0;
+    return HASHTABLE_OK;
+}
 
-    int status;
+static void slots_free(struct slots *table) {
+    free(table->ctrl);
+    free(table->entries);
+    table->ctrl = NULL;
+    table->entries = NULL;
+    table->size = 0;
+}
 
-    /* Rehash the elements */
-    for (size_t i = 0; i < old_size; i++) {
-        if (curr[i].taken == false)
+/*
+ * Move up to `steps` slots of the old table to the current one, releasing
+ * the old table once the last one is moved. Moved slots are marked DELETED,
+ * the probe sequences of the keys still to be moved must stay intact.
+ */
+static void hashtable_rehash_step(HashTable *table, size_t steps) {
+    struct slots *old = &table->old;
+    if (!old->ctrl)
+        return;
+    size_t end = old->table_size;
+    if (steps < end - table->rehash_cursor)
+        end = table->rehash_cursor + steps;
+    for (size_t i = table->rehash_cursor; i < end; i++) {
+        if (old->ctrl[i] < 0)
             continue;
-        if ((status = hashtable_put(table, curr[i].key,
-                                    curr[i].val)) != HASHTABLE_OK)
-            return status;
+        struct hashtable_entry *e = &old->entries[i];
+        uint64_t hash = hashtable_hash_int(e->key, e->keylen);
+        size_t slot = slots_find_free(&table->cur, hash);
+        slots_insert(&table->cur, slot, hash, e->key, e->keylen, e->val);
+        set_ctrl(old, i, CTRL_DELETED);
+        old->size--;
     }
-    free(curr);
+    table->rehash_cursor = end;
+    if (end == old->table_size)
+        slots_free(old);
+}
+
+/*
+ * Start a resize, the current slots become the old ones, emptied over the
+ * next operations into new slots twice the size if live entries exceed half
+ * of the max load, of the same size otherwise. A running resize is completed
+ * first. If the new slots can't be allocated the table keeps working on the
+ * current ones until they have no EMPTY slot left.
+ */
+static int hashtable_rehash(HashTable *table) {
+    assert(table);
+    hashtable_rehash_step(table, SIZE_MAX);
+    size_t new_size = table->cur.table_size;
+    if (table->cur.size >= max_load(new_size) / 2)
+        new_size *= 2;
+    struct slots next;
+    if (slots_alloc(&next, new_size) != HASHTABLE_OK)
+        return -HASHTABLE_OOM;
+    table->old = table->cur;
+    table->cur = next;
+    table->rehash_cursor = 0;
+    hashtable_rehash_step(table, REHASH_STEP);
     return HASHTABLE_OK;
 }
 
+/* Find a key on both the current and the old slots */
+static struct slots *hashtable_find(HashTable *table, const char *key,
+                                    size_t len, uint64_t hash,
+                                    ssize_t *index) {
+    *index = slots_find(&table->cur, key, len, hash);
+    if (*index >= 0)
+        return &table->cur;
+    if (table->old.ctrl) {
+        *index = slots_find(&table->old, key, len, hash);
+        if (*index >= 0)
+            return &table->old;
+    }
+    return NULL;
+}
+
 /* callback function used with iterate to clean up the hashtable */
 static int destroy_entry(struct hashtable_entry *entry) {
     if (!entry)
@@ -129,22 +393,24 @@ static int destroy_entry(struct hashtable_entry *entry) {
  * dynamically allocated on the heap memory, so it must be released manually.
  */
 HashTable *hashtable_create(int (*destructor)(struct hashtable_entry *)) {
+    hash_init();
     HashTable *table = malloc(sizeof(HashTable));
     if(!table)
         return NULL;
-    table->entries = calloc(INITIAL_SIZE, sizeof(struct hashtable_entry));
-    if(!table->entries) {
-        hashtable_release(table);
+    if (slots_alloc(&table->cur, INITIAL_SIZE) != HASHTABLE_OK) {
+        free(table);
         return NULL;
     }
+    table->old.ctrl = NULL;
+    table->old.entries = NULL;
+    table->old.size = 0;
+    table->rehash_cursor = 0;
     table->destructor = destructor ? destructor : destroy_entry;
-    table->table_size = INITIAL_SIZE;
-    table->size = 0;
     return table;
 }
 
 size_t hashtable_size(const HashTable *table) {
-    return table->size;
+    return table->cur.size + table->old.size;
 }
 
 int hashtable_exists(HashTable *table, const char *key) {
@@ -152,28 +418,39 @@ int hashtable_exists(HashTable *table, const char *key) {
     return !ret ? 0 : 1;
 }
 
-/* Add a new key-value pair into the hashtable entries array, use chaining in
-   case of collision. */
+/*
+ * Add a new key-value pair into the hashtable, replacing the value of the key
+ * if already present. A new key takes the first free slot on its probe
+ * sequence, reusing DELETED ones.
+ */
 int hashtable_put(HashTable *table, const char *key, void *val) {
     assert(table && key);
-
-    /* Find a place to put our value */
-    int index = hashtable_hash(table, (const uint8_t *) key);
-    while (index == -HASHTABLE_FULL){
-        if (hashtable_rehash(table) == -HASHTABLE_ERR)
-            return -HASHTABLE_ERR;
-        index = hashtable_hash(table, (const uint8_t *) key);
+    hashtable_rehash_step(table, REHASH_STEP);
+    size_t len = strlen(key);
+    uint64_t hash = hashtable_hash_int(key, len);
+    ssize_t index;
+    struct slots *slots = hashtable_find(table, key, len, hash, &index);
+    if (slots) {
+        slots->entries[index].key = key;
+        slots->entries[index].val = val;
+        return HASHTABLE_OK;
     }
-
-    /* Set the entries */
-    table->entries[index].val = val;
-    table->entries[index].key = key;
-
-    /* Update taken flag, if it was false, update the size also */
-    if (table->entries[index].taken == false) {
-        table->entries[index].taken = true;
-        table->size++;
+    struct slots *cur = &table->cur;
+    size_t slot = slots_find_free(cur, hash);
+
+    /*
+     * Taking an EMPTY slot beyond the max load, make room first. Failing
+     * that the slot is taken anyway as long as another EMPTY one is left to
+     * end the probe sequences.
+     */
+    if (cur->ctrl[slot] == CTRL_EMPTY &&
+        cur->size + cur->deleted + 1 > max_load(cur->table_size)) {
+        if (hashtable_rehash(table) == HASHTABLE_OK)
+            slot = slots_find_free(cur, hash);
+        else if (cur->size + cur->deleted + 1 >= cur->table_size)
+            return -HASHTABLE_OOM;
     }
+    slots_insert(cur, slot, hash, key, len, val);
     return HASHTABLE_OK;
 }
 
@@ -182,21 +459,11 @@ int hashtable_put(HashTable *table, const char *key, void *val) {
  */
 void *hashtable_get(HashTable *table, const char *key) {
     assert(table && key);
-
-    /* Find data location */
-    uint64_t curr = hashtable_hash_int(table, (const uint8_t *) key);
-
-    /* Linear probing, if necessary */
-    for (int i = 0; i < MAX_CHAIN_LENGTH; i++){
-        if (table->entries[curr].taken == true) {
-            if (STREQ(table->entries[curr].key, key, strlen(key)) == true)
-                return table->entries[curr].val;
-        }
-        curr = (curr + 1) % table->table_size;
-    }
-
-    /* Not found */
-    return NULL;
+    size_t len = strlen(key);
+    uint64_t hash = hashtable_hash_int(key, len);
+    ssize_t index;
+    struct slots *slots = hashtable_find(table, key, len, hash, &index);
+    return slots ? slots->entries[index].val : NULL;
 }
 
 /*
@@ -204,34 +471,48 @@ void *hashtable_get(HashTable *table, const char *key) {
  */
 int hashtable_del(HashTable *table, const char *key) {
     assert(table && key);
+    hashtable_rehash_step(table, REHASH_STEP);
+    size_t len = strlen(key);
+    uint64_t hash = hashtable_hash_int(key, len);
+    ssize_t index;
+    struct slots *slots = hashtable_find(table, key, len, hash, &index);
 
-    /* Find key */
-    uint64_t curr = hashtable_hash_int(table, (const uint8_t *) key);
-
-    /* Linear probing, if necessary */
-    for (int i = 0; i < MAX_CHAIN_LENGTH; i++) {
+    /* Data not found */
+    if (!slots)
+        return -HASHTABLE_ERR;
 
-        // check wether the position in array is in use
-        if (table->entries[curr].taken == true) {
-            if (STREQ(table->entries[curr].key, key, strlen(key)) == true) {
+    slots_erase(slots, index);
 
-                /* Blank out the fields */
-                table->entries[curr].taken = false;
+    /* Destroy the entry */
+    table->destructor(&slots->entries[index]);
 
-                /* Reduce the size */
-                table->size--;
+    return HASHTABLE_OK;
+}
 
-                /* Destroy the entry */
-                table->destructor(&table->entries[curr]);
+/* Apply a function to every entry of a set of slots */
+static int slots_map(struct slots *table,
+                     int (*func)(struct hashtable_entry *, void *),
+                     void *param) {
+    for (size_t i = 0; i < table->table_size && table->ctrl; i++) {
+        if (table->ctrl[i] >= 0) {
 
-                return HASHTABLE_OK;
-            }
+            /* Apply function to the key-value entry */
+            struct hashtable_entry data = table->entries[i];
+            int status = func(&data, param);
+            if (status != HASHTABLE_OK)
+                return status;
         }
-        curr = (curr + 1) % table->table_size;
     }
+    return HASHTABLE_OK;
+}
 
-    /* Data not found */
-    return -HASHTABLE_ERR;
+/* Function pointers can't be passed as void *, wrap them */
+struct map_func {
+    int (*func)(struct hashtable_entry *);
+};
+
+static int map_single(struct hashtable_entry *entry, void *arg) {
+    return ((struct map_func *) arg)->func(entry);
 }
 
 /*
@@ -241,23 +522,8 @@ int hashtable_del(HashTable *table, const char *key) {
  */
 int hashtable_map(HashTable *table, int (*func)(struct hashtable_entry *)) {
     assert(func);
-
-    /* On empty hashmap, return immediately */
-    if (!table || table->size <= 0)
-        return -HASHTABLE_ERR;
-
-    /* Linear probing */
-    for (size_t i = 0; i < table->table_size; i++) {
-        if (table->entries[i].taken == true) {
-
-            /* Apply function to the key-value entry */
-            struct hashtable_entry data = table->entries[i];
-            int status = func(&data);
-            if (status != HASHTABLE_OK)
-                return status;
-        }
-    }
-    return HASHTABLE_OK;
+    struct map_func arg = { func };
+    return hashtable_map2(table, map_single, &arg);
 }
 
 /*
@@ -270,21 +536,13 @@ int hashtable_map2(HashTable *table,
     assert(func);
 
     /* On empty hashmap, return immediately */
-    if (!table || table->size <= 0)
+    if (!table || hashtable_size(table) <= 0)
         return -HASHTABLE_ERR;
 
-    /* Linear probing */
-    for (size_t i = 0; i < table->table_size; i++) {
-        if (table->entries[i].taken == true) {
-
-            /* Apply function to the key-value entry */
-            struct hashtable_entry data = table->entries[i];
-            int status = func(&data, param);
-            if (status != HASHTABLE_OK)
-                return status;
-        }
-    }
-    return HASHTABLE_OK;
+    int status = slots_map(&table->cur, func, param);
+    if (status != HASHTABLE_OK)
+        return status;
+    return slots_map(&table->old, func, param);
 }
 
 /*
@@ -295,118 +553,7 @@ void hashtable_release(HashTable *table){
     if (!table)
         return;
     hashtable_map(table, table->destructor);
-    if (!table || !table->entries)
-        return;
-    free(table->entries);
+    slots_free(&table->cur);
+    slots_free(&table->old);
     free(table);
 }
-
-/* The implementation here was originally done by Gary S. Brown. Slighltly
- * modified by Pete Warden, without any imposition on the reuse of the code.
- */
-
-/* ============================================================= */
-/*  COPYRIGHT (C) 1986 Gary S. Brown.  You may use this program, or       */
-/*  code or tables extracted from it, as desired without restriction.     */
-/*                                                                        */
-/*  First, the polynomial itself and its table of feedback terms.  The    */
-/*  polynomial is                                                         */
-/*  X^32+X^26+X^23+X^22+X^16+X^12+X^11+X^10+X^8+X^7+X^5+X^4+X^2+X^1+X^0   */
-/*                                                                        */
-/*  Note that we take it "backwards" and put the highest-order term in    */
-/*  the lowest-order bit.  The X^32 term is "implied"; the LSB is the     */
-/*  X^31 term, etc.  The X^0 term (usually shown as "+1") results in      */
-/*  the MSB being 1.                                                      */
-/*                                                                        */
-/*  Note that the usual hardware shift register implementation, which     */
-/*  is what we're using (we're merely optimizing it by doing eight-bit    */
-/*  chunks at a time) shifts bits into the lowest-order term.  In our     */
-/*  implementation, that means shifting towards the right.  Why do we     */
-/*  do it this way?  Because the calculated CRC must be transmitted in    */
-/*  order from highest-order term to lowest-order term.  UARTs transmit   */
-/*  characters in order from LSB to MSB.  By storing the CRC this way,    */
-/*  we hand it to the UART in the order low-byte to high-byte; the UART   */
-/*  sends each low-bit to hight-bit; and the result is transmission bit   */
-/*  by bit from highest- to lowest-order term without requiring any bit   */
-/*  shuffling on our part.  Reception works similarly.                    */
-/*                                                                        */
-/*  The feedback terms table consists of 256, 32-bit entries.  Notes:     */
-/*                                                                        */
-/*      The table can be generated at runtime if desired; code to do so   */
-/*      is shown later.  It might not be obvious, but the feedback        */
-/*      terms simply represent the results of eight shift/xor opera-      */
-/*      tions for all combinations of data and CRC register values.       */
-/*                                                                        */
-/*      The values must be right-shifted by eight bits by the "updcrc"    */
-/*      logic; the shift must be unsigned (bring in zeroes).  On some     */
-/*      hardware you could probably optimize the shift in assembler by    */
-/*      using byte-swap instructions.                                     */
-/*      polynomial $edb88320                                              */
-/*                                                                        */
-/*  --------------------------------------------------------------------  */
-
-static unsigned long crc32_tab[] = {
-    0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
-    0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
-    0xe0d5e91eL, 0x97d2d988L, 0x09b64c2bL, 0x7eb17cbdL, 0xe7b82d07L,
-    0x90bf1d91L, 0x1db71064L, 0x6ab020f2L, 0xf3b97148L, 0x84be41deL,
-    0x1adad47dL, 0x6ddde4ebL, 0xf4d4b551L, 0x83d385c7L, 0x136c9856L,
-    0x646ba8c0L, 0xfd62f97aL, 0x8a65c9ecL, 0x14015c4fL, 0x63066cd9L,
-    0xfa0f3d63L, 0x8d080df5L, 0x3b6e20c8L, 0x4c69105eL, 0xd56041e4L,
-    0xa2677172L, 0x3c03e4d1L, 0x4b04d447L, 0xd20d85fdL, 0xa50ab56bL,
-    0x35b5a8faL, 0x42b2986cL, 0xdbbbc9d6L, 0xacbcf940L, 0x32d86ce3L,
-    0x45df5c75L, 0xdcd60dcfL, 0xabd13d59L, 0x26d930acL, 0x51de003aL,
-    0xc8d75180L, 0xbfd06116L, 0x21b4f4b5L, 0x56b3c423L, 0xcfba9599L,
-    0xb8bda50fL, 0x2802b89eL, 0x5f058808L, 0xc60cd9b2L, 0xb10be924L,
-    0x2f6f7c87L, 0x58684c11L, 0xc1611dabL, 0xb6662d3dL, 0x76dc4190L,
-    0x01db7106L, 0x98d220bcL, 0xefd5102aL, 0x71b18589L, 0x06b6b51fL,
-    0x9fbfe4a5L, 0xe8b8d433L, 0x7807c9a2L, 0x0f00f934L, 0x9609a88eL,
-    0xe10e9818L, 0x7f6a0dbbL, 0x086d3d2dL, 0x91646c97L, 0xe6635c01L,
-    0x6b6b51f4L, 0x1c6c6162L, 0x856530d8L, 0xf262004eL, 0x6c0695edL,
-    0x1b01a57bL, 0x8208f4c1L, 0xf50fc457L, 0x65b0d9c6L, 0x12b7e950L,
-    0x8bbeb8eaL, 0xfcb9887cL, 0x62dd1ddfL, 0x15da2d49L, 0x8cd37cf3L,
-    0xfbd44c65L, 0x4db26158L, 0x3ab551ceL, 0xa3bc0074L, 0xd4bb30e2L,
-    0x4adfa541L, 0x3dd895d7L, 0xa4d1c46dL, 0xd3d6f4fbL, 0x4369e96aL,
-    0x346ed9fcL, 0xad678846L, 0xda60b8d0L, 0x44042d73L, 0x33031de5L,
-    0xaa0a4c5fL, 0xdd0d7cc9L, 0x5005713cL, 0x270241aaL, 0xbe0b1010L,
-    0xc90c2086L, 0x5768b525L, 0x206f85b3L, 0xb966d409L, 0xce61e49fL,
-    0x5edef90eL, 0x29d9c998L, 0xb0d09822L, 0xc7d7a8b4L, 0x59b33d17L,
-    0x2eb40d81L, 0xb7bd5c3bL, 0xc0ba6cadL, 0xedb88320L, 0x9abfb3b6L,
-    0x03b6e20cL, 0x74b1d29aL, 0xead54739L, 0x9dd277afL, 0x04db2615L,
-    0x73dc1683L, 0xe3630b12L, 0x94643b84L, 0x0d6d6a3eL, 0x7a6a5aa8L,
-    0xe40ecf0bL, 0x9309ff9dL, 0x0a00ae27L, 0x7d079eb1L, 0xf00f9344L,
-    0x8708a3d2L, 0x1e01f268L, 0x6906c2feL, 0xf762575dL, 0x806567cbL,
-    0x196c3671L, 0x6e6b06e7L, 0xfed41b76L, 0x89d32be0L, 0x10da7a5aL,
-    0x67dd4accL, 0xf9b9df6fL, 0x8ebeeff9L, 0x17b7be43L, 0x60b08ed5L,
-    0xd6d6a3e8L, 0xa1d1937eL, 0x38d8c2c4L, 0x4fdff252L, 0xd1bb67f1L,
-    0xa6bc5767L, 0x3fb506ddL, 0x48b2364bL, 0xd80d2bdaL, 0xaf0a1b4cL,
-    0x36034af6L, 0x41047a60L, 0xdf60efc3L, 0xa867df55L, 0x316e8eefL,
-    0x4669be79L, 0xcb61b38cL, 0xbc66831aL, 0x256fd2a0L, 0x5268e236L,
-    0xcc0c7795L, 0xbb0b4703L, 0x220216b9L, 0x5505262fL, 0xc5ba3bbeL,
-    0xb2bd0b28L, 0x2bb45a92L, 0x5cb36a04L, 0xc2d7ffa7L, 0xb5d0cf31L,
-    0x2cd99e8bL, 0x5bdeae1dL, 0x9b64c2b0L, 0xec63f226L, 0x756aa39cL,
-    0x026d930aL, 0x9c0906a9L, 0xeb0e363fL, 0x72076785L, 0x05005713L,
-    0x95bf4a82L, 0xe2b87a14L, 0x7bb12baeL, 0x0cb61b38L, 0x92d28e9bL,
-    0xe5d5be0dL, 0x7cdcefb7L, 0x0bdbdf21L, 0x86d3d2d4L, 0xf1d4e242L,
-    0x68ddb3f8L, 0x1fda836eL, 0x81be16cdL, 0xf6b9265bL, 0x6fb077e1L,
-    0x18b74777L, 0x88085ae6L, 0xff0f6a70L, 0x66063bcaL, 0x11010b5cL,
-    0x8f659effL, 0xf862ae69L, 0x616bffd3L, 0x166ccf45L, 0xa00ae278L,
-    0xd70dd2eeL, 0x4e048354L, 0x3903b3c2L, 0xa7672661L, 0xd06016f7L,
-    0x4969474dL, 0x3e6e77dbL, 0xaed16a4aL, 0xd9d65adcL, 0x40df0b66L,
-    0x37d83bf0L, 0xa9bcae53L, 0xdebb9ec5L, 0x47b2cf7fL, 0x30b5ffe9L,
-    0xbdbdf21cL, 0xcabac28aL, 0x53b39330L, 0x24b4a3a6L, 0xbad03605L,
-    0xcdd70693L, 0x54de5729L, 0x23d967bfL, 0xb3667a2eL, 0xc4614ab8L,
-    0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL,
-    0x2d02ef8dL
-};
-
-/* Return a 32-bit CRC of the contents of the buffer. */
-static unsigned long crc32(const uint8_t *s, unsigned int len) {
-    unsigned int i;
-    uint64_t crc32val;
-    crc32val = 0LL;
-    for (i = 0;  i < len;  i ++) {
-        crc32val = crc32_tab[(crc32val ^ s[i]) & 0xff] ^ (crc32val >> 8);
-    }
-    return crc32val;
-}
\ No newline at end of file
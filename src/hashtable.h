@@ -10,10 +10,11 @@
 #define HASHTABLE_OOM  2
 #define HASHTABLE_FULL 3
 
-/* We need to keep keys and values */
+/* We need to keep keys and values, along with the length of the key */
 struct hashtable_entry {
     const char *key;
     void *val;
+    uint32_t keylen;
     bool taken;
 };
 
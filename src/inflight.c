@@ -0,0 +1,155 @@
+#define _POSIX_C_SOURCE 200809L
+#include <string.h>
+#include <stdlib.h>
+#include "core.h"
+#include "config.h"
+#include "mqtt.h"
+#include "memory.h"
+#include "inflight.h"
+
+uint64_t *pkt_id_bitmap_create(void) {
+    uint64_t *bitmap = memory_alloc(MEMORY_CLIENTS, PKT_ID_BITMAP_SIZE);
+    if (bitmap)
+        memset(bitmap, 0, PKT_ID_BITMAP_SIZE);
+    return bitmap;
+}
+
+void pkt_id_bitmap_free(uint64_t *bitmap) {
+    memory_free(MEMORY_CLIENTS, bitmap, PKT_ID_BITMAP_SIZE);
+}
+
+bool pkt_id_test(const uint64_t *bitmap, unsigned short pkt_id) {
+    return bitmap[pkt_id >> 6] >> (pkt_id & 63) & 1;
+}
+
+void pkt_id_set(uint64_t *bitmap, unsigned short pkt_id) {
+    bitmap[pkt_id >> 6] |= (uint64_t) 1 << (pkt_id & 63);
+}
+
+void pkt_id_clear(uint64_t *bitmap, unsigned short pkt_id) {
+    bitmap[pkt_id >> 6] &= ~((uint64_t) 1 << (pkt_id & 63));
+}
+
+/* Empty words are skipped whole, most of the bitmap usually is */
+void pkt_id_map(const uint64_t *bitmap,
+                void (*func)(unsigned short, void *), void *arg) {
+    for (size_t i = 0; i < PKT_ID_BITMAP_SIZE / sizeof(uint64_t); i++) {
+        uint64_t word = bitmap[i];
+        while (word) {
+            int bit = __builtin_ctzll(word);
+            func((unsigned short) (i * 64 + bit), arg);
+            word &= word - 1;
+        }
+    }
+}
+
+struct inflight *inflight_create(unsigned max) {
+    unsigned size = 1;
+    while (size < max && size < MAX_INFLIGHT_LIMIT)
+        size <<= 1;
+    struct inflight *w =
+        memory_alloc(MEMORY_CLIENTS,
+                     sizeof(*w) + size * sizeof(struct inflight_entry));
+    if (!w)
+        return NULL;
+    w->next_id = 1;
+    w->mask = size - 1;
+    w->len = 0;
+    w->max = max < size ? max : size;
+    w->released = NULL;
+    for (unsigned i = 0; i < size; i++)
+        w->entries[i].pkt_id = 0;
+    return w;
+}
+
+size_t inflight_size(const struct inflight *w) {
+    return sizeof(*w) + ((size_t) w->mask + 1) * sizeof(struct inflight_entry);
+}
+
+static void inflight_entry_release(struct inflight *w,
+                                   struct inflight_entry *e) {
+    message_release(e->msg);
+    topic_unref(e->topic);
+    e->msg = NULL;
+    e->topic = NULL;
+    e->pkt_id = 0;
+    w->len--;
+}
+
+void inflight_free(struct inflight *w) {
+    if (!w)
+        return;
+    for (unsigned i = 0; i <= w->mask; i++)
+        if (w->entries[i].pkt_id != 0)
+            inflight_entry_release(w, &w->entries[i]);
+    pkt_id_bitmap_free(w->released);
+    memory_free(MEMORY_CLIENTS, w, inflight_size(w));
+}
+
+struct inflight_entry *inflight_add(struct inflight *w, struct message *msg,
+                                    struct topic *topic, unsigned char qos,
+                                    time_t now) {
+    struct inflight_entry *e = &w->entries[w->next_id & w->mask];
+    if (e->pkt_id != 0 || w->len >= w->max)
+        return NULL;
+
+    /* The id came round again before the PUBCOMP of its last use */
+    if (w->released && pkt_id_test(w->released, w->next_id))
+        return NULL;
+    e->pkt_id = w->next_id;
+
+    /* Packet id 0 is not allowed by the protocol */
+    if (++w->next_id == 0)
+        w->next_id = 1;
+    e->msg = message_ref(msg);
+    topic_ref(topic);
+    e->topic = topic;
+    e->qos = qos;
+    e->sent = now;
+    w->len++;
+    return e;
+}
+
+struct inflight_entry *inflight_get(struct inflight *w,
+                                    unsigned short pkt_id) {
+    struct inflight_entry *e = &w->entries[pkt_id & w->mask];
+    return pkt_id != 0 && e->pkt_id == pkt_id ? e : NULL;
+}
+
+bool inflight_ack(struct inflight *w, unsigned short pkt_id) {
+    struct inflight_entry *e = &w->entries[pkt_id & w->mask];
+    if (pkt_id == 0 || e->pkt_id != pkt_id)
+        return false;
+    inflight_entry_release(w, e);
+    return true;
+}
+
+bool inflight_pubrec(struct inflight *w, unsigned short pkt_id) {
+    struct inflight_entry *e = &w->entries[pkt_id & w->mask];
+    if (pkt_id == 0)
+        return false;
+    if (e->pkt_id != pkt_id || e->qos != EXACTLY_ONCE)
+        return w->released && pkt_id_test(w->released, pkt_id);
+    if (!w->released && !(w->released = pkt_id_bitmap_create()))
+        return false;
+    inflight_entry_release(w, e);
+    pkt_id_set(w->released, pkt_id);
+    return true;
+}
+
+bool inflight_pubcomp(struct inflight *w, unsigned short pkt_id) {
+    if (!w->released || !pkt_id_test(w->released, pkt_id))
+        return false;
+    pkt_id_clear(w->released, pkt_id);
+    return true;
+}
+
+/* The slot of the next id is the one of the oldest entry still in flight */
+void inflight_map(struct inflight *w,
+                  void (*func)(struct inflight_entry *, void *), void *arg) {
+    for (unsigned i = 0; i <= w->mask && w->len > 0; i++) {
+        struct inflight_entry *e = &w->entries[(w->next_id + i) & w->mask];
+        if (e->pkt_id != 0)
+            func(e, arg);
+    }
+}
@@ -0,0 +1,99 @@
+#ifndef INFLIGHT_H
+#define INFLIGHT_H
+
+#include <time.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct topic;
+struct message;
+
+/*
+ * Outbound QoS 1 and 2 publishes sent to a client and not yet acknowledged.
+ *
+ * Packet ids are handed out in sequence and each one owns the slot of a
+ * ring at `id & mask`, acks find their entry with a single index. The slot
+ * of the next id holds the oldest entry of the window: while it's still
+ * waiting for an ack no new id is given out, so a client not acking its
+ * messages pins at most `max_inflight` of them.
+ */
+
+/*
+ * Packet ids of QoS 2 exchanges halfway through, a bit for each of the 65536
+ * ids, set and cleared in O(1):
+ * - inbound publishes acked with a PUBREC, waiting for their PUBREL
+ * - outbound publishes released with a PUBREL, waiting for their PUBCOMP
+ */
+#define PKT_ID_BITMAP_SIZE  (65536 / 8)
+
+/* Create a cleared bitmap, accounted to MEMORY_CLIENTS */
+uint64_t *pkt_id_bitmap_create(void);
+void pkt_id_bitmap_free(uint64_t *);
+
+bool pkt_id_test(const uint64_t *, unsigned short);
+void pkt_id_set(uint64_t *, unsigned short);
+void pkt_id_clear(uint64_t *, unsigned short);
+
+/* Call a function on every packet id set */
+void pkt_id_map(const uint64_t *, void (*)(unsigned short, void *), void *);
+
+struct inflight_entry {
+    /* Message and topic are referenced till the entry is acked */
+    struct message *msg;
+    struct topic *topic;
+    /* Last (re)transmission, for the retry timeout */
+    time_t sent;
+    /* Packet id, 0 for a free slot */
+    unsigned short pkt_id;
+    unsigned char qos;
+};
+
+struct inflight {
+    unsigned short next_id;
+    /* Slots of the ring minus one, the size being a power of 2 */
+    unsigned short mask;
+    /* Entries in flight and the configured bound of them */
+    unsigned short len;
+    unsigned short max;
+    /* Ids released with a PUBREL, NULL till the first PUBREC received */
+    uint64_t *released;
+    struct inflight_entry entries[];
+};
+
+/* Create a window of at least `max` entries, accounted to MEMORY_CLIENTS */
+struct inflight *inflight_create(unsigned);
+
+/* Release the window and the references held by its entries */
+void inflight_free(struct inflight *);
+
+/* Memory taken by a window */
+size_t inflight_size(const struct inflight *);
+
+/*
+ * Track a message under the next packet id, referencing message and topic,
+ * return NULL if the window is full
+ */
+struct inflight_entry *inflight_add(struct inflight *, struct message *,
+                                    struct topic *, unsigned char, time_t);
+
+/* Entry of a packet id in flight, NULL if unknown */
+struct inflight_entry *inflight_get(struct inflight *, unsigned short);
+
+/* Release the entry of an acked packet id, false if not in flight */
+bool inflight_ack(struct inflight *, unsigned short);
+
+/*
+ * PUBREC received for a QoS 2 publish, its message is not needed anymore
+ * and the id moves to the released ones till the PUBCOMP, an id released
+ * already is accepted again. Return false for an unknown id.
+ */
+bool inflight_pubrec(struct inflight *, unsigned short);
+
+/* PUBCOMP received, the id is free again, false if it wasn't released */
+bool inflight_pubcomp(struct inflight *, unsigned short);
+
+/* Call a function on every entry in flight, oldest first */
+void inflight_map(struct inflight *,
+                  void (*)(struct inflight_entry *, void *), void *);
+
+#endif
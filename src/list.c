@@ -1,10 +1,23 @@
 #include "list.h"
+#include "pool.h"
 #include <stdlib.h>
 
 static struct list_node *list_node_remove(struct list_node *,
                                           struct list_node *,
                                           compare_func, int *);
 
+/* List nodes of every list */
+static struct pool node_pool = POOL_INITIALIZER("list_nodes",
+                                                struct list_node);
+
+struct list_node *list_node_alloc(void) {
+    return pool_alloc(&node_pool);
+}
+
+void list_node_free(void *node) {
+    pool_free(&node_pool, node);
+}
+
 /*
  * Create a list, initializing all fields
  */
@@ -40,7 +53,7 @@ void list_release(List *l, int deep) {
             if (h) {
                 if (h->data && deep == 1)
                     free(h->data);
-                free(h);
+                list_node_free(h);
             }
         }
         h = tmp;
@@ -69,7 +82,7 @@ void list_clear(List *l, int deep) {
         if (h) {
             if (h->data && deep == 1)
                 free(h->data);
-            free(h);
+            list_node_free(h);
         }
         h = tmp;
     }
@@ -82,7 +95,7 @@ void list_clear(List *l, int deep) {
  * Complexity: O(1)
  */
 List *list_push(List *l, void *val) {
-    struct list_node *new_node = malloc(sizeof(struct list_node));
+    struct list_node *new_node = list_node_alloc();
     if (!new_node)
         return NULL;
     new_node->data = val;
@@ -102,7 +115,7 @@ List *list_push(List *l, void *val) {
  * Complexity: O(1)
  */
 List *list_push_back(List *l, void *val) {
-    struct list_node *new_node = malloc(sizeof(struct list_node));
+    struct list_node *new_node = list_node_alloc();
     if (!new_node)
         return NULL;
     new_node->data = val;
@@ -132,7 +145,7 @@ static struct list_node *list_node_remove(struct list_node *head,
         return NULL;
     if (cmp(head, node) == 0) {
         struct list_node *tmp_next = head->next;
-        free(head);
+        list_node_free(head);
         head = NULL;
 
         // Update remove counter
@@ -19,6 +19,13 @@ typedef struct list {
  */
 typedef int (*compare_func)(void *, void *);
 
+/*
+ * Allocate and release list nodes, they come from a pool shared by every
+ * list, nodes are released only through list_node_free
+ */
+struct list_node *list_node_alloc(void);
+void list_node_free(void *);
+
 /* Create an empty list */
 List *list_create(int (*destructor)(struct list_node*));
 
@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "config.h"
+#include "memory.h"
+
+/* Counters of a thread, a cache line of their own */
+struct memory_slot {
+    _Alignas(64) atomic_llong bytes[MEMORY_CATEGORIES];
+};
+
+static struct memory_slot slots[MEMORY_MAX_THREADS];
+
+/* Slots handed out so far, could exceed MEMORY_MAX_THREADS */
+static atomic_int nslots;
+
+static _Thread_local struct memory_slot *slot;
+
+/* The last slot is shared by the threads beyond the limit */
+static _Thread_local int shared;
+
+static const char *names[MEMORY_CATEGORIES] = {
+    "topics",
+    "trie",
+    "subscriptions",
+    "clients",
+    "queued",
+    "retained"
+};
+
+/* Claim a slot for the calling thread, on its first accounting */
+static struct memory_slot *memory_slot(void) {
+    if (!slot) {
+        int i = atomic_fetch_add(&nslots, 1);
+        shared = i >= MEMORY_MAX_THREADS - 1;
+        slot = &slots[shared ? MEMORY_MAX_THREADS - 1 : i];
+    }
+    return slot;
+}
+
+/*
+ * Counters can go negative, memory is often released by a thread other than
+ * the one which allocated it, only the sum over every slot is meaningful
+ */
+static inline void memory_update(enum memory_category category,
+                                 long long bytes) {
+    atomic_llong *counter = &memory_slot()->bytes[category];
+    if (shared) {
+        atomic_fetch_add_explicit(counter, bytes, memory_order_relaxed);
+        return;
+    }
+    long long value = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, value + bytes, memory_order_relaxed);
+}
+
+void memory_add(enum memory_category category, size_t bytes) {
+    memory_update(category, (long long) bytes);
+}
+
+void memory_sub(enum memory_category category, size_t bytes) {
+    memory_update(category, -(long long) bytes);
+}
+
+void *memory_alloc(enum memory_category category, size_t size) {
+    void *ptr = malloc(size);
+    if (ptr)
+        memory_add(category, size);
+    return ptr;
+}
+
+void memory_free(enum memory_category category, void *ptr, size_t size) {
+    if (!ptr)
+        return;
+    memory_sub(category, size);
+    free(ptr);
+}
+
+size_t memory_category_used(enum memory_category category) {
+    int n = atomic_load(&nslots);
+    if (n > MEMORY_MAX_THREADS)
+        n = MEMORY_MAX_THREADS;
+    long long total = 0;
+    for (int i = 0; i < n; i++)
+        total += atomic_load_explicit(&slots[i].bytes[category],
+                                      memory_order_relaxed);
+    return total > 0 ? (size_t) total : 0;
+}
+
+size_t memory_used(void) {
+    size_t total = 0;
+    for (int i = 0; i < MEMORY_CATEGORIES; i++)
+        total += memory_category_used(i);
+    return total;
+}
+
+bool memory_exceeded(void) {
+    return memory_used() > conf->max_memory;
+}
+
+const char *memory_category_name(enum memory_category category) {
+    return names[category];
+}
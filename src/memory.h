@@ -0,0 +1,54 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Memory accounting of the broker, every subsystem reports the bytes it
+ * takes and gives back to its own category, either through the allocation
+ * wrappers or directly for memory coming from elsewhere, e.g. the pools.
+ * The sum is checked against the `max_memory` configuration to decide when
+ * the memory policies apply.
+ *
+ * Each thread counts on its own slot, written by the owner only, so the
+ * allocation path takes no lock and shares no cache line with other
+ * threads. Readers sum the slots of every thread.
+ */
+
+/* Threads with a slot of their own, the ones after share a last slot */
+#define MEMORY_MAX_THREADS  128
+
+enum memory_category {
+    /* Interned topics, their names and level offsets */
+    MEMORY_TOPICS,
+    /* Nodes of the topic tree */
+    MEMORY_TRIE,
+    /* Subscriber entries and share groups */
+    MEMORY_SUBSCRIPTIONS,
+    /* Connected clients and the replies waiting to be written to them */
+    MEMORY_CLIENTS,
+    /* Messages queued to the fan-out workers and to persistent sessions */
+    MEMORY_QUEUED,
+    /* Messages held by the retained store */
+    MEMORY_RETAINED,
+    MEMORY_CATEGORIES
+};
+
+void memory_add(enum memory_category, size_t);
+void memory_sub(enum memory_category, size_t);
+
+/* malloc and free accounting the bytes to a category */
+void *memory_alloc(enum memory_category, size_t);
+void memory_free(enum memory_category, void *, size_t);
+
+/* Bytes accounted to a category and to all of them */
+size_t memory_category_used(enum memory_category);
+size_t memory_used(void);
+
+/* Return true if the memory accounted is over the configured max_memory */
+bool memory_exceeded(void);
+
+const char *memory_category_name(enum memory_category);
+
+#endif
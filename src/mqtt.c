@@ -2,27 +2,38 @@
 #include <string.h>
 #include "mqtt.h"
 #include "pack.h"
+#include "arena.h"
 
 static size_t unpack_mqtt_connect(const unsigned char *,
                                   union mqtt_header *,
-                                  union mqtt_packet *);
+                                  union mqtt_packet *,
+                                  struct arena *);
 static size_t unpack_mqtt_publish(const unsigned char *,
                                   union mqtt_header *,
-                                  union mqtt_packet *);
+                                  union mqtt_packet *,
+                                  struct arena *);
 static size_t unpack_mqtt_subscribe(const unsigned char *,
                                     union mqtt_header *,
-                                    union mqtt_packet *);
+                                    union mqtt_packet *,
+                                    struct arena *);
 static size_t unpack_mqtt_unsubscribe(const unsigned char *,
                                       union mqtt_header *,
-                                      union mqtt_packet *);
+                                      union mqtt_packet *,
+                                      struct arena *);
 static size_t unpack_mqtt_ack(const unsigned char *,
                               union mqtt_header *,
-                              union mqtt_packet *);
-static unsigned char *pack_mqtt_header(const union mqtt_header *);
-static unsigned char *pack_mqtt_ack(const union mqtt_packet *);
-static unsigned char *pack_mqtt_connack(const union mqtt_packet *);
-static unsigned char *pack_mqtt_suback(const union mqtt_packet *);
-static unsigned char *pack_mqtt_publish(const union mqtt_packet *);
+                              union mqtt_packet *,
+                              struct arena *);
+static unsigned char *pack_mqtt_header(const union mqtt_header *,
+                                       struct arena *);
+static unsigned char *pack_mqtt_ack(const union mqtt_packet *,
+                                    struct arena *);
+static unsigned char *pack_mqtt_connack(const union mqtt_packet *,
+                                        struct arena *);
+static unsigned char *pack_mqtt_suback(const union mqtt_packet *,
+                                       struct arena *);
+static unsigned char *pack_mqtt_publish(const union mqtt_packet *,
+                                        struct arena *);
 
 /*
  * MQTT v3.1.1 standard, Remaining length field on the fixed header can be at
@@ -72,11 +83,30 @@ unsigned long long mqtt_decode_length(const unsigned char **buf) {
 }
 
 /*
- * MQTT unpacking functions
+ * MQTT unpacking functions, every field is allocated on the arena of the
+ * request, the packet is valid till the arena is reset
  */
+
+/*
+ * Count the topic filters of a SUBSCRIBE or UNSUBSCRIBE payload, each one
+ * followed by `extra` bytes, e.g. the requested QoS
+ */
+static size_t count_tuples(const unsigned char *raw, size_t len, size_t extra) {
+    size_t n = 0;
+    while (len >= sizeof(uint16_t)) {
+        size_t tuple = sizeof(uint16_t) + ((raw[0] << 8) | raw[1]) + extra;
+        if (tuple > len)
+            break;
+        raw += tuple;
+        len -= tuple;
+        n++;
+    }
+    return n;
+}
 static size_t unpack_mqtt_connect(const unsigned char *raw,
                                   union mqtt_header *hdr,
-                                  union mqtt_packet *pkt) {
+                                  union mqtt_packet *pkt,
+                                  struct arena *arena) {
 
     struct mqtt_connect connect = { .header = *hdr };
     pkt->connect = connect;
@@ -105,7 +135,7 @@ static size_t unpack_mqtt_connect(const unsigned char *raw,
 
     /* Read the client id */
     if (cid_len > 0) {
-        pkt->connect.payload.client_id = malloc(cid_len + 1);
+        pkt->connect.payload.client_id = arena_alloc(arena, cid_len + 1);
         unpack_bytes((const uint8_t **) &raw, cid_len,
                      pkt->connect.payload.client_id);
     }
@@ -114,12 +144,12 @@ static size_t unpack_mqtt_connect(const unsigned char *raw,
     if (pkt->connect.bits.will == 1) {
 
         uint16_t will_topic_len = unpack_u16((const uint8_t **) &raw);
-        pkt->connect.payload.will_topic = malloc(will_topic_len + 1);
+        pkt->connect.payload.will_topic = arena_alloc(arena, will_topic_len + 1);
         unpack_bytes((const uint8_t **) &raw, will_topic_len,
                      pkt->connect.payload.will_topic);
 
         uint16_t will_message_len = unpack_u16((const uint8_t **) &raw);
-        pkt->connect.payload.will_message = malloc(will_message_len + 1);
+        pkt->connect.payload.will_message = arena_alloc(arena, will_message_len + 1);
         unpack_bytes((const uint8_t **) &raw, will_message_len,
                      pkt->connect.payload.will_message);
     }
@@ -127,7 +157,7 @@ static size_t unpack_mqtt_connect(const unsigned char *raw,
     /* Read the username if username flag is set */
     if (pkt->connect.bits.username == 1) {
         uint16_t username_len = unpack_u16((const uint8_t **) &raw);
-        pkt->connect.payload.username = malloc(username_len + 1);
+        pkt->connect.payload.username = arena_alloc(arena, username_len + 1);
         unpack_bytes((const uint8_t **) &raw, username_len,
                      pkt->connect.payload.username);
     }
@@ -135,7 +165,7 @@ static size_t unpack_mqtt_connect(const unsigned char *raw,
     /* Read the password if password flag is set */
     if (pkt->connect.bits.password == 1) {
         uint16_t password_len = unpack_u16((const uint8_t **) &raw);
-        pkt->connect.payload.password = malloc(password_len + 1);
+        pkt->connect.payload.password = arena_alloc(arena, password_len + 1);
         unpack_bytes((const uint8_t **) &raw, password_len,
                      pkt->connect.payload.password);
     }
@@ -145,7 +175,8 @@ static size_t unpack_mqtt_connect(const unsigned char *raw,
 
 static size_t unpack_mqtt_publish(const unsigned char *raw,
                                   union mqtt_header *hdr,
-                                  union mqtt_packet *pkt) {
+                                  union mqtt_packet *pkt,
+                                  struct arena *arena) {
     struct mqtt_publish publish = { .header = *hdr };
     pkt->publish = publish;
 
@@ -158,10 +189,10 @@ static size_t unpack_mqtt_publish(const unsigned char *raw,
     /* Read topic length and topic of the soon-to-be-published message */
     uint16_t topic_len = unpack_u16((const uint8_t **) &raw);
     pkt->publish.topiclen = topic_len;
-    pkt->publish.topic = malloc(topic_len + 1);
+    pkt->publish.topic = arena_alloc(arena, topic_len + 1);
     unpack_bytes((const uint8_t **) &raw, topic_len, pkt->publish.topic);
 
-    uint16_t message_len = len;
+    size_t message_len = len;
 
     /* Read packet id */
     if (publish.header.bits.qos > AT_MOST_ONCE) {
@@ -175,15 +206,20 @@ static size_t unpack_mqtt_publish(const unsigned char *raw,
      */
     message_len -= (sizeof(uint16_t) + topic_len);
     pkt->publish.payloadlen = message_len;
-    pkt->publish.payload = malloc(message_len + 1);
-    unpack_bytes((const uint8_t **) &raw, message_len, pkt->publish.payload);
+
+    /*
+     * The payload is referenced where it lies, the caller can have read it
+     * somewhere else and point it there
+     */
+    pkt->publish.payload = (unsigned char *) raw;
 
     return len;
 }
 
 static size_t unpack_mqtt_subscribe(const unsigned char *raw,
                                     union mqtt_header *hdr,
-                                    union mqtt_packet *pkt) {
+                                    union mqtt_packet *pkt,
+                                    struct arena *arena) {
     struct mqtt_subscribe subscribe = { .header = *hdr };
 
     /*
@@ -197,6 +233,10 @@ static size_t unpack_mqtt_subscribe(const unsigned char *raw,
     subscribe.pkt_id = unpack_u16((const uint8_t **) &raw);
     remaining_bytes -= sizeof(uint16_t);
 
+    /* Count the tuples first, the array is allocated once on the arena */
+    size_t ntuples = count_tuples(raw, remaining_bytes, sizeof(uint8_t));
+    subscribe.tuples = arena_alloc(arena, ntuples * sizeof(*subscribe.tuples));
+
     /*
      * Read in a loop all remaining bytes specified by len of the Fixed Header.
      * From now on the payload consists of 3-tuples formed by:
@@ -204,18 +244,14 @@ static size_t unpack_mqtt_subscribe(const unsigned char *raw,
      *  - topic filter (string)
      *  - qos
      */
-    int i = 0;
-    while (remaining_bytes > 0) {
+    size_t i = 0;
+    while (i < ntuples) {
 
         /* Read length bytes of the first topic filter */
         uint16_t topic_len = unpack_u16((const uint8_t **) &raw);
         remaining_bytes -= sizeof(uint16_t);
-
-        /* We have to make room for additional incoming tuples */
-        subscribe.tuples = realloc(subscribe.tuples,
-                                   (i+1) * sizeof(*subscribe.tuples));
         subscribe.tuples[i].topic_len = topic_len;
-        subscribe.tuples[i].topic = malloc(topic_len + 1);
+        subscribe.tuples[i].topic = arena_alloc(arena, topic_len + 1);
         unpack_bytes((const uint8_t **) &raw, topic_len,
                      subscribe.tuples[i].topic);
         remaining_bytes -= topic_len;
@@ -232,7 +268,8 @@ static size_t unpack_mqtt_subscribe(const unsigned char *raw,
 
 static size_t unpack_mqtt_unsubscribe(const unsigned char *raw,
                                       union mqtt_header *hdr,
-                                      union mqtt_packet *pkt) {
+                                      union mqtt_packet *pkt,
+                                      struct arena *arena) {
     struct mqtt_unsubscribe unsubscribe = { .header = *hdr };
 
     /*
@@ -245,6 +282,9 @@ static size_t unpack_mqtt_unsubscribe(const unsigned char *raw,
     /* Read packet id */
     unsubscribe.pkt_id = unpack_u16((const uint8_t **) &raw);
     remaining_bytes -= sizeof(uint16_t);
+    size_t ntuples = count_tuples(raw, remaining_bytes, 0);
+    unsubscribe.tuples = arena_alloc(arena,
+                                     ntuples * sizeof(*unsubscribe.tuples));
 
     /*
      * Read in a loop all remaining bytes specified by len of the Fixed Header.
@@ -252,18 +292,14 @@ static size_t unpack_mqtt_unsubscribe(const unsigned char *raw,
      *  - topic length
      *  - topic filter (string)
      */
-    int i = 0;
-    while (remaining_bytes > 0) {
+    size_t i = 0;
+    while (i < ntuples) {
 
         /* Read length bytes of the first topic filter */
         uint16_t topic_len = unpack_u16((const uint8_t **) &raw);
         remaining_bytes -= sizeof(uint16_t);
-
-        /* We have to make room for additional incoming tuples */
-        unsubscribe.tuples = realloc(unsubscribe.tuples,
-                                     (i+1) * sizeof(*unsubscribe.tuples));
         unsubscribe.tuples[i].topic_len = topic_len;
-        unsubscribe.tuples[i].topic = malloc(topic_len + 1);
+        unsubscribe.tuples[i].topic = arena_alloc(arena, topic_len + 1);
         unpack_bytes((const uint8_t **) &raw, topic_len,
                      unsubscribe.tuples[i].topic);
         remaining_bytes -= topic_len;
@@ -279,7 +315,9 @@ static size_t unpack_mqtt_unsubscribe(const unsigned char *raw,
 
 static size_t unpack_mqtt_ack(const unsigned char *raw,
                               union mqtt_header *hdr,
-                              union mqtt_packet *pkt) {
+                              union mqtt_packet *pkt,
+                              struct arena *arena) {
+    (void) arena;
     struct mqtt_ack ack = { .header = *hdr };
 
     /*
@@ -296,7 +334,8 @@ static size_t unpack_mqtt_ack(const unsigned char *raw,
 
 typedef size_t mqtt_unpack_handler(const unsigned char *,
                                    union mqtt_header *,
-                                   union mqtt_packet *);
+                                   union mqtt_packet *,
+                                   struct arena *);
 
 /*
  * Unpack functions mapping unpacking_handlers positioned in the array based
@@ -316,7 +355,8 @@ static mqtt_unpack_handler *unpack_handlers[11] = {
     unpack_mqtt_unsubscribe
 };
 
-int unpack_mqtt_packet(const unsigned char *raw, union mqtt_packet *pkt) {
+int unpack_mqtt_packet(const unsigned char *raw, union mqtt_packet *pkt,
+                       struct arena *arena) {
     int rc = 0;
 
     /* Read first byte of the fixed header */
@@ -330,15 +370,14 @@ int unpack_mqtt_packet(const unsigned char *raw, union mqtt_packet *pkt) {
         pkt->header = header;
     else
         /* Call the appropriate unpack handler based on the message type */
-        rc = unpack_handlers[header.bits.type](++raw, &header, pkt);
+        rc = unpack_handlers[header.bits.type](++raw, &header, pkt, arena);
 
     return rc;
 }
 
 /*
- * MQTT packets building functions
- * TO-DO: Replace static union/struct pointers to 
- *        struct/uniones allocated using malloc
+ * MQTT packets building functions, fixed size packets are built on static
+ * storage, the ones with a variable part on the arena of the request
  */
 
 union mqtt_header *mqtt_packet_header(unsigned char byte) {
@@ -364,26 +403,28 @@ struct mqtt_connack *mqtt_packet_connack(unsigned char byte,
     return &connack;
 }
 
-struct mqtt_suback *mqtt_packet_suback(unsigned char byte,
+struct mqtt_suback *mqtt_packet_suback(struct arena *arena,
+                                       unsigned char byte,
                                        unsigned short pkt_id,
                                        unsigned char *rcs,
                                        unsigned short rcslen) {
-    struct mqtt_suback *suback = malloc(sizeof(*suback));
+    struct mqtt_suback *suback = arena_alloc(arena, sizeof(*suback));
     suback->header.byte = byte;
     suback->pkt_id = pkt_id;
     suback->rcslen = rcslen;
-    suback->rcs = malloc(rcslen);
+    suback->rcs = arena_alloc(arena, rcslen);
     memcpy(suback->rcs, rcs, rcslen);
     return suback;
 }
 
-struct mqtt_publish *mqtt_packet_publish(unsigned char byte,
+struct mqtt_publish *mqtt_packet_publish(struct arena *arena,
+                                         unsigned char byte,
                                          unsigned short pkt_id,
                                          size_t topiclen,
                                          unsigned char *topic,
                                          size_t payloadlen,
                                          unsigned char *payload) {
-    struct mqtt_publish *publish = malloc(sizeof(*publish));
+    struct mqtt_publish *publish = arena_alloc(arena, sizeof(*publish));
     publish->header.byte = byte;
     publish->pkt_id = pkt_id;
     publish->topiclen = topiclen;
@@ -393,42 +434,12 @@ struct mqtt_publish *mqtt_packet_publish(unsigned char byte,
     return publish;
 }
 
-void mqtt_packet_release(union mqtt_packet *pkt, unsigned type) {
-    switch (type) {
-        case CONNECT:
-            free(pkt->connect.payload.client_id);
-            if (pkt->connect.bits.username == 1)
-                free(pkt->connect.payload.username);
-            if (pkt->connect.bits.password == 1)
-                free(pkt->connect.payload.password);
-            if (pkt->connect.bits.will == 1) {
-                free(pkt->connect.payload.will_message);
-                free(pkt->connect.payload.will_topic);
-            }
-            break;
-        case SUBSCRIBE:
-        case UNSUBSCRIBE:
-            for (unsigned i = 0; i < pkt->subscribe.tuples_len; i++)
-                free(pkt->subscribe.tuples[i].topic);
-            free(pkt->subscribe.tuples);
-            break;
-        case SUBACK:
-            free(pkt->suback.rcs);
-            break;
-        case PUBLISH:
-            free(pkt->publish.topic);
-            free(pkt->publish.payload);
-            break;
-        default:
-            break;
-    }
-}
-
 /*
  * MQTT packets packing functions
  */
 
-typedef unsigned char *mqtt_pack_handler(const union mqtt_packet *);
+typedef unsigned char *mqtt_pack_handler(const union mqtt_packet *,
+                                         struct arena *);
 
 static mqtt_pack_handler *pack_handlers[13] = {
     NULL,
@@ -446,8 +457,9 @@ static mqtt_pack_handler *pack_handlers[13] = {
     NULL
 };
 
-static unsigned char *pack_mqtt_header(const union mqtt_header *hdr) {
-    unsigned char *packed = malloc(MQTT_HEADER_LEN);
+static unsigned char *pack_mqtt_header(const union mqtt_header *hdr,
+                                       struct arena *arena) {
+    unsigned char *packed = arena_alloc(arena, MQTT_HEADER_LEN);
     unsigned char *ptr = packed;
     pack_u8(&ptr, hdr->byte);
 
@@ -456,8 +468,9 @@ static unsigned char *pack_mqtt_header(const union mqtt_header *hdr) {
     return packed;
 }
 
-static unsigned char *pack_mqtt_ack(const union mqtt_packet *pkt) {
-    unsigned char *packed = malloc(MQTT_ACK_LEN);
+static unsigned char *pack_mqtt_ack(const union mqtt_packet *pkt,
+                                    struct arena *arena) {
+    unsigned char *packed = arena_alloc(arena, MQTT_ACK_LEN);
     unsigned char *ptr = packed;
     pack_u8(&ptr, pkt->ack.header.byte);
     mqtt_encode_length(ptr, MQTT_HEADER_LEN);
@@ -466,8 +479,9 @@ static unsigned char *pack_mqtt_ack(const union mqtt_packet *pkt) {
     return packed;
 }
 
-static unsigned char *pack_mqtt_connack(const union mqtt_packet *pkt) {
-    unsigned char *packed = malloc(MQTT_ACK_LEN);
+static unsigned char *pack_mqtt_connack(const union mqtt_packet *pkt,
+                                        struct arena *arena) {
+    unsigned char *packed = arena_alloc(arena, MQTT_ACK_LEN);
     unsigned char *ptr = packed;
     pack_u8(&ptr, pkt->connack.header.byte);
     mqtt_encode_length(ptr, MQTT_HEADER_LEN);
@@ -477,9 +491,10 @@ static unsigned char *pack_mqtt_connack(const union mqtt_packet *pkt) {
     return packed;
 }
 
-static unsigned char *pack_mqtt_suback(const union mqtt_packet *pkt) {
+static unsigned char *pack_mqtt_suback(const union mqtt_packet *pkt,
+                                       struct arena *arena) {
     size_t pktlen = MQTT_HEADER_LEN + sizeof(uint16_t) + pkt->suback.rcslen;
-    unsigned char *packed = malloc(pktlen + 0);
+    unsigned char *packed = arena_alloc(arena, pktlen);
     unsigned char *ptr = packed;
     pack_u8(&ptr, pkt->suback.header.byte);
     size_t len = sizeof(uint16_t) + pkt->suback.rcslen;
@@ -491,7 +506,8 @@ static unsigned char *pack_mqtt_suback(const union mqtt_packet *pkt) {
     return packed;
 }
 
-static unsigned char *pack_mqtt_publish(const union mqtt_packet *pkt) {
+static unsigned char *pack_mqtt_publish(const union mqtt_packet *pkt,
+                                        struct arena *arena) {
 
     /*
      * We must calculate the total length of the packet including header and
@@ -515,7 +531,7 @@ static unsigned char *pack_mqtt_publish(const union mqtt_packet *pkt) {
 
     pktlen += remaininglen_offset;
 
-    unsigned char *packed = malloc(pktlen);
+    unsigned char *packed = arena_alloc(arena, pktlen);
     unsigned char *ptr = packed;
     pack_u8(&ptr, pkt->publish.header.byte);
 
@@ -531,20 +547,21 @@ static unsigned char *pack_mqtt_publish(const union mqtt_packet *pkt) {
 
     // Topic len followed by topic name in bytes
     pack_u16(&ptr, pkt->publish.topiclen);
-    pack_bytes(&ptr, pkt->publish.topic);
+    pack_bytes(&ptr, pkt->publish.topic, pkt->publish.topiclen);
 
     // Packet id
     if (pkt->header.bits.qos > AT_MOST_ONCE)
         pack_u16(&ptr, pkt->publish.pkt_id);
 
     // Finally the payload, same way of topic, payload len -> payload
-    pack_bytes(&ptr, pkt->publish.payload);
+    pack_bytes(&ptr, pkt->publish.payload, pkt->publish.payloadlen);
 
     return packed;
 }
 
-unsigned char *pack_mqtt_packet(const union mqtt_packet *pkt, unsigned type) {
+unsigned char *pack_mqtt_packet(const union mqtt_packet *pkt, unsigned type,
+                                struct arena *arena) {
     if (type == PINGREQ || type == PINGRESP)
-        return pack_mqtt_header(&pkt->header);
-    return pack_handlers[type](pkt);
+        return pack_mqtt_header(&pkt->header, arena);
+    return pack_handlers[type](pkt, arena);
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define MQTT_H
 
 #include <stdio.h>
+#include "arena.h"
 
 #define MQTT_HEADER_LEN 2
 #define MQTT_ACK_LEN    4
@@ -14,12 +15,15 @@
 #define PUBLISH_BYTE  0x30
 #define PUBACK_BYTE   0x40
 #define PUBREC_BYTE   0x50
-#define PUBREL_BYTE   0x60
+#define PUBREL_BYTE   0x62
 #define PUBCOMP_BYTE  0x70
 #define SUBACK_BYTE   0x90
 #define UNSUBACK_BYTE 0xB0
 #define PINGRESP_BYTE 0xD0
 
+/* SUBACK return code for a rejected subscription */
+#define SUBACK_FAILURE 0x80
+
 /* Message types */
 enum packet_type {
     CONNECT     = 1,
@@ -123,7 +127,7 @@ struct mqtt_publish {
     unsigned short pkt_id;
     unsigned short topiclen;
     unsigned char *topic;
-    unsigned short payloadlen;
+    size_t payloadlen;
     unsigned char *payload;
 };
 
@@ -155,8 +159,15 @@ union mqtt_packet {
 
 int mqtt_encode_length(unsigned char *, size_t);
 unsigned long long mqtt_decode_length(const unsigned char **);
-int unpack_mqtt_packet(const unsigned char *, union mqtt_packet *);
-unsigned char *pack_mqtt_packet(const union mqtt_packet *, unsigned);
+
+/*
+ * Packets are unpacked and packed on the arena of the request, no field needs
+ * to be released alone
+ */
+int unpack_mqtt_packet(const unsigned char *, union mqtt_packet *,
+                       struct arena *);
+unsigned char *pack_mqtt_packet(const union mqtt_packet *, unsigned,
+                                struct arena *);
 
 
 union mqtt_header *mqtt_packet_header(unsigned char);
@@ -164,11 +175,12 @@ struct mqtt_ack *mqtt_packet_ack(unsigned char , unsigned short);
 struct mqtt_connack *mqtt_packet_connack(unsigned char ,
                                          unsigned char ,
                                          unsigned char);
-struct mqtt_suback *mqtt_packet_suback(unsigned char, unsigned short,
-                                       unsigned char *, unsigned short);
-struct mqtt_publish *mqtt_packet_publish(unsigned char, unsigned short, size_t,
+struct mqtt_suback *mqtt_packet_suback(struct arena *, unsigned char,
+                                       unsigned short, unsigned char *,
+                                       unsigned short);
+struct mqtt_publish *mqtt_packet_publish(struct arena *, unsigned char,
+                                         unsigned short, size_t,
                                          unsigned char *,
                                          size_t, unsigned char *);
-void mqtt_packet_release(union mqtt_packet *, unsigned);
 
 #endif
\ No newline at end of file
@@ -13,6 +13,10 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <linux/sockios.h>
+#include "pack.h"
 #include "network.h"
 #include "config.h"
 
@@ -186,6 +190,125 @@ err:
     return -1;
 }
 
+ssize_t recv_bytes_wait(int fd, unsigned char *buf, size_t len, int timeout) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = recv(fd, buf + total, len - total, 0);
+        if (n == 0)
+            break;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                goto err;
+            struct pollfd pfd = { .fd = fd, .events = POLLIN };
+            if (poll(&pfd, 1, timeout) <= 0)
+                break;
+            continue;
+        }
+        total += n;
+    }
+    return total;
+err:
+    fprintf(stderr, "recv(2) - error reading data: %s", strerror(errno));
+    return -1;
+}
+
+/* Query the send queue of the socket, SIOCOUTQ works on TCP and UNIX sockets */
+ssize_t socket_pending_bytes(int fd) {
+    int pending = 0;
+    if (ioctl(fd, SIOCOUTQ, &pending) < 0)
+        return -1;
+    return pending;
+}
+
+/******************************
+ *       CLOSURE TABLE        *
+ ******************************/
+
+void closure_table_init(struct closure_table *table) {
+    table->nchunks = 0;
+    table->chunks = NULL;
+}
+
+void closure_table_free(struct closure_table *table) {
+    for (size_t i = 0; i < table->nchunks; i++) {
+        if (!table->chunks[i])
+            continue;
+        for (int j = 0; j < CLOSURE_CHUNK; j++) {
+            struct closure *c = &table->chunks[i][j];
+            if ((c->generation & 1) && c->payload)
+                bytestring_release(c->payload);
+        }
+        free(table->chunks[i]);
+    }
+    free(table->chunks);
+    closure_table_init(table);
+}
+
+struct closure *closure_table_acquire(struct closure_table *table, int fd) {
+    size_t chunk = fd / CLOSURE_CHUNK;
+    if (chunk >= table->nchunks) {
+        size_t nchunks = chunk + 1;
+        struct closure **chunks =
+            realloc(table->chunks, nchunks * sizeof(*chunks));
+        if (!chunks)
+            return NULL;
+        for (size_t i = table->nchunks; i < nchunks; i++)
+            chunks[i] = NULL;
+        table->chunks = chunks;
+        table->nchunks = nchunks;
+    }
+    if (!table->chunks[chunk]) {
+        table->chunks[chunk] = calloc(CLOSURE_CHUNK, sizeof(struct closure));
+        if (!table->chunks[chunk])
+            return NULL;
+    }
+    struct closure *c = &table->chunks[chunk][fd % CLOSURE_CHUNK];
+    c->generation += (c->generation & 1) ? 2 : 1;
+    c->fd = fd;
+    c->obj = NULL;
+    c->payload = NULL;
+    return c;
+}
+
+void closure_table_release(struct closure_table *table, struct closure *c) {
+    (void) table;
+    if (c->payload)
+        bytestring_release(c->payload);
+    c->payload = NULL;
+    c->obj = NULL;
+    c->generation++;
+}
+
+struct closure *closure_table_get(const struct closure_table *table,
+                                  conn_handle handle) {
+    int fd = (int) (handle & 0xffffffff);
+    uint32_t generation = handle >> 32;
+    size_t chunk = fd / CLOSURE_CHUNK;
+    if (fd < 0 || chunk >= table->nchunks || !table->chunks[chunk])
+        return NULL;
+    struct closure *c = &table->chunks[chunk][fd % CLOSURE_CHUNK];
+    return c->generation == generation && (generation & 1) ? c : NULL;
+}
+
+void closure_table_map(struct closure_table *table,
+                       void (*func)(struct closure *, void *), void *arg) {
+    for (size_t i = 0; i < table->nchunks; i++) {
+        if (!table->chunks[i])
+            continue;
+        for (int j = 0; j < CLOSURE_CHUNK; j++) {
+            struct closure *c = &table->chunks[i][j];
+            if (c->generation & 1)
+                func(c, arg);
+        }
+    }
+}
+
+conn_handle closure_handle(const struct closure *c) {
+    return ((conn_handle) c->generation << 32) | (uint32_t) c->fd;
+}
+
 /******************************
  *         EPOLL APIS         *
  ******************************/
@@ -267,9 +390,9 @@ void evloop_add_periodic_task(struct evloop *loop,
         return;
     }
 
-    // Add the timer to the event loop
+    // Add the timer to the event loop, the closure is told apart by pointer
     struct epoll_event ev;
-    ev.data.fd = timerfd;
+    ev.data.ptr = cb;
     ev.events = EPOLLIN;
     if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, timerfd, &ev) < 0) {
         perror("epoll_ctl(2): EPOLLIN");
@@ -317,21 +440,18 @@ int evloop_wait(struct evloop *el) {
                 (!(el->events[i].events & EPOLLIN) &&
                  !(el->events[i].events & EPOLLOUT))) {
 
-                /* An error has occured on this fd, or the socket is not
-                   ready for reading, closing connection */
-                perror ("epoll_wait(2)");
-                shutdown(el->events[i].data.fd, 0);
-                close(el->events[i].data.fd);
+                /* An error has occured on this fd, or the peer hung up, the
+                   callback gets called anyway: reading or writing on the
+                   socket fails and the owner of the closure can release the
+                   client along with its state */
                 el->status = errno;
-                continue;
             }
             struct closure *closure = el->events[i].data.ptr;
             periodic_done = 0;
-            for (int i = 0; i < el->periodic_nr && periodic_done == 0; i++) {
-                if (el->events[i].data.fd == el->periodic_tasks[i]->timerfd) {
-                    struct closure *c = el->periodic_tasks[i]->closure;
-                    (void) read(el->events[i].data.fd, &timer, 8);
-                    c->call(el, c->args);
+            for (int j = 0; j < el->periodic_nr && periodic_done == 0; j++) {
+                if (closure == el->periodic_tasks[j]->closure) {
+                    (void) read(el->periodic_tasks[j]->timerfd, &timer, 8);
+                    closure->call(el, closure->args);
                     periodic_done = 1;
                 }
             }
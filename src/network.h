@@ -45,6 +45,19 @@ ssize_t send_bytes(int, const unsigned char *, size_t);
  */
 ssize_t recv_bytes(int, unsigned char *, size_t);
 
+/*
+ * Receive exactly a number of bytes, waiting up to a timeout in milliseconds
+ * each time the descriptor has nothing to read. Return the number of bytes,
+ * less on disconnection or timeout, -1 on error.
+ */
+ssize_t recv_bytes_wait(int, unsigned char *, size_t, int);
+
+/*
+ * Return the number of bytes written on a socket descriptor but not yet sent
+ * out by the kernel, -1 on error
+ */
+ssize_t socket_pending_bytes(int);
+
 typedef union epoll_data {
    void        *ptr;
    int          fd;
@@ -76,21 +89,63 @@ typedef void callback(struct evloop *, void *);
 /*
  * Callback object, represents a callback function with an associated
  * descriptor if needed, args is a void pointer which can be a structure
- * pointing to callback parameters and closure_id is a UUID for the closure
- * itself.
+ * pointing to callback parameters and generation counts the connections
+ * which used the closure, see struct closure_table.
  * The last two fields are payload, a serialized version of the result of
  * a callback, ready to be sent through wire and a function pointer to the
  * callback function to execute.
  */
 struct closure {
     int fd;
+    uint32_t generation;
     void *obj;
     void *args;
-    char closure_id[UUID_LEN];
     struct bytestring *payload;
     callback *call;
 };
 
+/*
+ * Handle of a connection, the fd of the connection in the low 32 bits and
+ * the generation of its closure in the high ones. A handle stays valid as
+ * long as the connection is open, once closed and its fd reused by a new
+ * connection the handle is detected as stale.
+ */
+typedef uint64_t conn_handle;
+
+/* Closures in a chunk of the closure table */
+#define CLOSURE_CHUNK 1024
+
+/*
+ * Closures of the open connections, a flat array indexed by fd grown by
+ * chunks, which never move once allocated. The generation of a closure is
+ * odd while in use, even when released.
+ */
+struct closure_table {
+    size_t nchunks;
+    struct closure **chunks;
+};
+
+void closure_table_init(struct closure_table *);
+void closure_table_free(struct closure_table *);
+
+/*
+ * Take the closure of a newly accepted fd, bumping its generation. Return
+ * NULL if out of memory.
+ */
+struct closure *closure_table_acquire(struct closure_table *, int);
+
+/* Release the closure of a closed connection, along with its payload */
+void closure_table_release(struct closure_table *, struct closure *);
+
+/* Return the closure of a handle, or NULL if the handle is stale */
+struct closure *closure_table_get(const struct closure_table *, conn_handle);
+
+/* Call a function on every closure in use */
+void closure_table_map(struct closure_table *,
+                       void (*)(struct closure *, void *), void *);
+
+conn_handle closure_handle(const struct closure *);
+
 struct evloop *evloop_create(int, int);
 void evloop_init(struct evloop *, int, int);
 void evloop_free(struct evloop *);
@@ -49,8 +49,7 @@ void pack_u32(uint8_t **buf, uint32_t val) {
     (*buf) += sizeof(uint32_t);
 }
 
-void pack_bytes(uint8_t **buf, uint8_t *str) {
-    size_t len = strlen((char *) str);
+void pack_bytes(uint8_t **buf, const uint8_t *str, size_t len) {
     memcpy(*buf, str, len);
     (*buf) += len;
 }
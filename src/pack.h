@@ -28,7 +28,7 @@ void pack_u16(uint8_t **, uint16_t);
 void pack_u32(uint8_t **, uint32_t);
 
 // append len bytes into the bytestring
-void pack_bytes(uint8_t **, uint8_t *);
+void pack_bytes(uint8_t **, const uint8_t *, size_t);
 
 /*
  * bytestring structure, provides a convenient way of handling byte string data.
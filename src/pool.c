@@ -0,0 +1,238 @@
+#define _DEFAULT_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdalign.h>
+#include <sys/mman.h>
+#include "util.h"
+#include "config.h"
+#include "pool.h"
+
+/* Per-thread cache of the free objects of a pool */
+struct pool_cache {
+    void *head;
+    size_t len;
+};
+
+static _Thread_local struct pool_cache caches[POOL_MAX];
+
+/* Pools registered on their first block, listed by the stats */
+static struct pool *pools[POOL_MAX];
+
+static atomic_int npools;
+
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Huge page currently carved into blocks, shared by every pool so objects
+ * of different kinds touched together by the fan-out sit on the same pages
+ */
+static struct {
+    pthread_mutex_t lock;
+    char *page;
+    size_t left;
+    /* Mode in use, lowered on the first failure to map a page */
+    int mode;
+    bool init;
+} huge = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, HUGE_PAGES_OFF, false };
+
+/*
+ * Map a transparent huge page, the mapping is made twice as large to get a
+ * POOL_HUGE_PAGE aligned range in it, the excess is unmapped right away
+ */
+static char *huge_page_madvise(void) {
+    size_t len = 2 * POOL_HUGE_PAGE;
+    char *raw = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return NULL;
+    char *page = (char *) (((uintptr_t) raw + POOL_HUGE_PAGE - 1) &
+                           ~((uintptr_t) POOL_HUGE_PAGE - 1));
+    if (page > raw)
+        munmap(raw, page - raw);
+    if (raw + len > page + POOL_HUGE_PAGE)
+        munmap(page + POOL_HUGE_PAGE, raw + len - (page + POOL_HUGE_PAGE));
+    if (madvise(page, POOL_HUGE_PAGE, MADV_HUGEPAGE) < 0) {
+        munmap(page, POOL_HUGE_PAGE);
+        return NULL;
+    }
+    return page;
+}
+
+/* Map a new huge page, stepping down to the next mode on failure */
+static char *huge_page_map(void) {
+    if (huge.mode == HUGE_PAGES_HUGETLB) {
+        char *page = mmap(NULL, POOL_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (page != MAP_FAILED)
+            return page;
+        sol_warning("No reserved huge pages available for the pools, "
+                    "falling back to transparent huge pages");
+        huge.mode = HUGE_PAGES_MADVISE;
+    }
+    char *page = huge_page_madvise();
+    if (!page) {
+        sol_warning("Transparent huge pages not available for the pools, "
+                    "falling back to the heap");
+        huge.mode = HUGE_PAGES_OFF;
+    }
+    return page;
+}
+
+/*
+ * Allocate the memory of a block, from a huge page if enabled, blocks never
+ * span two pages and the tail of a page too short for a block is wasted
+ */
+static void *pool_block_alloc(size_t size) {
+    if (size > POOL_HUGE_PAGE)
+        return malloc(size);
+    pthread_mutex_lock(&huge.lock);
+    if (!huge.init) {
+        huge.mode = conf ? conf->huge_pages : HUGE_PAGES_OFF;
+        huge.init = true;
+    }
+    void *block = NULL;
+    if (huge.mode != HUGE_PAGES_OFF && huge.left < size) {
+        char *page = huge_page_map();
+        if (page) {
+            huge.page = page;
+            huge.left = POOL_HUGE_PAGE;
+        }
+    }
+    if (huge.mode != HUGE_PAGES_OFF && huge.left >= size) {
+        block = huge.page;
+        huge.page += size;
+        huge.left -= size;
+    }
+    pthread_mutex_unlock(&huge.lock);
+    return block ? block : malloc(size);
+}
+
+/* Objects are aligned like malloc'ed memory and big enough for a link */
+static size_t pool_object_size(const struct pool *p) {
+    size_t align = alignof(max_align_t);
+    size_t size = p->size < sizeof(void *) ? sizeof(void *) : p->size;
+    return (size + align - 1) & ~(align - 1);
+}
+
+static inline void *next_of(void *obj) {
+    return *(void **) obj;
+}
+
+static inline void set_next(void *obj, void *next) {
+    *(void **) obj = next;
+}
+
+/* Assign a cache slot to the pool, once */
+static int pool_register(struct pool *p) {
+    pthread_mutex_lock(&pools_lock);
+    if (atomic_load(&p->id) < 0) {
+        int n = atomic_load(&npools);
+        if (n == POOL_MAX) {
+            pthread_mutex_unlock(&pools_lock);
+            abort();
+        }
+        pools[n] = p;
+        atomic_store(&p->id, n);
+        atomic_store(&npools, n + 1);
+    }
+    pthread_mutex_unlock(&pools_lock);
+    return atomic_load(&p->id);
+}
+
+/*
+ * Refill the cache of the calling thread with half of its capacity, taken
+ * from the shared free list or carved out of a new block
+ */
+static void pool_refill(struct pool *p, struct pool_cache *c) {
+    pthread_mutex_lock(&p->lock);
+    while (p->free && c->len < POOL_CACHE_SIZE / 2) {
+        void *obj = p->free;
+        p->free = next_of(obj);
+        set_next(obj, c->head);
+        c->head = obj;
+        c->len++;
+    }
+    pthread_mutex_unlock(&p->lock);
+    if (c->len > 0)
+        return;
+    size_t size = pool_object_size(p);
+    char *block = pool_block_alloc(size * POOL_BLOCK);
+    if (!block)
+        return;
+    atomic_fetch_add(&p->allocated, POOL_BLOCK);
+
+    /* Keep half of the block in the cache, the rest goes to the pool */
+    void *shared = NULL;
+    for (size_t i = 0; i < POOL_BLOCK; i++) {
+        void *obj = block + i * size;
+        if (i < POOL_CACHE_SIZE / 2) {
+            set_next(obj, c->head);
+            c->head = obj;
+            c->len++;
+        } else {
+            set_next(obj, shared);
+            shared = obj;
+        }
+    }
+    if (!shared)
+        return;
+    void *last = shared;
+    while (next_of(last))
+        last = next_of(last);
+    pthread_mutex_lock(&p->lock);
+    set_next(last, p->free);
+    p->free = shared;
+    pthread_mutex_unlock(&p->lock);
+}
+
+void *pool_alloc(struct pool *p) {
+    int id = atomic_load_explicit(&p->id, memory_order_acquire);
+    if (id < 0)
+        id = pool_register(p);
+    struct pool_cache *c = &caches[id];
+    if (!c->head)
+        pool_refill(p, c);
+    void *obj = c->head;
+    if (!obj)
+        return NULL;
+    c->head = next_of(obj);
+    c->len--;
+    atomic_fetch_add_explicit(&p->used, 1, memory_order_relaxed);
+    return obj;
+}
+
+/*
+ * Objects can be released by a thread other than the one which allocated
+ * them, e.g. after a grace period of the epoch module, they just go to the
+ * cache of the releasing thread
+ */
+void pool_free(struct pool *p, void *obj) {
+    if (!obj)
+        return;
+    struct pool_cache *c = &caches[atomic_load(&p->id)];
+    set_next(obj, c->head);
+    c->head = obj;
+    c->len++;
+    atomic_fetch_sub_explicit(&p->used, 1, memory_order_relaxed);
+    if (c->len < POOL_CACHE_SIZE)
+        return;
+
+    /* Cache full, move half of it back to the shared free list */
+    void *first = c->head, *last = c->head;
+    for (size_t i = 1; i < POOL_CACHE_SIZE / 2; i++)
+        last = next_of(last);
+    c->head = next_of(last);
+    c->len -= POOL_CACHE_SIZE / 2;
+    pthread_mutex_lock(&p->lock);
+    set_next(last, p->free);
+    p->free = first;
+    pthread_mutex_unlock(&p->lock);
+}
+
+int pool_count(void) {
+    return atomic_load(&npools);
+}
+
+struct pool *pool_get(int i) {
+    return i < pool_count() ? pools[i] : NULL;
+}
@@ -0,0 +1,61 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * Free-list pools of fixed size objects, for the small structures allocated
+ * and released at high rate on the connect, subscribe and publish paths.
+ *
+ * Objects are carved out of blocks of POOL_BLOCK objects and never given
+ * back to the allocator, released ones are pushed on a free list to be
+ * handed out again. Every thread keeps a cache of free objects of each
+ * pool, taking and returning them in batches to the shared free list, so
+ * most allocations take no lock at all.
+ *
+ * With the `huge_pages` configuration blocks are carved out of 2MB huge
+ * pages instead of the heap, the fan-out walks thousands of clients and
+ * buffers per publish and huge pages take most TLB misses off that walk.
+ */
+
+/* Max number of pools, each thread keeps a cache for every one of them */
+#define POOL_MAX            8
+
+/* Free objects kept by a thread cache, half of them move in batches */
+#define POOL_CACHE_SIZE     64
+
+/* Objects carved out of every block allocated by a pool */
+#define POOL_BLOCK          256
+
+/* Size of the huge pages blocks are carved from, if enabled */
+#define POOL_HUGE_PAGE      (2 * 1024 * 1024)
+
+struct pool {
+    const char *name;
+    size_t size;
+    /* Slot of the pool on the thread caches, -1 till the first block */
+    atomic_int id;
+    pthread_mutex_t lock;
+    /* Shared free list, objects are linked through their first word */
+    void *free;
+    /* Objects carved out of blocks so far */
+    atomic_size_t allocated;
+    /* Objects handed out and not yet released */
+    atomic_size_t used;
+};
+
+/* Static initializer of a pool of objects of a given type */
+#define POOL_INITIALIZER(name, type) \
+    { (name), sizeof(type), -1, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 }
+
+void *pool_alloc(struct pool *);
+void pool_free(struct pool *, void *);
+
+/* Number of pools which allocated a block, and the pool at an index */
+int pool_count(void);
+struct pool *pool_get(int);
+
+#endif
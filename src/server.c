@@ -1,18 +1,28 @@
 #define _POSIX_C_SOURCE 200809L
 #include <time.h>
 #include <errno.h>
+#include <sched.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
 #include "pack.h"
 #include "util.h"
 #include "mqtt.h"
 #include "core.h"
+#include "pool.h"
+#include "arena.h"
+#include "memory.h"
 #include "network.h"
 #include "hashtable.h"
+#include "epoch.h"
+#include "inflight.h"
+#include "wal.h"
 #include "config.h"
 #include "server.h"
 
@@ -25,9 +35,27 @@ static const double SOL_SECONDS = 88775.24;
  */
 static struct sol_info info;
 
-/* Broker global instance, contains the topic trie and the clients hashtable */
+/* Broker global instance, contains the topic trie and the client registry */
 static struct sol sol;
 
+/* Closures of the open connections, indexed by fd */
+static struct closure_table closures;
+
+/*
+ * Scratch arena of the event loop, packets are unpacked and replies packed on
+ * it, everything is released at once after each packet is dispatched
+ */
+static struct arena scratch = ARENA_INITIALIZER;
+
+/*
+ * Message of the PUBLISH being handled when it outlives the request, QoS 1
+ * and 2 or retained, recv_packet reads its payload straight into it
+ */
+static struct message *inbound = NULL;
+
+/* Id of the last message logged to the write-ahead log */
+static uint64_t wal_message_id = 0;
+
 /*
  * Prototype for a command handler, it accepts a pointer to the closure as the
  * link to the client sender of the command and a pointer to the packet itself
@@ -74,6 +102,156 @@ struct connection {
     int fd;
 };
 
+/*
+ * Output queue of a client, every packet to it goes through here under its
+ * write lock, sent by the event loop and by the fan-out workers alike. Bytes
+ * are written straight to the socket while nothing waits before them, what
+ * the socket doesn't take is queued and written out by on_write once the
+ * socket is writable again: packets are never cut nor interleaved. Kept
+ * between writes, so a client exchanging acks doesn't allocate, and given
+ * back to the pool by the idle sweep once the client goes quiet.
+ */
+struct reply {
+    unsigned char *data;
+    /* Bytes queued, the first `sent` of them already written */
+    size_t len;
+    size_t sent;
+    size_t capacity;
+    /* Set on every write, cleared by the idle sweep */
+    bool used;
+    unsigned char buf[REPLY_INLINE];
+};
+
+static struct pool reply_pool = POOL_INITIALIZER("replies", struct reply);
+
+/*
+ * Connections with output queued, waiting for the event loop to watch their
+ * socket for writability. Any thread can queue output to a client, only the
+ * event loop arms the closures, it's woken up through an eventfd.
+ */
+static struct {
+    pthread_mutex_t lock;
+    conn_handle *conns;
+    size_t len;
+    size_t capacity;
+} pending_output = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+
+static struct closure output_closure;
+
+/* Drop the storage of an output queue longer than REPLY_INLINE */
+static void reply_shrink(struct reply *r) {
+    if (r->data != r->buf)
+        memory_free(MEMORY_CLIENTS, r->data, r->capacity);
+    r->data = r->buf;
+    r->capacity = REPLY_INLINE;
+    r->len = 0;
+    r->sent = 0;
+}
+
+/* Give the output queue of a client back to the pool, under its write lock */
+static void reply_release(struct sol_client *c) {
+    struct reply *r = c->out;
+    if (!r)
+        return;
+    reply_shrink(r);
+    memory_sub(MEMORY_CLIENTS, sizeof(*r));
+    pool_free(&reply_pool, r);
+    c->out = NULL;
+    c->queued = 0;
+}
+
+/* Append bytes to the output queue of a client, under its write lock */
+static void reply_append(struct sol_client *c, const unsigned char *data,
+                         size_t len) {
+    struct reply *r = c->out;
+    if (!r) {
+        r = pool_alloc(&reply_pool);
+        memory_add(MEMORY_CLIENTS, sizeof(*r));
+        r->data = r->buf;
+        r->capacity = REPLY_INLINE;
+        r->len = 0;
+        r->sent = 0;
+        c->out = r;
+    }
+    if (r->len + len > r->capacity) {
+        size_t capacity = (r->len + len) * 2;
+        unsigned char *buf = memory_alloc(MEMORY_CLIENTS, capacity);
+        memcpy(buf, r->data, r->len);
+        if (r->data != r->buf)
+            memory_free(MEMORY_CLIENTS, r->data, r->capacity);
+        r->data = buf;
+        r->capacity = capacity;
+    }
+    memcpy(r->data + r->len, data, len);
+    r->len += len;
+    r->used = true;
+    c->queued += len;
+}
+
+/* Bytes queued to a client and not yet written, under its write lock */
+static size_t reply_pending(const struct sol_client *c) {
+    return c->queued;
+}
+
+/* Ask the event loop to write out the output queued to a client */
+static void output_schedule(struct sol_client *c) {
+    pthread_mutex_lock(&pending_output.lock);
+    if (pending_output.len == pending_output.capacity) {
+        pending_output.capacity =
+            pending_output.capacity ? pending_output.capacity * 2 : 64;
+        pending_output.conns =
+            realloc(pending_output.conns,
+                    pending_output.capacity * sizeof(conn_handle));
+    }
+    pending_output.conns[pending_output.len++] = c->conn;
+    bool wake = pending_output.len == 1;
+    pthread_mutex_unlock(&pending_output.lock);
+    if (wake) {
+        uint64_t one = 1;
+        (void) write(output_closure.fd, &one, sizeof(one));
+    }
+}
+
+/*
+ * Send bytes to a client, called under its write lock. What can't be written
+ * right away is queued after the output already waiting, in order.
+ */
+static void client_send(struct sol_client *c, const unsigned char *data,
+                        size_t len) {
+    if (c->fd < 0 || len == 0)
+        return;
+    size_t sent = 0;
+    if (reply_pending(c) == 0) {
+        ssize_t n = send_bytes(c->fd, data, len);
+        if (n < 0) {
+            sol_error("Error writing on socket to client %s: %s",
+                      c->client_id, strerror(errno));
+            return;
+        }
+        info.bytes_sent += n;
+        sent = n;
+        if (c->out)
+            c->out->used = true;
+        if (sent == len)
+            return;
+        if (c->out)
+            c->out->len = c->out->sent = 0;
+        reply_append(c, data + sent, len - sent);
+        output_schedule(c);
+        return;
+    }
+    reply_append(c, data, len);
+}
+
+/* Send a reply to the client of a connection */
+static void reply_send(struct closure *cb, const unsigned char *data,
+                       size_t len) {
+    struct sol_client *c = cb->obj;
+    pthread_mutex_lock(&c->write_lock);
+    client_send(c, data, len);
+    pthread_mutex_unlock(&c->write_lock);
+}
+
 /* I/O closures, for the 3 main operation of the server
  * - Accept a new connecting client
  * - Read incoming bytes from connected clients
@@ -83,12 +261,67 @@ static void on_read(struct evloop *, void *);
 static void on_write(struct evloop *, void *);
 static void on_accept(struct evloop *, void *);
 
+/* Arm the closures of the connections with output queued for writing */
+static void on_output(struct evloop *, void *);
+
+/* Arm a closure for its next read, or for a write if output is queued */
+static void closure_rearm(struct evloop *, struct closure *);
+
+/*
+ * Write-ahead log callback, sends the acks of the publishes made durable and
+ * writes a checkpoint once the log moved to a new segment
+ */
+static void on_durable(struct evloop *, void *);
+
 /*
  * Periodic task callback, will be executed every N seconds defined on the
  * configuration
  */
 static void publish_stats(struct evloop *, void *);
 
+/*
+ * Periodic task callback, gives the buffers of the connections idle since
+ * the previous run back to their pools
+ */
+static void idle_sweep(struct evloop *, void *);
+
+/*
+ * Periodic task callback, sends again the QoS 1 and 2 messages left without
+ * an ack for longer than the configured retry time
+ */
+static void inflight_retry(struct evloop *, void *);
+
+/* Start the fan-out workers, if enabled by the configuration */
+static void fanout_start(void);
+
+/* Close a connection, releasing its closure and its client */
+static void connection_close(struct closure *);
+
+/*
+ * State of the replay, the WAL_QUEUED records of a checkpoint are for the
+ * session of the WAL_SESSION record before them
+ */
+struct wal_restore {
+    struct sol_client *session;
+};
+
+/* Restore the state of the broker from a record of the write-ahead log */
+static void wal_replay(const struct wal_record *, void *);
+
+/* Write a snapshot of the state to the log, if a checkpoint is due */
+static void wal_checkpoint_run(void);
+
+/* Log the start of the persistent session of a client, or its end */
+static void wal_session_log(const char *, bool);
+
+/* Log a change to the subscriptions of a persistent session */
+static void wal_subscription_log(const struct sol_client *, unsigned char,
+                                 unsigned, const char *, const char *,
+                                 size_t, bool);
+
+/* Log the ack of a message by the client of a persistent session */
+static void wal_ack_log(const struct sol_client *, uint64_t);
+
 /*
  * Accept a new incoming connection assigning ip address and socket descriptor
  * to the connection structure pointer passed as argument
@@ -131,22 +364,32 @@ static void on_accept(struct evloop *loop, void *arg) {
     struct closure *server = arg;
     struct connection conn;
 
-    accept_new_client(server->fd, &conn);
+    if (accept_new_client(server->fd, &conn) < 0) {
+        evloop_rearm_callback_read(loop, server);
+        return;
+    }
+
+    /* Over max_memory new connections are refused till memory is released */
+    if ((conf->memory_policy & MEMORY_REJECT_CONNECTIONS) &&
+        memory_exceeded()) {
+        sol_warning("Memory limit reached, refusing connection from %s",
+                    conn.ip);
+        close(conn.fd);
+        evloop_rearm_callback_read(loop, server);
+        return;
+    }
 
-    /* Create a client structure to handle his context connection */
-    struct closure *client_closure = malloc(sizeof(*client_closure));
-    if (!client_closure)
+    /* Take the closure of the fd to handle the context of the connection */
+    struct closure *client_closure = closure_table_acquire(&closures, conn.fd);
+    if (!client_closure) {
+        close(conn.fd);
+        evloop_rearm_callback_read(loop, server);
         return;
+    }
 
     /* Populate client structure */
-    client_closure->fd = conn.fd;
-    client_closure->obj = NULL;
-    client_closure->payload = NULL;
     client_closure->args = client_closure;
     client_closure->call = on_read;
-    generate_uuid(client_closure->closure_id);
-
-    hashtable_put(sol.closures, client_closure->closure_id, client_closure);
 
     /* Add it to the epoll loop */
     evloop_add_callback(loop, client_closure);
@@ -166,22 +409,23 @@ static void on_accept(struct evloop *loop, void *arg) {
  * packed, which is contained in the first 2 bytes in order to read packet
  * type and total length that we need to recv to complete the packet.
  *
- * This function accept a socket fd, a buffer to read incoming streams of
- * bytes and a structure formed by 2 fields:
+ * This function accept a socket fd, a pointer to the buffer to read incoming
+ * streams of bytes into and a pointer to a command:
  *
- * - buf -> a byte buffer, it will be malloc'ed in the function and it will
- *          contain the serialized bytes of the incoming packet
- * - flags -> flags pointer, copy the flag setting of the incoming packet,
- *            again for simplicity and convenience of the caller.
+ * - buf -> set to a byte buffer allocated on the scratch arena, sized to the
+ *          packet, it will contain the serialized bytes of the incoming packet
+ * - command -> copy the first byte of the incoming packet, again for
+ *              simplicity and convenience of the caller.
  */
-static ssize_t recv_packet(int clientfd, unsigned char *buf, char *command) {
+static ssize_t recv_packet(int clientfd, unsigned char **buf, char *command) {
     ssize_t nbytes = 0;
+    /* Fixed header and, for a PUBLISH, the length of its topic */
+    unsigned char header[7];
 
     /* Read the first byte, it should contain the message type code */
-    if ((nbytes = recv_bytes(clientfd, buf, 1)) <= 0)
+    if ((nbytes = recv_bytes(clientfd, header, 1)) <= 0)
         return -ERRCLIENTDC;
-    unsigned char byte = *buf;
-    buf++;
+    unsigned char byte = *header;
     if (DISCONNECT < byte || CONNECT > byte)
         return -ERRPACKETERR;
 
@@ -190,13 +434,14 @@ static ssize_t recv_packet(int clientfd, unsigned char *buf, char *command) {
      * bytes based on the size stored, so byte 2-5 is dedicated to the packet
      * length.
      */
-    unsigned char buff[4];
+    unsigned char *buff = header + 1;
     int count = 0;
     int n = 0;
     do {
-        if ((n = recv_bytes(clientfd, buf+count, 1)) <= 0)
+        if (count == 4)
+            return -ERRPACKETERR;
+        if ((n = recv_bytes_wait(clientfd, buff+count, 1, RECV_TIMEOUT)) != 1)
             return -ERRCLIENTDC;
-        buff[count] = buf[count];
         nbytes += n;
     } while (buff[count++] & (1 << 7));
 
@@ -213,18 +458,102 @@ static ssize_t recv_packet(int clientfd, unsigned char *buf, char *command) {
         goto exit;
     }
 
-    /* Read remaining bytes to complete the packet */
-    if ((n = recv_bytes(clientfd, buf + 1, tlen)) < 0)
-        goto err;
-    nbytes += n;
+    /*
+     * A PUBLISH which has to outlive the request leaves its payload out of
+     * the packet buffer, the topic length tells where the payload starts
+     */
+    union mqtt_header hdr = { .byte = byte };
+    size_t hlen = tlen;
+    size_t head = 0;
+    if (hdr.bits.type == PUBLISH &&
+        (hdr.bits.qos > AT_MOST_ONCE || hdr.bits.retain == 1)) {
+        if (tlen < sizeof(uint16_t))
+            return -ERRPACKETERR;
+        if (recv_bytes_wait(clientfd, header + 1 + count, 2,
+                            RECV_TIMEOUT) != 2)
+            return -ERRCLIENTDC;
+        head = sizeof(uint16_t);
+        hlen = head + (header[1 + count] << 8 | header[2 + count]);
+        if (hdr.bits.qos > AT_MOST_ONCE)
+            hlen += sizeof(uint16_t);
+        if (hlen > tlen)
+            return -ERRPACKETERR;
+    }
+
+    /*
+     * The buffer takes just the packet, the arena drops the blocks of the
+     * larger ones on reset
+     */
+    *buf = arena_alloc(&scratch, 1 + count + hlen);
+    if (!*buf)
+        return -ERRNOMEM;
+    memcpy(*buf, header, 1 + count + head);
+
+    /*
+     * Read remaining bytes to complete the packet, a connection dropping or
+     * stalling before is closed by the caller
+     */
+    n = recv_bytes_wait(clientfd, *buf + 1 + count + head, hlen - head,
+                        RECV_TIMEOUT);
+    if (n != (ssize_t) (hlen - head))
+        return -ERRCLIENTDC;
+    nbytes += n + head;
+
+    /*
+     * The payload goes to the buffer of the message, shared by reference
+     * with retained store, inflight windows and sessions. An empty retained
+     * QoS 0 message just clears the retained one, no message needed.
+     */
+    size_t payloadlen = tlen - hlen;
+    if (hlen < tlen || hdr.bits.qos > AT_MOST_ONCE) {
+        unsigned char *payload = NULL;
+        if (payloadlen > 0 && !(payload = malloc(payloadlen)))
+            return -ERRNOMEM;
+        n = recv_bytes_wait(clientfd, payload, payloadlen, RECV_TIMEOUT);
+        if (n != (ssize_t) payloadlen) {
+            free(payload);
+            return -ERRCLIENTDC;
+        }
+        nbytes += n;
+        inbound = message_create(hdr.bits.qos, payloadlen, payload);
+    }
     *command = byte;
 exit:
     return nbytes;
-err:
-    shutdown(clientfd, 0);
-    close(clientfd);
-    return nbytes;
+}
 
+/* A retained message evicted is cleared in the log too */
+static void wal_retained_clear(struct topic *t, void *arg) {
+    (void) arg;
+    struct wal_record r = {
+        .type = WAL_RETAIN,
+        .qos = AT_MOST_ONCE,
+        .topiclen = t->len,
+        .payloadlen = 0,
+        .topic = t->name,
+        .payload = NULL
+    };
+    wal_append(&r, NULL);
+}
+
+/*
+ * Over max_memory the oldest retained messages are evicted till the memory
+ * accounted gets back under the limit, if the policy allows it
+ */
+static void memory_shed(void) {
+    if (!(conf->memory_policy & MEMORY_EVICT_RETAINED))
+        return;
+    size_t used = memory_used();
+    if (used <= conf->max_memory)
+        return;
+    size_t evicted = sol_retained_evict(&sol, used - conf->max_memory,
+                                        wal_enabled() ?
+                                        wal_retained_clear : NULL, NULL);
+    if (evicted > 0) {
+        info.bytes_evicted += evicted;
+        sol_warning("Memory limit reached, evicted %zu bytes of retained "
+                    "messages", evicted);
+    }
 }
 
 /* Handle incoming requests, after being accepted or after a reply */
@@ -232,7 +561,7 @@ static void on_read(struct evloop *loop, void *arg) {
     struct closure *cb = arg;
 
     /* Raw bytes buffer to handle input from client */
-    unsigned char *buffer = malloc(conf->max_request_size);
+    unsigned char *buffer = NULL;
     ssize_t bytes = 0;
     char command = 0;
 
@@ -242,17 +571,18 @@ static void on_read(struct evloop *loop, void *arg) {
      * send the size of the remaining packet as the second byte. By knowing it
      * we know if the packet is ready to be deserialized and used.
      */
-    bytes = recv_packet(cb->fd, buffer, &command);
+    bytes = recv_packet(cb->fd, &buffer, &command);
 
     /*
-     * Looks like we got a client disconnection.
+     * Looks like we got a client disconnection, the client and its
+     * subscriptions must be removed like on a DISCONNECT.
      *
      * TODO: Set a error_handler for ERRMAXREQSIZE instead of dropping client
      *       connection, explicitly returning an informative error code to the
      *       client connected.
      */
     if (bytes == -ERRCLIENTDC || bytes == -ERRMAXREQSIZE)
-        goto exit;
+        goto errdc;
 
     /*
      * If a not correct packet received, we must free the buffer and reset the
@@ -260,6 +590,11 @@ static void on_read(struct evloop *loop, void *arg) {
      */
     if (bytes == -ERRPACKETERR)
         goto errdc;
+
+    if (bytes == -ERRNOMEM) {
+        sol_error("Out of memory reading a packet");
+        goto errdc;
+    }
     info.bytes_recv++;
 
     /*
@@ -267,64 +602,129 @@ static void on_read(struct evloop *loop, void *arg) {
      * correct handler based on the type of the operation.
      */
     union mqtt_packet packet;
-    unpack_mqtt_packet(buffer, &packet);
+    unpack_mqtt_packet(buffer, &packet, &scratch);
     union mqtt_header hdr = { .byte = command };
+    if (inbound)
+        packet.publish.payload = inbound->payload;
+
+    /* Any packet keeps the client out of the idle sweep */
+    if (cb->obj)
+        ((struct sol_client *) cb->obj)->active = true;
 
     /* Execute command callback */
     int rc = handlers[hdr.bits.type](cb, &packet);
-    if (rc == REARM_W) {
-        cb->call = on_write;
-
-        /*
-         * Reset handler to read_handler in order to read new incoming data and
-         * EPOLL event for read fds
-         */
-        evloop_rearm_callback_write(loop, cb);
-    } else if (rc == REARM_R) {
-        cb->call = on_read;
-        evloop_rearm_callback_read(loop, cb);
+    if (rc == REARM_W || rc == REARM_R)
+        closure_rearm(loop, cb);
+
+    /* Collect some unused topics, then release what no reader can see */
+    size_t reclaimed = sol_topic_gc(&sol, TOPIC_GC_STEP);
+    if (reclaimed > 0) {
+        info.bytes_reclaimed += reclaimed;
+        sol_debug("Reclaimed %zu bytes of unused topics", reclaimed);
     }
-    // Disconnect packet received
-exit:
-    free(buffer);
+    message_release(inbound);
+    inbound = NULL;
+    memory_shed();
+    epoch_reclaim();
+    arena_reset(&scratch);
     return;
 errdc:
-    free(buffer);
+    message_release(inbound);
+    inbound = NULL;
+    arena_reset(&scratch);
     sol_error("Dropping client");
-    shutdown(cb->fd, 0);
-    close(cb->fd);
-    hashtable_del(sol.clients, ((struct sol_client *) cb->obj)->client_id);
-    hashtable_del(sol.closures, cb->closure_id);
-    info.nclients--;
-    info.nconnections--;
+
+    /* The connection can drop before a CONNECT was received */
+    connection_close(cb);
     return;
 }
 
+/*
+ * The next packet is read once the output queued to the client is written
+ * out, a client not reading what it's sent stops being read too
+ */
+static void closure_rearm(struct evloop *loop, struct closure *cb) {
+    struct sol_client *c = cb->obj;
+    size_t pending = 0;
+    if (c) {
+        pthread_mutex_lock(&c->write_lock);
+        pending = reply_pending(c);
+        pthread_mutex_unlock(&c->write_lock);
+    }
+    if (pending > 0) {
+        cb->call = on_write;
+        evloop_rearm_callback_write(loop, cb);
+    } else {
+        cb->call = on_read;
+        evloop_rearm_callback_read(loop, cb);
+    }
+}
+
+/*
+ * Write out the output queued to the client of a connection, `sent` tracks
+ * the bytes already written, the write is re-armed till the whole queue is
+ * out. On error the queue is dropped, the next read notices the connection
+ * is gone.
+ */
 static void on_write(struct evloop *loop, void *arg) {
     struct closure *cb = arg;
-    ssize_t sent;
-    if ((sent = send_bytes(cb->fd, cb->payload->data, cb->payload->size)) < 0)
-        sol_error("Error writing on socket to client %s: %s",
-                  ((struct sol_client *) cb->obj)->client_id, strerror(errno));
-
-    // Update information stats
-    info.bytes_sent += sent;
-    bytestring_release(cb->payload);
-    cb->payload = NULL;
+    struct sol_client *c = cb->obj;
+    if (c) {
+        pthread_mutex_lock(&c->write_lock);
+        struct reply *r = c->out;
+        if (r && r->len > r->sent) {
+            ssize_t sent = send_bytes(cb->fd, r->data + r->sent,
+                                      r->len - r->sent);
+            if (sent < 0) {
+                sol_error("Error writing on socket to client %s: %s",
+                          c->client_id, strerror(errno));
+                r->sent = r->len;
+            } else {
+                info.bytes_sent += sent;
+                r->sent += sent;
+            }
+        }
+        if (r && r->sent == r->len) {
+            reply_shrink(r);
+        } else if (r && r->sent > r->len / 2) {
+            memmove(r->data, r->data + r->sent, r->len - r->sent);
+            r->len -= r->sent;
+            r->sent = 0;
+        }
+        c->queued = r ? r->len - r->sent : 0;
+        pthread_mutex_unlock(&c->write_lock);
+    }
+    closure_rearm(loop, cb);
+}
 
-    /*
-     * Re-arm callback by setting EPOLL event on EPOLLIN to read fds and
-     * re-assigning the callback `on_read` for the next event
-     */
-    cb->call = on_read;
-    evloop_rearm_callback_read(loop, cb);
+static void on_output(struct evloop *loop, void *arg) {
+    struct closure *output = arg;
+    uint64_t count;
+    (void) read(output->fd, &count, sizeof(count));
+    pthread_mutex_lock(&pending_output.lock);
+    conn_handle *conns = pending_output.conns;
+    size_t len = pending_output.len;
+    pending_output.conns = NULL;
+    pending_output.len = pending_output.capacity = 0;
+    pthread_mutex_unlock(&pending_output.lock);
+
+    /* A closure waiting for a write already is left as it is */
+    for (size_t i = 0; i < len; i++) {
+        struct closure *cb = closure_table_get(&closures, conns[i]);
+        if (cb && cb->call == on_read) {
+            cb->call = on_write;
+            evloop_rearm_callback_write(loop, cb);
+        }
+    }
+    free(conns);
+    evloop_rearm_callback_read(loop, output);
 }
 
 /*
  * Statistics topics, published every N seconds defined by configuration
  * interval
  */
-#define SYS_TOPICS 14
+#define SYS_TOPICS 16
 
 static const char *sys_topics[SYS_TOPICS] = {
     "$SOL/",
@@ -340,7 +740,9 @@ static const char *sys_topics[SYS_TOPICS] = {
     "$SOL/broker/bytes/received/",
     "$SOL/broker/messages/sent/",
     "$SOL/broker/messages/received/",
-    "$SOL/broker/memory/used"
+    "$SOL/broker/memory/used",
+    "$SOL/broker/messages/queued",
+    "$SOL/broker/bytes/queued"
 };
 
 static void run(struct evloop *loop) {
@@ -350,39 +752,130 @@ static void run(struct evloop *loop) {
     }
 }
 
+/* Connected clients, released through the epoch module */
+static struct pool client_pool = POOL_INITIALIZER("clients",
+                                                  struct sol_client);
+
+/* Topic hints of the clients publishing */
+static struct pool hints_pool = POOL_INITIALIZER("hints",
+                                                 struct topic_hint[TOPIC_HINTS]);
+
+/* Memory accounted for a client */
+static size_t client_size(const struct sol_client *client) {
+    size_t size = sizeof(*client);
+    if (client->client_id != client->id_buf)
+        size += strlen(client->client_id) + 1;
+    return size;
+}
+
 /*
- * Cleanup function to be passed in as destructor to the Hashtable for
- * connecting clients
+ * Create a client offline, not yet registered, with a persistent session
+ * unless it asked for a clean one
  */
-static int client_destructor(struct hashtable_entry *entry) {
-    if (!entry)
-        return -1;
-    struct sol_client *client = entry->val;
-    if (client->client_id)
+static struct sol_client *client_create(const char *cid, bool clean_session) {
+    struct sol_client *client = pool_alloc(&client_pool);
+    client->fd = -1;
+    client->conn = 0;
+    size_t cidlen = strlen(cid);
+    if (cidlen < CLIENT_ID_INLINE) {
+        memcpy(client->id_buf, cid, cidlen + 1);
+        client->client_id = client->id_buf;
+    } else {
+        client->client_id = strdup(cid);
+    }
+    memory_add(MEMORY_CLIENTS, client_size(client));
+    client->active = true;
+    client->session = clean_session ? NULL : session_create();
+    client->subscribed = NULL;
+    client->hints = NULL;
+    client->inflight = NULL;
+    client->pubrec_ids = NULL;
+    client->out = NULL;
+    client->queued = 0;
+    pthread_mutex_init(&client->write_lock, NULL);
+    return client;
+}
+
+/* Give the topic hints of a client back to their pool */
+static void client_release_hints(struct sol_client *client) {
+    if (!client->hints)
+        return;
+    memory_sub(MEMORY_CLIENTS, sizeof(struct topic_hint[TOPIC_HINTS]));
+    pool_free(&hints_pool, client->hints);
+    client->hints = NULL;
+}
+
+/* Release a client, publishers could still be reading it till reclaimed */
+static void client_free(void *ptr) {
+    struct sol_client *client = ptr;
+    memory_sub(MEMORY_CLIENTS, client_size(client));
+    if (client->client_id != client->id_buf)
         free(client->client_id);
-    free(client);
-    return 0;
+    if (client->session) {
+        info.messages_queued -= client->session->len;
+        info.bytes_queued -= client->session->bytes;
+        session_free(client->session);
+    }
+    client_release_hints(client);
+    reply_release(client);
+    inflight_free(client->inflight);
+    pkt_id_bitmap_free(client->pubrec_ids);
+    pthread_mutex_destroy(&client->write_lock);
+    pool_free(&client_pool, client);
 }
 
 /*
- * Cleanup function to be passed in as destructor to the Hashtable for
- * registered closures.
+ * Release a client removed from the registry, every subscription of the
+ * client is removed from the topics through the client index, so no topic
+ * keeps a dangling reference.
  */
-static int closure_destructor(struct hashtable_entry *entry) {
-    if (!entry)
-        return -1;
-    struct closure *closure = entry->val;
-    if (closure->payload)
-        bytestring_release(closure->payload);
-    free(closure);
-    return 0;
+static void client_destroy(struct sol_client *client) {
+    pthread_mutex_lock(&sol.lock);
+    sol_client_unsubscribe(&sol, client, NULL, NULL, 0, false);
+    pthread_mutex_unlock(&sol.lock);
+
+    /* A fan-out job could still be writing to it, the fd can be reused */
+    pthread_mutex_lock(&client->write_lock);
+    client->fd = -1;
+    pthread_mutex_unlock(&client->write_lock);
+    epoch_retire(client, client_free);
+}
+
+/*
+ * Close a connection, its client is removed from the registry and released
+ * unless another connection took over its client id in the meanwhile
+ */
+static void connection_close(struct closure *cb) {
+    struct sol_client *client = cb->obj;
+
+    /*
+     * Fan-out workers stop writing to the client before the fd is closed, a
+     * persistent session stays registered, offline, till its client connects
+     * again
+     */
+    if (client && client->session) {
+        pthread_mutex_lock(&client->write_lock);
+        client->fd = -1;
+        client->conn = 0;
+        reply_release(client);
+        pthread_mutex_unlock(&client->write_lock);
+        client_release_hints(client);
+    } else if (client && sol_client_remove(&sol, client)) {
+        client_destroy(client);
+    }
+    shutdown(cb->fd, 0);
+    close(cb->fd);
+    closure_table_release(&closures, cb);
+    info.nclients--;
+    info.nconnections--;
 }
 
 int start_server(const char *addr, const char *port) {
     /* Initialize global Sol instance */
-    trie_init(&sol.topics);
-    sol.clients = hashtable_create(client_destructor);
-    sol.closures = hashtable_create(closure_destructor);
+    sol_init(&sol);
+    epoch_register();
+    closure_table_init(&closures);
+    fanout_start();
 
     struct closure server_closure;
 
@@ -391,11 +884,32 @@ int start_server(const char *addr, const char *port) {
     server_closure.payload = NULL;
     server_closure.args = &server_closure;
     server_closure.call = on_accept;
-    generate_uuid(server_closure.closure_id);
 
     /* Generate stats topics */
-    for (int i = 0; i < SYS_TOPICS; i++)
-        sol_topic_put(&sol, topic_create(strdup(sys_topics[i])));
+    for (int i = 0; i < SYS_TOPICS; i++) {
+        struct topic *t = topic_create(strdup(sys_topics[i]));
+        topic_ref(t);
+        sol_topic_put(&sol, t);
+    }
+
+    /* Sessions and retained messages are restored before any connection */
+    struct closure wal_closure = {
+        .fd = -1,
+        .payload = NULL,
+        .args = &wal_closure,
+        .call = on_durable
+    };
+    if (conf->wal_dir[0] != '\0') {
+        epoch_enter();
+        struct wal_restore restore = { NULL };
+        wal_closure.fd = wal_open(conf->wal_dir, wal_replay, &restore);
+        epoch_exit();
+        if (wal_closure.fd < 0) {
+            sol_error("Unable to open the write-ahead log in %s",
+                      conf->wal_dir);
+            return -1;
+        }
+    }
     struct evloop *event_loop = evloop_create(EPOLL_MAX_EVENTS, EPOLL_TIMEOUT);
 
     /* Set socket in EPOLLIN flag mode, ready to read data */
@@ -409,137 +923,726 @@ int start_server(const char *addr, const char *port) {
         .args = &sys_closure,
         .call = publish_stats
     };
-    generate_uuid(sys_closure.closure_id);
 
     /* Schedule as periodic task to be executed every 5 seconds */
     evloop_add_periodic_task(event_loop, conf->stats_pub_interval,
                              0, &sys_closure);
+
+    /* Release the buffers of idle connections */
+    struct closure idle_closure = {
+        .fd = 0,
+        .payload = NULL,
+        .args = &idle_closure,
+        .call = idle_sweep
+    };
+    evloop_add_periodic_task(event_loop, conf->idle_release_time,
+                             0, &idle_closure);
+
+    /* Send again the unacknowledged messages */
+    struct closure retry_closure = {
+        .fd = 0,
+        .payload = NULL,
+        .args = &retry_closure,
+        .call = inflight_retry
+    };
+    evloop_add_periodic_task(event_loop, conf->inflight_retry_time,
+                             0, &retry_closure);
+
+    /* Output queued by the fan-out workers and by the event loop */
+    output_closure.fd = eventfd(0, EFD_NONBLOCK);
+    output_closure.payload = NULL;
+    output_closure.args = &output_closure;
+    output_closure.call = on_output;
+    evloop_add_callback(event_loop, &output_closure);
+
+    /* Acks of the publishes waiting for the log, and its checkpoints */
+    if (wal_enabled()) {
+        evloop_add_callback(event_loop, &wal_closure);
+        wal_checkpoint_run();
+    }
     sol_info("Server start");
     info.start_time = time(NULL);
     run(event_loop);
-    hashtable_release(sol.clients);
-    hashtable_release(sol.closures);
+    wal_close();
+    sol_client_clear(&sol, client_destroy);
+    closure_table_free(&closures);
+    arena_release(&scratch);
     sol_info("Sol v%s exiting", VERSION);
     return 0;
 }
 
-static void publish_message(unsigned short pkt_id,
-                            unsigned short topiclen,
-                            const char *topic,
-                            unsigned short payloadlen,
-                            unsigned char *payload) {
-
-    /* Retrieve the Topic structure from the global map, exit if not found */
-    struct topic *t = sol_topic_get(&sol, topic);
-    if (!t)
-        return;
+/* Size in bytes of a packed PUBLISH packet */
+static size_t publish_len(const union mqtt_packet *pkt) {
+    size_t publen = MQTT_HEADER_LEN + sizeof(uint16_t) +
+        pkt->publish.topiclen + pkt->publish.payloadlen;
+    if (pkt->publish.header.bits.qos > AT_MOST_ONCE)
+        publen += sizeof(uint16_t);
+    int remaininglen_offset = 0;
+    if ((publen - 1) > 0x200000)
+        remaininglen_offset = 3;
+    else if ((publen - 1) > 0x4000)
+        remaininglen_offset = 2;
+    else if ((publen - 1) > 0x80)
+        remaininglen_offset = 1;
+    return publen + remaininglen_offset;
+}
 
-    /* Build MQTT packet with command PUBLISH */
-    union mqtt_packet pkt;
-    struct mqtt_publish *p = mqtt_packet_publish(PUBLISH_BYTE,
-                                                 pkt_id,
-                                                 topiclen,
-                                                 (unsigned char *) topic,
-                                                 payloadlen,
-                                                 payload);
-    pkt.publish = *p;
-    size_t len;
-    unsigned char *packed;
+/*
+ * Build a PUBLISH packet of a message on a topic, the topic name of the
+ * packet is not NUL terminated, it's not meant to be logged
+ */
+static void message_packet(union mqtt_packet *pkt, const struct topic *t,
+                           const struct message *m, unsigned char byte,
+                           unsigned short pkt_id) {
+    pkt->publish.header.byte = byte;
+    pkt->publish.pkt_id = pkt_id;
+    pkt->publish.topiclen = t->len;
+    pkt->publish.topic = (unsigned char *) t->name;
+    pkt->publish.payloadlen = m->payloadlen;
+    pkt->publish.payload = m->payload;
+}
 
-    /* Send payload through TCP to all subscribed clients of the topic */
-    struct list_node *cur = t->subscribers->head;
-    size_t sent = 0L;
-    for (; cur; cur = cur->next) {
-        sol_debug("Sending PUBLISH (d%i, q%u, r%i, m%u, %s, ... (%i bytes))",
-                  pkt.publish.header.bits.dup,
-                  pkt.publish.header.bits.qos,
-                  pkt.publish.header.bits.retain,
-                  pkt.publish.pkt_id,
-                  pkt.publish.topic,
-                  pkt.publish.payloadlen);
-        len = MQTT_HEADER_LEN + sizeof(uint16_t) +
-            pkt.publish.topiclen + pkt.publish.payloadlen;
-        struct subscriber *sub = cur->data;
-        struct sol_client *sc = sub->client;
-
-        /* Update QoS according to subscriber's one */
-        pkt.publish.header.bits.qos = sub->qos;
-        if (pkt.publish.header.bits.qos > AT_MOST_ONCE)
-            len += sizeof(uint16_t);
-        int remaininglen_offset = 0;
-        if ((len - 1) > 0x200000)
-            remaininglen_offset = 3;
-        else if ((len - 1) > 0x4000)
-            remaininglen_offset = 2;
-        else if ((len - 1) > 0x80)
-            remaininglen_offset = 1;
-        len += remaininglen_offset;
-        packed = pack_mqtt_packet(&pkt, PUBLISH);
-        if ((sent = send_bytes(sc->fd, packed, len)) < 0)
-            sol_error("Error publishing to %s: %s",
-                      sc->client_id, strerror(errno));
-
-        // Update information stats
-        info.bytes_sent += sent;
-        info.messages_sent++;
-        free(packed);
+/*
+ * Queue a message to the session of a client, called under its write lock,
+ * the stats follow the queue
+ */
+static void client_enqueue(struct sol_client *c, struct message *m,
+                           struct topic *t, unsigned char qos) {
+    struct session *s = c->session;
+    long long len = s->len, bytes = s->bytes;
+    size_t dropped = session_enqueue(s, m, t, qos);
+    info.messages_queued += (long long) s->len - len;
+    info.bytes_queued += (long long) s->bytes - bytes;
+    if (dropped > 0) {
+        sol_debug("Session queue of %s full, %zu messages dropped",
+                  c->client_id, dropped);
+        info.messages_dropped += dropped;
     }
-    free(p);
 }
 
 /*
- * Publish statistics periodic task, it will be called once every N config
- * defined seconds, it publish some informations on predefined topics
+ * Send a PUBLISH packet to a single subscriber, the QoS of the outgoing packet
+ * is the lowest between the one of the message and the one requested by the
+ * subscriber. Called by the event loop and by the fan-out workers, writes go
+ * through the output queue of the client. The packet is packed on the arena of the caller and
+ * rewound right after, a publish to many subscribers doesn't grow it.
+ *
+ * QoS 1 and 2 messages get the next packet id of the client and stay in its
+ * inflight window, referenced, till acknowledged, or wait on the queue of its
+ * session if it has one. The message is NULL for QoS 0 publishes.
  */
-static void publish_stats(struct evloop *loop, void *args) {
-    char cclients[number_len(info.nclients) + 1];
-    sprintf(cclients, "%d", info.nclients);
-    char bsent[number_len(info.bytes_sent) + 1];
-    sprintf(bsent, "%lld", info.bytes_sent);
-    char msent[number_len(info.messages_sent) + 1];
-    sprintf(msent, "%lld", info.messages_sent);
-    char mrecv[number_len(info.messages_recv) + 1];
-    sprintf(mrecv, "%lld", info.messages_recv);
-    long long uptime = time(NULL) - info.start_time;
-    char utime[number_len(uptime) + 1];
-    sprintf(utime, "%lld", uptime);
-    double sol_uptime = (double)(time(NULL) - info.start_time) / SOL_SECONDS;
-    char sutime[16];
-    sprintf(sutime, "%.4f", sol_uptime);
-    publish_message(0, strlen(sys_topics[5]), sys_topics[5],
-                    strlen(utime), (unsigned char *) &utime);
-    publish_message(0, strlen(sys_topics[6]), sys_topics[6],
-                    strlen(sutime), (unsigned char *) &sutime);
-    publish_message(0, strlen(sys_topics[7]), sys_topics[7],
-                    strlen(cclients), (unsigned char *) &cclients);
-    publish_message(0, strlen(sys_topics[9]), sys_topics[9],
-                    strlen(bsent), (unsigned char *) &bsent);
-    publish_message(0, strlen(sys_topics[11]), sys_topics[11],
-                    strlen(msent), (unsigned char *) &msent);
-    publish_message(0, strlen(sys_topics[12]), sys_topics[12],
-                    strlen(mrecv), (unsigned char *) &mrecv);
-}
+static void send_publish(struct subscriber *sub, union mqtt_packet *pkt,
+                         struct message *m, struct topic *t,
+                         struct arena *arena) {
+    struct sol_client *sc = sub->client;
+    unsigned char qos = m && m->qos < sub->qos ? m->qos : sub->qos;
+    if (!m)
+        qos = AT_MOST_ONCE;
 
-static int connect_handler(struct closure *cb, union mqtt_packet *pkt) {
+    /*
+     * Over max_memory, QoS 0 messages to a client which isn't keeping up
+     * with its socket are dropped instead of piling up on it
+     */
+    if (qos == AT_MOST_ONCE &&
+        (conf->memory_policy & MEMORY_DROP_QOS0) && memory_exceeded()) {
+        pthread_mutex_lock(&sc->write_lock);
+        ssize_t pending = socket_pending_bytes(sc->fd);
+        size_t queued = reply_pending(sc);
+        pthread_mutex_unlock(&sc->write_lock);
+        if (pending > 0)
+            queued += pending;
+        if (queued > conf->slow_consumer_bytes) {
+            sol_debug("Memory limit reached, dropping PUBLISH to slow "
+                      "consumer %s", sc->client_id);
+            info.messages_dropped++;
+            return;
+        }
+    }
 
-    // TODO just return error_code and handle it on `on_read`
-    if (hashtable_exists(sol.clients,
-                         (const char *) pkt->connect.payload.client_id)) {
+    pkt->publish.header.bits.qos = qos;
+    pkt->publish.header.bits.dup = 0;
+    pkt->publish.pkt_id = 0;
+    size_t publen = publish_len(pkt);
+    struct arena_mark mark = arena_mark(arena);
+    pthread_mutex_lock(&sc->write_lock);
+    if (qos > AT_MOST_ONCE) {
 
-        // Already connected client, 2 CONNECT packet should be interpreted as
-        // a violation of the protocol, causing disconnection of the client
+        /*
+         * A persistent session queues what can't be sent right away, behind
+         * the messages already queued, which keep their order
+         */
+        struct inflight_entry *e = NULL;
+        if (sc->fd >= 0 && !(sc->session && sc->session->len > 0)) {
+            if (!sc->inflight)
+                sc->inflight = inflight_create(conf->max_inflight);
+            if (sc->inflight)
+                e = inflight_add(sc->inflight, m, t, qos, time(NULL));
+        }
+        if (!e) {
+            if (sc->session) {
+                client_enqueue(sc, m, t, qos);
+            } else if (sc->fd >= 0) {
+                sol_debug("Inflight window of %s full, dropping PUBLISH",
+                          sc->client_id);
+                info.messages_dropped++;
+            }
+            pthread_mutex_unlock(&sc->write_lock);
+            return;
+        }
+        pkt->publish.pkt_id = e->pkt_id;
+    }
+    if (sc->fd < 0) {
+        pthread_mutex_unlock(&sc->write_lock);
+        return;
+    }
+    unsigned char *pub = pack_mqtt_packet(pkt, PUBLISH, arena);
+    client_send(sc, pub, publen);
+    pthread_mutex_unlock(&sc->write_lock);
 
-        sol_info("Received double CONNECT from %s, disconnecting client",
-                 pkt->connect.payload.client_id);
+    // Update information stats
+    sol_debug("Sending PUBLISH to %s (d%i, q%u, r%i, m%u, %s, ... (%zu bytes))",
+              sc->client_id,
+              pkt->publish.header.bits.dup,
+              pkt->publish.header.bits.qos,
+              pkt->publish.header.bits.retain,
+              pkt->publish.pkt_id,
+              pkt->publish.topic,
+              pkt->publish.payloadlen);
+    info.messages_sent++;
+    arena_rewind(arena, mark);
+}
+
+/*
+ * Fan-out workers, one for each shard of the match sets. Publishes with more
+ * subscribers than the configured threshold are split by shard and every
+ * chunk is queued as a job to the worker of the shard, which packs and writes
+ * the message to each subscriber of the chunk.
+ *
+ * A client always belongs to the same shard, picked by the hash of its id so
+ * it stays there across reconnections, and each worker runs its jobs in FIFO
+ * order, while the event loop sends inline only when no job is pending:
+ * every subscriber receives the messages in the order they were published.
+ * What else the event loop sends to a client while jobs are pending, like
+ * retained and resent messages, goes through its worker as well.
+ */
+struct fanout_message {
+    atomic_uint refs;
+    /* Referenced message of QoS 1 and 2 publishes, and its topic */
+    struct message *msg;
+    struct topic *topic;
+    /* Topic and payload are copied right after the struct */
+    union mqtt_packet pkt;
+};
+
+struct fanout_job {
+    struct fanout_message *msg;
+    struct subscriber *const *subscribers;
+    size_t len;
+    /* Member selected from a share group, `subscribers` points to it */
+    struct subscriber *selected;
+    /* Epoch pin keeping subscribers and clients alive till the job is done */
+    unsigned long pin;
+    struct fanout_job *next;
+    /*
+     * Bytes packed by the event loop for a client instead of a message,
+     * dropped if the client moved to another connection in the meanwhile
+     */
+    struct sol_client *client;
+    conn_handle conn;
+    size_t datalen;
+    unsigned char data[];
+};
+
+struct fanout_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct fanout_job *head;
+    struct fanout_job *tail;
+    /* Scratch arena of the worker, reset after every job */
+    struct arena arena;
+};
+
+static struct fanout_worker *workers;
+
+/* Jobs queued to the workers and not yet completed */
+static atomic_long fanout_inflight;
+
+/* Memory accounted for a queued message */
+static size_t fanout_message_size(const union mqtt_packet *pkt) {
+    return sizeof(struct fanout_message) + pkt->publish.topiclen +
+        pkt->publish.payloadlen + 1;
+}
+
+static struct fanout_message *
+fanout_message_create(const union mqtt_packet *pkt, struct message *m,
+                      struct topic *t) {
+    struct fanout_message *msg =
+        memory_alloc(MEMORY_QUEUED, fanout_message_size(pkt));
+    atomic_init(&msg->refs, 1);
+    msg->msg = m ? message_ref(m) : NULL;
+    msg->topic = t;
+    msg->pkt = *pkt;
+
+    /* The topic is NUL terminated like the unpacked one, it gets logged */
+    msg->pkt.publish.topic = (unsigned char *) (msg + 1);
+    memcpy(msg->pkt.publish.topic, pkt->publish.topic, pkt->publish.topiclen);
+    msg->pkt.publish.topic[pkt->publish.topiclen] = '\0';
+    msg->pkt.publish.payload =
+        msg->pkt.publish.topic + pkt->publish.topiclen + 1;
+    memcpy(msg->pkt.publish.payload, pkt->publish.payload,
+           pkt->publish.payloadlen);
+    return msg;
+}
+
+static void fanout_message_release(struct fanout_message *msg) {
+    if (atomic_fetch_sub(&msg->refs, 1) > 1)
+        return;
+    message_release(msg->msg);
+    memory_free(MEMORY_QUEUED, msg, fanout_message_size(&msg->pkt));
+}
+
+static void *fanout_run(void *arg) {
+    struct fanout_worker *w = arg;
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        while (!w->head)
+            pthread_cond_wait(&w->cond, &w->lock);
+        struct fanout_job *job = w->head;
+        w->head = job->next;
+        if (!w->head)
+            w->tail = NULL;
+        pthread_mutex_unlock(&w->lock);
+
+        if (job->client) {
+            struct sol_client *c = job->client;
+            pthread_mutex_lock(&c->write_lock);
+            if (c->conn == job->conn)
+                client_send(c, job->data, job->datalen);
+            pthread_mutex_unlock(&c->write_lock);
+        } else {
+            /* send_publish updates the QoS, each worker has its own copy */
+            union mqtt_packet pkt = job->msg->pkt;
+            for (size_t i = 0; i < job->len; i++)
+                send_publish(job->subscribers[i], &pkt, job->msg->msg,
+                             job->msg->topic, &w->arena);
+            arena_reset(&w->arena);
+            fanout_message_release(job->msg);
+        }
+        epoch_unpin(job->pin);
+        memory_free(MEMORY_QUEUED, job, sizeof(*job) + job->datalen);
+        atomic_fetch_sub(&fanout_inflight, 1);
+    }
+    return NULL;
+}
+
+static void fanout_start(void) {
+    if (conf->fanout_workers <= 0)
+        return;
+    workers = calloc(conf->fanout_workers, sizeof(*workers));
+    for (int i = 0; i < conf->fanout_workers; i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        pthread_cond_init(&workers[i].cond, NULL);
+        pthread_create(&workers[i].thread, NULL, fanout_run, &workers[i]);
+    }
+}
+
+/* Append a job to the queue of a worker, called inside an epoch section */
+static void fanout_push(size_t shard, struct fanout_job *job) {
+    job->pin = epoch_pin();
+    job->next = NULL;
+    atomic_fetch_add(&fanout_inflight, 1);
+    struct fanout_worker *w = &workers[shard];
+    pthread_mutex_lock(&w->lock);
+    if (w->tail)
+        w->tail->next = job;
+    else
+        w->head = job;
+    w->tail = job;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Queue a chunk of subscribers to a worker, called inside an epoch section */
+static void fanout_enqueue(size_t shard, struct fanout_message *msg,
+                           struct subscriber *const *subscribers, size_t len,
+                           struct subscriber *selected) {
+    struct fanout_job *job = memory_alloc(MEMORY_QUEUED, sizeof(*job));
+    atomic_fetch_add(&msg->refs, 1);
+    job->msg = msg;
+    job->selected = selected;
+    job->subscribers = selected ? &job->selected : subscribers;
+    job->len = len;
+    job->client = NULL;
+    job->datalen = 0;
+    fanout_push(shard, job);
+}
+
+/*
+ * Send bytes packed by the event loop to a client, through the worker of the
+ * client while publishes may be queued to it, so they don't get ahead of
+ * them. Called under the write lock of the client.
+ */
+static void client_output(struct sol_client *c, const unsigned char *data,
+                          size_t len) {
+    if (conf->fanout_workers <= 0 || atomic_load(&fanout_inflight) == 0) {
+        client_send(c, data, len);
+        return;
+    }
+    if (c->fd < 0 || len == 0)
+        return;
+    struct fanout_job *job = memory_alloc(MEMORY_QUEUED, sizeof(*job) + len);
+    job->msg = NULL;
+    job->subscribers = NULL;
+    job->len = 0;
+    job->client = c;
+    job->conn = c->conn;
+    job->datalen = len;
+    memcpy(job->data, data, len);
+
+    /* The pin keeping the client alive needs an epoch section of its own */
+    epoch_enter();
+    fanout_push(sol_client_shard(c), job);
+    epoch_exit();
+}
+
+static void fanout_publish(const struct match_set *set,
+                           union mqtt_packet *pkt, struct message *m,
+                           struct topic *t) {
+    struct fanout_message *msg = fanout_message_create(pkt, m, t);
+    for (size_t i = 0; i < set->nshards; i++) {
+        size_t len = set->shards[i + 1] - set->shards[i];
+        if (len > 0)
+            fanout_enqueue(i, msg, set->subscribers + set->shards[i],
+                           len, NULL);
+    }
+    for (size_t i = 0; i < set->ngroups; i++) {
+        struct subscriber *sub = share_group_select(set->groups[i]);
+        if (sub)
+            fanout_enqueue(sol_client_shard(sub->client), msg, NULL, 1, sub);
+    }
+    fanout_message_release(msg);
+}
+
+/*
+ * Fan out a PUBLISH packet on a topic, every subscriber matching it receive a
+ * copy of the message while share groups deliver it to just one of their
+ * members. Subscribers are resolved through the match cache, so exact and
+ * wildcard subscriptions are walked only when they changed. QoS 1 and 2
+ * publishes carry their message, referenced by the inflight windows.
+ */
+static void publish_topic(struct topic *t, union mqtt_packet *pkt,
+                          struct message *m) {
+    const struct match_set *set = sol_topic_match(&sol, t);
+
+    /* Once a publish went to the workers, the next ones follow it there */
+    if (conf->fanout_workers > 0 &&
+        (set->nsubscribers >= conf->fanout_threshold ||
+         atomic_load(&fanout_inflight) > 0)) {
+        fanout_publish(set, pkt, m, t);
+        return;
+    }
+    for (size_t i = 0; i < set->nsubscribers; i++)
+        send_publish(set->subscribers[i], pkt, m, t, &scratch);
+    for (size_t i = 0; i < set->ngroups; i++) {
+        struct subscriber *sub = share_group_select(set->groups[i]);
+        if (sub)
+            send_publish(sub, pkt, m, t, &scratch);
+    }
+}
+
+static void publish_message(unsigned short pkt_id,
+                            unsigned short topiclen,
+                            const char *topic,
+                            size_t payloadlen,
+                            unsigned char *payload) {
+
+    /* Retrieve the Topic structure from the global map, exit if not found */
+    epoch_enter();
+    struct topic *t = sol_topic_lookup(&sol, topic, topiclen);
+    if (!t) {
+        epoch_exit();
+        return;
+    }
+
+    /* Build MQTT packet with command PUBLISH */
+    union mqtt_packet pkt;
+    struct mqtt_publish *p = mqtt_packet_publish(&scratch,
+                                                 PUBLISH_BYTE,
+                                                 pkt_id,
+                                                 topiclen,
+                                                 (unsigned char *) topic,
+                                                 payloadlen,
+                                                 payload);
+    pkt.publish = *p;
+
+    /* Send payload through TCP to all subscribed clients of the topic */
+    publish_topic(t, &pkt, NULL);
+    epoch_exit();
+}
+
+/*
+ * Publish a counter on a $SOL topic which is not one of the predefined ones,
+ * e.g. the stats of the object pools which register on their first
+ * allocation, the topic is created and pinned on the first publish
+ */
+static void publish_counter(const char *topic, size_t value) {
+    size_t len = strlen(topic);
+    if (!sol_topic_lookup(&sol, topic, len))
+        topic_ref(sol_topic_intern(&sol, topic, len));
+    char payload[number_len(value) + 1];
+    sprintf(payload, "%zu", value);
+    publish_message(0, len, topic, strlen(payload), (unsigned char *) payload);
+}
+
+/* Publish the stats of a pool on $SOL/broker/pools/<pool>/<stat> */
+static void publish_pool_stat(const struct pool *p, const char *stat,
+                              size_t value) {
+    char topic[128];
+    snprintf(topic, sizeof(topic), "$SOL/broker/pools/%s/%s", p->name, stat);
+    publish_counter(topic, value);
+}
+
+/*
+ * Publish the memory accounted by the broker, the total on
+ * $SOL/broker/memory/used and the breakdown by category on
+ * $SOL/broker/memory/<category>
+ */
+static void publish_memory_stats(void) {
+    char topic[128];
+    size_t used = 0;
+    for (int i = 0; i < MEMORY_CATEGORIES; i++) {
+        size_t bytes = memory_category_used(i);
+        snprintf(topic, sizeof(topic), "$SOL/broker/memory/%s",
+                 memory_category_name(i));
+        publish_counter(topic, bytes);
+        used += bytes;
+    }
+    publish_counter(sys_topics[13], used);
+}
 
-        close(cb->fd);
-        hashtable_del(sol.clients, (const char *) pkt->connect.payload.client_id);
-        hashtable_del(sol.closures, cb->closure_id);
+/* Publish the counters of the write-ahead log on $SOL/broker/wal/<stat> */
+static void publish_wal_stats(void) {
+    struct wal_stats stats;
+    wal_stats(&stats);
+    publish_counter("$SOL/broker/wal/records", stats.records);
+    publish_counter("$SOL/broker/wal/bytes", stats.bytes);
+    publish_counter("$SOL/broker/wal/syncs", stats.syncs);
+    publish_counter("$SOL/broker/wal/latency_us/avg", stats.latency_avg);
+    publish_counter("$SOL/broker/wal/latency_us/max", stats.latency_max);
+}
 
-        // Update stats
-        info.nclients--;
-        info.nconnections--;
+/*
+ * Publish statistics periodic task, it will be called once every N config
+ * defined seconds, it publish some informations on predefined topics
+ */
+static void publish_stats(struct evloop *loop, void *args) {
+    char cclients[number_len(info.nclients) + 1];
+    sprintf(cclients, "%d", info.nclients);
+    char bsent[number_len(info.bytes_sent) + 1];
+    sprintf(bsent, "%lld", info.bytes_sent);
+    char msent[number_len(info.messages_sent) + 1];
+    sprintf(msent, "%lld", info.messages_sent);
+    char mrecv[number_len(info.messages_recv) + 1];
+    sprintf(mrecv, "%lld", info.messages_recv);
+    long long uptime = time(NULL) - info.start_time;
+    char utime[number_len(uptime) + 1];
+    sprintf(utime, "%lld", uptime);
+    double sol_uptime = (double)(time(NULL) - info.start_time) / SOL_SECONDS;
+    char sutime[16];
+    sprintf(sutime, "%.4f", sol_uptime);
+    publish_message(0, strlen(sys_topics[5]), sys_topics[5],
+                    strlen(utime), (unsigned char *) &utime);
+    publish_message(0, strlen(sys_topics[6]), sys_topics[6],
+                    strlen(sutime), (unsigned char *) &sutime);
+    publish_message(0, strlen(sys_topics[7]), sys_topics[7],
+                    strlen(cclients), (unsigned char *) &cclients);
+    publish_message(0, strlen(sys_topics[9]), sys_topics[9],
+                    strlen(bsent), (unsigned char *) &bsent);
+    publish_message(0, strlen(sys_topics[11]), sys_topics[11],
+                    strlen(msent), (unsigned char *) &msent);
+    publish_message(0, strlen(sys_topics[12]), sys_topics[12],
+                    strlen(mrecv), (unsigned char *) &mrecv);
+    for (int i = 0; i < pool_count(); i++) {
+        struct pool *p = pool_get(i);
+        size_t allocated = atomic_load(&p->allocated);
+        publish_pool_stat(p, "used", atomic_load(&p->used));
+        publish_pool_stat(p, "allocated", allocated);
+        publish_pool_stat(p, "bytes", allocated * p->size);
+    }
+    publish_memory_stats();
+    publish_counter(sys_topics[14], atomic_load(&info.messages_queued));
+    publish_counter(sys_topics[15], atomic_load(&info.bytes_queued));
+    if (wal_enabled())
+        publish_wal_stats();
+    arena_reset(&scratch);
+}
 
+static void idle_sweep_closure(struct closure *cb, void *arg) {
+    (void) arg;
+    struct sol_client *c = cb->obj;
+    if (!c)
+        return;
+
+    /* Output still waiting to be written is kept whatever its age */
+    pthread_mutex_lock(&c->write_lock);
+    struct reply *r = c->out;
+    if (r && r->len == 0 && r->used == false)
+        reply_release(c);
+    else if (r)
+        r->used = false;
+    pthread_mutex_unlock(&c->write_lock);
+    if (c->active == false)
+        client_release_hints(c);
+    c->active = false;
+}
+
+/*
+ * Connections are marked on every read and reply and unmarked here, what's
+ * found unmarked didn't see any traffic for a whole period
+ */
+static void idle_sweep(struct evloop *loop, void *args) {
+    (void) loop;
+    (void) args;
+    closure_table_map(&closures, idle_sweep_closure, NULL);
+}
+
+/* Send again an entry of the inflight window if its ack is overdue */
+static void inflight_retry_entry(struct inflight_entry *e, void *arg) {
+    struct sol_client *c = arg;
+    time_t now = time(NULL);
+    if (now - e->sent < (time_t) conf->inflight_retry_time)
+        return;
+    union mqtt_packet pkt;
+    message_packet(&pkt, e->topic, e->msg,
+                   PUBLISH_BYTE | e->qos << 1 | 1 << 3, e->pkt_id);
+    size_t publen = publish_len(&pkt);
+    struct arena_mark mark = arena_mark(&scratch);
+    unsigned char *packed = pack_mqtt_packet(&pkt, PUBLISH, &scratch);
+    client_output(c, packed, publen);
+    arena_rewind(&scratch, mark);
+    sol_debug("Sending PUBLISH to %s again (d1, q%u, m%u)",
+              c->client_id, e->qos, e->pkt_id);
+    info.messages_sent++;
+    e->sent = now;
+}
+
+static void inflight_retry_closure(struct closure *cb, void *arg) {
+    (void) arg;
+    struct sol_client *c = cb->obj;
+    if (!c)
+        return;
+    /* Nothing is sent again while the client still has output to read */
+    pthread_mutex_lock(&c->write_lock);
+    if (c->fd >= 0 && c->inflight && c->inflight->len > 0 &&
+        reply_pending(c) == 0)
+        inflight_map(c->inflight, inflight_retry_entry, c);
+    pthread_mutex_unlock(&c->write_lock);
+}
+
+/*
+ * Runs every inflight_retry_time seconds, an entry can wait up to twice
+ * that time before being sent again
+ */
+static void inflight_retry(struct evloop *loop, void *args) {
+    (void) loop;
+    (void) args;
+    closure_table_map(&closures, inflight_retry_closure, NULL);
+}
+
+/*
+ * PUBLISH packets packed one after another to be sent in a single write,
+ * the retained messages matching a subscription right after the SUBACK or
+ * the messages in flight right after the CONNACK of a resumed session
+ */
+struct packet_batch {
+    /* Client the messages are for, and QoS granted to the subscription */
+    struct sol_client *client;
+    unsigned qos;
+    size_t len;
+    size_t capacity;
+    unsigned char *data;
+};
+
+/* Pack a packet of a given type and length at the end of the batch */
+static void packet_batch_pack(struct packet_batch *batch,
+                              union mqtt_packet *pkt, int type, size_t len) {
+    if (batch->len + len > batch->capacity) {
+        batch->capacity = (batch->len + len) * 2;
+        batch->data = realloc(batch->data, batch->capacity);
+    }
+    struct arena_mark mark = arena_mark(&scratch);
+    unsigned char *packed = pack_mqtt_packet(pkt, type, &scratch);
+    memcpy(batch->data + batch->len, packed, len);
+    batch->len += len;
+    arena_rewind(&scratch, mark);
+}
+
+/* Pack a PUBLISH packet at the end of the batch */
+static void packet_batch_add(struct packet_batch *batch,
+                             union mqtt_packet *pkt) {
+    packet_batch_pack(batch, pkt, PUBLISH, publish_len(pkt));
+    info.messages_sent++;
+}
+
+/* Pack the PUBREL of an outbound QoS 2 publish waiting for its PUBCOMP */
+static void pubrel_batch_add(unsigned short pkt_id, void *arg) {
+    union mqtt_packet pkt;
+    pkt.ack = *mqtt_packet_ack(PUBREL_BYTE, pkt_id);
+    packet_batch_pack(arg, &pkt, PUBREL, MQTT_ACK_LEN);
+}
+
+/*
+ * Send the messages queued to the session of a client while its inflight
+ * window has room, each one leaves the session once written or queued whole
+ * to the output of the client. Called by the event loop, under the write
+ * lock of the client.
+ */
+static void session_drain(struct sol_client *c) {
+    struct session *s = c->session;
+    struct queued_message *q;
+    while (s && c->fd >= 0 && (q = session_peek(s))) {
+        if (!c->inflight)
+            c->inflight = inflight_create(conf->max_inflight);
+        struct inflight_entry *e = c->inflight ?
+            inflight_add(c->inflight, q->msg, q->topic, q->qos, time(NULL)) :
+            NULL;
+        if (!e)
+            break;
+        union mqtt_packet pkt;
+        message_packet(&pkt, q->topic, q->msg,
+                       PUBLISH_BYTE | q->qos << 1, e->pkt_id);
+        size_t publen = publish_len(&pkt);
+        struct arena_mark mark = arena_mark(&scratch);
+        client_output(c, pack_mqtt_packet(&pkt, PUBLISH, &scratch), publen);
+        arena_rewind(&scratch, mark);
+        info.messages_sent++;
+        info.messages_queued--;
+        info.bytes_queued -= q->msg->payloadlen;
+        session_dequeue(s);
+    }
+}
+
+/* Pack an entry of the inflight window again, flagged as a duplicate */
+static void inflight_batch_add(struct inflight_entry *e, void *arg) {
+    union mqtt_packet pkt;
+    message_packet(&pkt, e->topic, e->msg,
+                   PUBLISH_BYTE | e->qos << 1 | 1 << 3, e->pkt_id);
+    packet_batch_add(arg, &pkt);
+    e->sent = time(NULL);
+}
+
+static int connect_handler(struct closure *cb, union mqtt_packet *pkt) {
+
+    // TODO just return error_code and handle it on `on_read`
+    if (cb->obj) {
+
+        // A second CONNECT packet on the same connection is a violation of
+        // the protocol, causing disconnection of the client
+
+        sol_info("Received double CONNECT from %s, disconnecting client",
+                 pkt->connect.payload.client_id);
+        connection_close(cb);
         return -REARM_W;
     }
     sol_info("New client connected as %s (c%i, k%u)",
@@ -547,45 +1650,94 @@ static int connect_handler(struct closure *cb, union mqtt_packet *pkt) {
              pkt->connect.bits.clean_session,
              pkt->connect.payload.keepalive);
 
+    const char *cid = (const char *) pkt->connect.payload.client_id;
+    bool clean_session = pkt->connect.bits.clean_session;
+    unsigned char session_present = 0;
+
+    /*
+     * A persistent session is resumed by a client connecting with the same
+     * id and without clean session, the previous connection is closed if
+     * still open and the client moves to this one, keeping subscriptions,
+     * messages in flight and messages queued while offline
+     */
+    struct sol_client *new_client = sol_client_get(&sol, cid);
+    if (new_client && new_client->session && clean_session == false) {
+        struct closure *old_cb =
+            closure_table_get(&closures, new_client->conn);
+        if (old_cb) {
+            sol_info("Client %s connected again, closing previous connection",
+                     cid);
+            connection_close(old_cb);
+        }
+        new_client->active = true;
+        session_present = 1;
+        sol_match_invalidate(&sol);
+        goto connack;
+    }
+
     /*
-     * Add the new connected client to the global map, if it is already
-     * connected, kick him out accordingly to the MQTT v3.1.1 specs.
+     * Add the new connected client to the registry, if it is already
+     * connected, kick the previous connection out accordingly to the MQTT
+     * v3.1.1 specs, a persistent session of the same id is discarded.
      */
-    struct sol_client *new_client = malloc(sizeof(*new_client));
+    new_client = client_create(cid, clean_session);
     new_client->fd = cb->fd;
-    const char *cid = (const char *) pkt->connect.payload.client_id;
-    new_client->client_id = strdup(cid);
-    hashtable_put(sol.clients, cid, new_client);
+    new_client->conn = closure_handle(cb);
+    struct sol_client *old = sol_client_takeover(&sol, new_client);
+
+    /* A new persistent session starts empty, a clean one ends the old one */
+    if (wal_enabled() && (clean_session == false || (old && old->session)))
+        wal_session_log(new_client->client_id, clean_session == false);
+    if (old) {
+        sol_info("Client %s connected again, closing previous connection",
+                 cid);
+        struct closure *old_cb = closure_table_get(&closures, old->conn);
+        if (old_cb)
+            connection_close(old_cb);
+        client_destroy(old);
+        sol_match_invalidate(&sol);
+    }
 
+connack:
     /* Substitute fd on callback with closure */
     cb->obj = new_client;
 
     /* Respond with a connack */
-    union mqtt_packet *response = malloc(sizeof(*response));
+    union mqtt_packet *response = arena_alloc(&scratch, sizeof(*response));
     unsigned char byte = CONNACK_BYTE;
-
-    // TODO check for session already present
-
-    if (pkt->connect.bits.clean_session == false)
-        new_client->session.subscriptions = list_create(NULL);
-
-    unsigned char session_present = 0;
     unsigned char connect_flags = 0 | (session_present & 0x1) << 0;
     unsigned char rc = 0;  // 0 means connection accepted
 
     response->connack = *mqtt_packet_connack(byte, connect_flags, rc);
 
-    cb->payload = bytestring_create(MQTT_ACK_LEN);
-    unsigned char *p = pack_mqtt_packet(response, CONNACK);
-    memcpy(cb->payload->data, p, MQTT_ACK_LEN);
-    free(p);
+    /*
+     * Messages left unacknowledged are sent again right after the CONNACK,
+     * followed by the PUBREL of the ones waiting for their PUBCOMP and by
+     * the messages queued while offline, as many as the window takes. The
+     * write lock is held throughout and a resumed session gets its new fd
+     * only here, no publish gets ahead of the CONNACK.
+     */
+    struct packet_batch resent = { new_client, 0, 0, 0, NULL };
+    unsigned char *p = pack_mqtt_packet(response, CONNACK, &scratch);
+    pthread_mutex_lock(&new_client->write_lock);
+    new_client->fd = cb->fd;
+    new_client->conn = closure_handle(cb);
+    client_send(new_client, p, MQTT_ACK_LEN);
+    if (new_client->inflight) {
+        inflight_map(new_client->inflight, inflight_batch_add, &resent);
+        if (new_client->inflight->released)
+            pkt_id_map(new_client->inflight->released,
+                       pubrel_batch_add, &resent);
+    }
+    client_output(new_client, resent.data, resent.len);
+    session_drain(new_client);
+    pthread_mutex_unlock(&new_client->write_lock);
+    free(resent.data);
 
     sol_debug("Sending CONNACK to %s (%u, %u)",
               pkt->connect.payload.client_id,
               session_present, rc);
 
-    free(response);
-
     return REARM_W;
 }
 
@@ -596,113 +1748,212 @@ static int disconnect_handler(struct closure *cb, union mqtt_packet *pkt) {
     /* Handle disconnection request from client */
     struct sol_client *c = cb->obj;
     sol_debug("Received DISCONNECT from %s", c->client_id);
-    close(c->fd);
-    hashtable_del(sol.clients, c->client_id);
-    hashtable_del(sol.closures, cb->closure_id);
-
-    // Update stats
-    info.nclients--;
-    info.nconnections--;
-
-    // TODO remove from all topic where it subscribed
+    connection_close(cb);
     return -REARM_W;
 }
 
-/* Recursive auxiliary function to subscribe to all children of a given topic */
-static void recursive_subscription(struct trie_node *node, void *arg) {
+/*
+ * Pack the retained message of a topic, if any, at the end of the batch, QoS
+ * 1 and 2 ones enter the inflight window of the client like any publish
+ */
+static void retained_batch_add(struct packet_batch *batch, struct topic *t) {
+    struct message *m =
+        atomic_load_explicit(&t->retained, memory_order_acquire);
+    if (!m)
+        return;
+    struct sol_client *c = batch->client;
+    unsigned char qos = m->qos < batch->qos ? m->qos : batch->qos;
+    unsigned short pkt_id = 0;
+    if (qos > AT_MOST_ONCE) {
+        pthread_mutex_lock(&c->write_lock);
+        if (!c->inflight)
+            c->inflight = inflight_create(conf->max_inflight);
+        struct inflight_entry *e = c->inflight ?
+            inflight_add(c->inflight, m, t, qos, time(NULL)) : NULL;
+        pthread_mutex_unlock(&c->write_lock);
+        if (!e) {
+            sol_debug("Inflight window of %s full, dropping retained "
+                      "message on %s", c->client_id, t->name);
+            info.messages_dropped++;
+            return;
+        }
+        pkt_id = e->pkt_id;
+    }
+    union mqtt_packet pkt;
+    message_packet(&pkt, t, m, PUBLISH_BYTE | qos << 1 | 1, pkt_id);
+    packet_batch_add(batch, &pkt);
+}
+
+/* Auxiliary function to collect retained messages of a subtree */
+static void subtree_retained(struct trie_node *node, void *arg) {
     if (!node || !node->data)
         return;
-    struct list_node *child = node->children->head;
-    for (; child; child = child->next)
-        recursive_subscription(child->data, arg);
-    struct topic *t = node->data;
-    struct subscriber *s = arg;
-    t->subscribers = list_push(t->subscribers, s);
+    retained_batch_add(arg, node->data);
+}
+
+/*
+ * Subscribe a client to a filter as it comes in a SUBSCRIBE packet, NUL
+ * terminated and modified in place, the retained messages matching it are
+ * collected to the batch, if any. Return the QoS granted or SUBACK_FAILURE.
+ */
+static unsigned char client_subscribe(struct sol_client *c, char *topic,
+                                      size_t topic_len, unsigned qos,
+                                      struct packet_batch *retained) {
+    bool wildcard = false;
+
+    /*
+     * Shared subscription, strip the "$share/<group>/" prefix, the group
+     * will be subscribed to the remaining topic filter
+     */
+    char *group = NULL;
+    if (topic_len > SHARE_PREFIX_LEN &&
+        strncmp(topic, SHARE_PREFIX, SHARE_PREFIX_LEN) == 0) {
+        group = topic + SHARE_PREFIX_LEN;
+        char *filter = strchr(group, '/');
+        if (!filter || filter == group || filter[1] == '\0') {
+            sol_warning("Invalid shared subscription %s from %s",
+                        topic, c->client_id);
+            return SUBACK_FAILURE;
+        }
+        *filter++ = '\0';
+        topic_len -= filter - topic;
+        topic = filter;
+    }
+
+    /*
+     * Subscribe to the topic and all its subtopics if it ends with "/#",
+     * a trailing '/' is not significant to interned topics
+     */
+    if (topic_len > 1 &&
+        topic[topic_len - 1] == '#' && topic[topic_len - 2] == '/') {
+        topic = remove_occur(topic, '#');
+        wildcard = true;
+    }
+
+    // TODO check for callback correctly set to obj
+    struct topic *t = sol_topic_intern(&sol, topic, strlen(topic));
+
+    /*
+     * Subscriptions are the writers of the topic tree, the new version of
+     * each topic list is published while publishers keep reading
+     */
+    pthread_mutex_lock(&sol.lock);
+
+    /* A persistent session keeps it, with the client, till discarded */
+    sol_topic_subscribe(&sol, t, group, c, qos, wildcard);
+    pthread_mutex_unlock(&sol.lock);
+    if (c->session && wal_enabled())
+        wal_subscription_log(c, WAL_SUBSCRIBE, qos, group,
+                             t->name, t->len, wildcard);
+
+    /*
+     * Collect retained messages matching the filter, shared subscriptions
+     * don't receive them
+     */
+    if (!group && retained) {
+        retained->qos = qos;
+        epoch_enter();
+        if (wildcard == true)
+            trie_prefix_map_tuple(&sol.topics, topic,
+                                  subtree_retained, retained);
+        else
+            retained_batch_add(retained, t);
+        epoch_exit();
+    }
+    return qos;
 }
 
 static int subscribe_handler(struct closure *cb, union mqtt_packet *pkt) {
     struct sol_client *c = cb->obj;
-    bool wildcard = false;
-    bool alloced = false;
 
     /*
      * We respond to the subscription request with SUBACK and a list of QoS in
      * the same exact order of reception
      */
     unsigned char rcs[pkt->subscribe.tuples_len];
+    struct packet_batch retained = { c, 0, 0, 0, NULL };
 
     /* Subscribe packets contains a list of topics and QoS tuples */
     for (unsigned i = 0; i < pkt->subscribe.tuples_len; i++) {
         sol_debug("Received SUBSCRIBE from %s", c->client_id);
-
-        /*
-         * Check if the topic exists already or in case create it and store in
-         * the global map
-         */
         char *topic = (char *) pkt->subscribe.tuples[i].topic;
-        sol_debug("\t%s (QoS %i)", topic, pkt->subscribe.tuples[i].qos);
-
-        /* Recursive subscribe to all children topics if the topic ends with "/#" */
-        if (topic[pkt->subscribe.tuples[i].topic_len - 1] == '#' &&
-            topic[pkt->subscribe.tuples[i].topic_len - 2] == '/') {
-            topic = remove_occur(topic, '#');
-            wildcard = true;
-        } else if (topic[pkt->subscribe.tuples[i].topic_len - 1] != '/') {
-            topic = append_string((char *) pkt->subscribe.tuples[i].topic, "/", 1);
-            alloced = true;
-        }
-        struct topic *t = sol_topic_get(&sol, topic);
-
-        // TODO check for callback correctly set to obj
-        if (!t) {
-            t = topic_create(strdup(topic));
-            sol_topic_put(&sol, t);
-        } else if (wildcard == true) {
-            struct subscriber *sub = malloc(sizeof(*sub));
-            sub->client = cb->obj;
-            sub->qos = pkt->subscribe.tuples[i].qos;
-            trie_prefix_map_tuple(&sol.topics, topic,
-                                  recursive_subscription, sub);
-        }
-
-        // Clean session true for now
-        topic_add_subscriber(t, cb->obj, pkt->subscribe.tuples[i].qos, true);
-        if (alloced)
-            free(topic);
-        rcs[i] = pkt->subscribe.tuples[i].qos;
+        unsigned qos = pkt->subscribe.tuples[i].qos;
+        sol_debug("\t%s (QoS %i)", topic, qos);
+        rcs[i] = client_subscribe(c, topic, pkt->subscribe.tuples[i].topic_len,
+                                  qos, &retained);
     }
-    struct mqtt_suback *suback = mqtt_packet_suback(SUBACK_BYTE,
+    struct mqtt_suback *suback = mqtt_packet_suback(&scratch,
+                                                    SUBACK_BYTE,
                                                     pkt->subscribe.pkt_id,
                                                     rcs,
                                                     pkt->subscribe.tuples_len);
-    mqtt_packet_release(pkt, SUBSCRIBE);
     pkt->suback = *suback;
-    unsigned char *packed = pack_mqtt_packet(pkt, SUBACK);
+    unsigned char *packed = pack_mqtt_packet(pkt, SUBACK, &scratch);
     size_t len = MQTT_HEADER_LEN + sizeof(uint16_t) + pkt->subscribe.tuples_len;
-    cb->payload = bytestring_create(len);
-    memcpy(cb->payload->data, packed, len);
-    free(packed);
-    mqtt_packet_release(pkt, SUBACK);
-    free(suback);
+
+    /* The retained messages go out right after the SUBACK */
+    pthread_mutex_lock(&c->write_lock);
+    client_send(c, packed, len);
+    client_output(c, retained.data, retained.len);
+    pthread_mutex_unlock(&c->write_lock);
+    free(retained.data);
     sol_debug("Sending SUBACK to %s", c->client_id);
     return REARM_W;
 }
 
+/*
+ * Remove the subscriptions of a client matching a filter as it comes in an
+ * UNSUBSCRIBE packet, following the same rules of SUBSCRIBE. The entries to
+ * drop are found on the index of the client, without visiting topics. Must
+ * be called holding the lock of the topic tree.
+ */
+static void client_unsubscribe(struct sol_client *c, char *topic,
+                               size_t topic_len) {
+    char *group = NULL;
+    if (topic_len > SHARE_PREFIX_LEN &&
+        strncmp(topic, SHARE_PREFIX, SHARE_PREFIX_LEN) == 0) {
+        group = topic + SHARE_PREFIX_LEN;
+        char *filter = strchr(group, '/');
+        if (!filter || filter == group || filter[1] == '\0')
+            return;
+        *filter++ = '\0';
+        topic_len -= filter - topic;
+        topic = filter;
+    }
+    bool wildcard = false;
+    if (topic_len > 1 && topic[topic_len - 1] == '#' &&
+        topic[topic_len - 2] == '/') {
+        topic_len -= 2;
+        wildcard = true;
+    } else if (topic_len > 0 && topic[topic_len - 1] == '/') {
+        topic_len--;
+    }
+    sol_client_unsubscribe(&sol, c, group, topic, topic_len, wildcard);
+    if (c->session && wal_enabled())
+        wal_subscription_log(c, WAL_UNSUBSCRIBE, 0, group,
+                             topic, topic_len, wildcard);
+}
+
 static int unsubscribe_handler(struct closure *cb, union mqtt_packet *pkt) {
     struct sol_client *c = cb->obj;
     sol_debug("Received UNSUBSCRIBE from %s", c->client_id);
+    pthread_mutex_lock(&sol.lock);
+    for (unsigned i = 0; i < pkt->unsubscribe.tuples_len; i++) {
+        char *topic = (char *) pkt->unsubscribe.tuples[i].topic;
+        sol_debug("\t%s", topic);
+        client_unsubscribe(c, topic, pkt->unsubscribe.tuples[i].topic_len);
+    }
+    pthread_mutex_unlock(&sol.lock);
     pkt->ack = *mqtt_packet_ack(UNSUBACK_BYTE, pkt->unsubscribe.pkt_id);
-    unsigned char *packed = pack_mqtt_packet(pkt, UNSUBACK);
-    cb->payload = bytestring_create(MQTT_ACK_LEN);
-    memcpy(cb->payload->data, packed, MQTT_ACK_LEN);
-    free(packed);
+    unsigned char *packed = pack_mqtt_packet(pkt, UNSUBACK, &scratch);
+    reply_send(cb, packed, MQTT_ACK_LEN);
     sol_debug("Sending UNSUBACK to %s", c->client_id);
     return REARM_W;
 }
 
 static int publish_handler(struct closure *cb, union mqtt_packet *pkt) {
     struct sol_client *c = cb->obj;
-    sol_debug("Received PUBLISH from %s (d%i, q%u, r%i, m%u, %s, ... (%i bytes))",
+    sol_debug("Received PUBLISH from %s (d%i, q%u, r%i, m%u, %s, ... (%zu bytes))",
               c->client_id,
               pkt->publish.header.bits.dup,
               pkt->publish.header.bits.qos,
@@ -711,99 +1962,138 @@ static int publish_handler(struct closure *cb, union mqtt_packet *pkt) {
               pkt->publish.topic,
               pkt->publish.payloadlen);
     info.messages_recv++;
-    char *topic = (char *) pkt->publish.topic;
-    bool alloced = false;
     unsigned char qos = pkt->publish.header.bits.qos;
 
+    /* The packet gets the packet ids of the subscribers while sent out */
+    unsigned short pkt_id = pkt->publish.pkt_id;
+
     /*
-     * For convenience we assure that all topics ends with a '/', indicating a
-     * hierarchical level
+     * With the write-ahead log, QoS 1 and 2 publishes are acked once their
+     * record is durable, by on_durable
      */
-    if (topic[pkt->publish.topiclen - 1] != '/') {
-        topic = append_string((char *) pkt->publish.topic, "/", 1);
-        alloced = true;
+    struct wal_ack ack = {
+        closure_handle(cb), pkt_id, qos == AT_LEAST_ONCE ? PUBACK : PUBREC
+    };
+    bool logged = false;
+
+    /*
+     * A QoS 2 publish is delivered once, till its PUBREL any publish with
+     * the same id is a duplicate and just gets the PUBREC again
+     */
+    if (qos == EXACTLY_ONCE) {
+        if (!c->pubrec_ids)
+            c->pubrec_ids = pkt_id_bitmap_create();
+        if (c->pubrec_ids && pkt_id_test(c->pubrec_ids, pkt_id)) {
+            sol_debug("Duplicate PUBLISH from %s (m%u), not delivered",
+                      c->client_id, pkt_id);
+            goto ack;
+        }
+        if (c->pubrec_ids)
+            pkt_id_set(c->pubrec_ids, pkt_id);
     }
 
+    /* Subscribers already connected receive the message as a normal one */
+    bool retain = pkt->publish.header.bits.retain;
+    pkt->publish.header.bits.retain = 0;
+
     /*
-     * Retrieve the topic from the global map, if it wasn't created before,
-     * create a new one with the name selected
+     * Lookup and fan-out run without locks, inside an epoch section. Devices
+     * keep publishing on the same few topics, the hints of the client are
+     * checked first, before any hashing.
      */
-    struct topic *t = sol_topic_get(&sol, topic);
-    if (!t) {
-        t = topic_create(strdup(topic));
-        sol_topic_put(&sol, t);
+    const char *topic = (const char *) pkt->publish.topic;
+    epoch_enter();
+    /*
+     * Hints are cold state, allocated on the first publish of the client,
+     * without memory for them the topic is just looked up every time
+     */
+    if (!c->hints && (c->hints = pool_alloc(&hints_pool))) {
+        memset(c->hints, 0, sizeof(struct topic_hint[TOPIC_HINTS]));
+        memory_add(MEMORY_CLIENTS, sizeof(struct topic_hint[TOPIC_HINTS]));
     }
+    struct topic *t = c->hints ?
+        topic_hint_find(&sol, c->hints, topic, pkt->publish.topiclen) : NULL;
+    if (!t) {
 
-    // Not the best way to handle this
-    if (alloced == true)
-        free(topic);
-    size_t publen;
-    unsigned char *pub;
-    struct list_node *cur = t->subscribers->head;
-    for (; cur; cur = cur->next) {
-        publen = MQTT_HEADER_LEN + sizeof(uint16_t) +
-            pkt->publish.topiclen + pkt->publish.payloadlen;
-        struct subscriber *sub = cur->data;
-        struct sol_client *sc = sub->client;
-
-        /* Update QoS according to subscriber's one */
-        pkt->publish.header.bits.qos = sub->qos;
-        if (pkt->publish.header.bits.qos > AT_MOST_ONCE)
-            publen += sizeof(uint16_t);
-        int remaininglen_offset = 0;
-        if ((publen - 1) > 0x200000)
-            remaininglen_offset = 3;
-        else if ((publen - 1) > 0x4000)
-            remaininglen_offset = 2;
-        else if ((publen - 1) > 0x80)
-            remaininglen_offset = 1;
-        publen += remaininglen_offset;
-        pub = pack_mqtt_packet(pkt, PUBLISH);
-        ssize_t sent;
-        if ((sent = send_bytes(sc->fd, pub, publen)) < 0)
-            sol_error("Error publishing to %s: %s",
-                      sc->client_id, strerror(errno));
-
-        // Update information stats
-        info.bytes_sent += sent;
-        sol_debug("Sending PUBLISH to %s (d%i, q%u, r%i, m%u, %s, ... (%i bytes))",
-                  sc->client_id,
-                  pkt->publish.header.bits.dup,
-                  pkt->publish.header.bits.qos,
-                  pkt->publish.header.bits.retain,
-                  pkt->publish.pkt_id,
-                  pkt->publish.topic,
-                  pkt->publish.payloadlen);
-        info.messages_sent++;
-        free(pub);
+        /*
+         * Most publishes hit topics nobody is subscribed to, unless the
+         * message has to be retained they're dropped after a probe on the
+         * subscribed topics filter, without creating the topic
+         */
+        if (retain == false &&
+            !sol_topic_subscribed(&sol, topic, pkt->publish.topiclen)) {
+            epoch_exit();
+            goto ack;
+        }
+
+        /*
+         * Retrieve the interned topic straight from the packet bytes, if it
+         * wasn't created before, create a new one with the name selected,
+         * it's the handle of its subscribers in the match cache
+         */
+        t = sol_topic_intern(&sol, topic, pkt->publish.topiclen);
+        if (c->hints)
+            topic_hint_store(&sol, c->hints, t);
     }
 
-    // TODO free publish
+    /*
+     * Messages which outlive the request, retained or waiting for acks in
+     * the inflight windows, share the inbound one, read by recv_packet with
+     * its payload. An empty retained message clears the one retained on the
+     * topic.
+     */
+    struct message *m = inbound;
+    size_t payloadlen = pkt->publish.payloadlen;
+    if (wal_enabled() && qos > AT_MOST_ONCE)
+        m->id = ++wal_message_id;
+    publish_topic(t, pkt, m);
+    bool retained = retain == true &&
+        sol_topic_retain(&sol, t, payloadlen > 0 ? m : NULL);
+    if (retain == true && retained == false)
+        sol_warning("Retained memory limit reached, message on %s from %s "
+                    "not retained", t->name, c->client_id);
 
+    /*
+     * QoS 0 publishes are not logged unless retained, a message the store
+     * refused is logged as a plain publish, if at all
+     */
+    if (wal_enabled() && (qos > AT_MOST_ONCE || retained == true)) {
+        struct wal_record r = {
+            .type = retained == true ? WAL_RETAIN : WAL_PUBLISH,
+            .qos = qos,
+            .topiclen = pkt->publish.topiclen,
+            .payloadlen = payloadlen,
+            .id = m ? m->id : 0,
+            .topic = topic,
+            .payload = pkt->publish.payload
+        };
+        wal_append(&r, qos > AT_MOST_ONCE ? &ack : NULL);
+        logged = true;
+    }
+    epoch_exit();
+
+ack:
+    /* Duplicates and dropped publishes are acked after the ones before */
+    if (qos > AT_MOST_ONCE && wal_enabled()) {
+        if (logged == false)
+            wal_append(NULL, &ack);
+        return REARM_R;
+    }
     if (qos == AT_LEAST_ONCE) {
-        mqtt_puback *puback = mqtt_packet_ack(PUBACK_BYTE, pkt->publish.pkt_id);
-        mqtt_packet_release(pkt, PUBLISH);
+        mqtt_puback *puback = mqtt_packet_ack(PUBACK_BYTE, pkt_id);
         pkt->ack = *puback;
-        unsigned char *packed = pack_mqtt_packet(pkt, PUBACK);
-        cb->payload = bytestring_create(MQTT_ACK_LEN);
-        memcpy(cb->payload->data, packed, MQTT_ACK_LEN);
-        free(packed);
+        unsigned char *packed = pack_mqtt_packet(pkt, PUBACK, &scratch);
+        reply_send(cb, packed, MQTT_ACK_LEN);
         sol_debug("Sending PUBACK to %s", c->client_id);
         return REARM_W;
     } else if (qos == EXACTLY_ONCE) {
-
-        // TODO add to a hashtable to track PUBREC clients last
-        mqtt_pubrec *pubrec = mqtt_packet_ack(PUBREC_BYTE, pkt->publish.pkt_id);
-        mqtt_packet_release(pkt, PUBLISH);
+        mqtt_pubrec *pubrec = mqtt_packet_ack(PUBREC_BYTE, pkt_id);
         pkt->ack = *pubrec;
-        unsigned char *packed = pack_mqtt_packet(pkt, PUBREC);
-        cb->payload = bytestring_create(MQTT_ACK_LEN);
-        memcpy(cb->payload->data, packed, MQTT_ACK_LEN);
-        free(packed);
+        unsigned char *packed = pack_mqtt_packet(pkt, PUBREC, &scratch);
+        reply_send(cb, packed, MQTT_ACK_LEN);
         sol_debug("Sending PUBREC to %s", c->client_id);
         return REARM_W;
     }
-    mqtt_packet_release(pkt, PUBLISH);
 
     /*
      * We're in the case of AT_MOST_ONCE QoS level, we don't need to sent out
@@ -812,44 +2102,419 @@ static int publish_handler(struct closure *cb, union mqtt_packet *pkt) {
     return REARM_R;
 }
 
+/*
+ * Send the messages queued to the session of a client as far as its inflight
+ * window allows, once an ack made room in it
+ */
+static void session_flush(struct sol_client *c) {
+    if (!c->session || c->session->len == 0)
+        return;
+    pthread_mutex_lock(&c->write_lock);
+    session_drain(c);
+    pthread_mutex_unlock(&c->write_lock);
+}
+
+/*
+ * Acks made durable by the write-ahead log, the ones to the same connection
+ * one after another are packed together and queued to its output at once.
+ * The acks of a connection closed in the meanwhile are dropped, its client
+ * sends the publishes again.
+ */
+struct ack_batch {
+    conn_handle conn;
+    struct packet_batch packets;
+};
+
+static void ack_batch_flush(struct ack_batch *b) {
+    if (b->packets.len == 0)
+        return;
+    struct closure *cb = closure_table_get(&closures, b->conn);
+    struct sol_client *c = cb ? cb->obj : NULL;
+    if (c) {
+        pthread_mutex_lock(&c->write_lock);
+        client_send(c, b->packets.data, b->packets.len);
+        pthread_mutex_unlock(&c->write_lock);
+    }
+    b->packets.len = 0;
+}
+
+static void ack_batch_add(const struct wal_ack *ack, void *arg) {
+    struct ack_batch *b = arg;
+    if (ack->conn != b->conn)
+        ack_batch_flush(b);
+    b->conn = ack->conn;
+    unsigned char byte = ack->type == PUBACK ? PUBACK_BYTE : PUBREC_BYTE;
+    union mqtt_packet pkt;
+    pkt.ack = *mqtt_packet_ack(byte, ack->pkt_id);
+    packet_batch_pack(&b->packets, &pkt, ack->type, MQTT_ACK_LEN);
+    sol_debug("Sending %s (m%u), durable", ack->type == PUBACK ?
+              "PUBACK" : "PUBREC", ack->pkt_id);
+}
+
+static void on_durable(struct evloop *loop, void *arg) {
+    struct closure *cb = arg;
+    uint64_t count;
+    (void) read(cb->fd, &count, sizeof(count));
+    struct ack_batch b = { 0, { NULL, 0, 0, 0, NULL } };
+    wal_acks_map(ack_batch_add, &b);
+    ack_batch_flush(&b);
+    free(b.packets.data);
+    wal_checkpoint_run();
+    evloop_rearm_callback_read(loop, cb);
+}
+
+static void wal_session_log(const char *cid, bool open) {
+    struct wal_record r = {
+        .type = WAL_SESSION,
+        .qos = open == true,
+        .topiclen = strlen(cid),
+        .topic = cid
+    };
+    wal_append(&r, NULL);
+}
+
+/* The filter is written the way a client sends it in a SUBSCRIBE */
+static void wal_subscription_log(const struct sol_client *c,
+                                 unsigned char type, unsigned qos,
+                                 const char *group, const char *topic,
+                                 size_t topic_len, bool wildcard) {
+    size_t grouplen = group ? strlen(group) : 0;
+    size_t len = topic_len + (group ? SHARE_PREFIX_LEN + grouplen + 1 : 0) +
+        (wildcard == true ? 2 : 0);
+    struct arena_mark mark = arena_mark(&scratch);
+    char *filter = arena_alloc(&scratch, len), *p = filter;
+    if (group) {
+        memcpy(p, SHARE_PREFIX, SHARE_PREFIX_LEN);
+        memcpy(p + SHARE_PREFIX_LEN, group, grouplen);
+        p += SHARE_PREFIX_LEN + grouplen;
+        *p++ = '/';
+    }
+    memcpy(p, topic, topic_len);
+    if (wildcard == true)
+        memcpy(p + topic_len, "/#", 2);
+    struct wal_record r = {
+        .type = type,
+        .qos = qos,
+        .topiclen = strlen(c->client_id),
+        .payloadlen = len,
+        .topic = c->client_id,
+        .payload = (unsigned char *) filter
+    };
+    wal_append(&r, NULL);
+    arena_rewind(&scratch, mark);
+}
+
+static void wal_ack_log(const struct sol_client *c, uint64_t id) {
+    struct wal_record r = {
+        .type = WAL_ACK,
+        .topiclen = strlen(c->client_id),
+        .id = id,
+        .topic = c->client_id
+    };
+    wal_append(&r, NULL);
+}
+
+/*
+ * Put a message back to the session of a client after a restart, in its
+ * inflight window as far as it takes, like the messages sent before, then
+ * on its queue. They're sent again once the client connects.
+ */
+static void session_restore(struct sol_client *c, struct message *m,
+                            struct topic *t, unsigned char qos) {
+    pthread_mutex_lock(&c->write_lock);
+    if (!c->inflight)
+        c->inflight = inflight_create(conf->max_inflight);
+    if (c->session->len > 0 || !c->inflight ||
+        !inflight_add(c->inflight, m, t, qos, time(NULL)))
+        client_enqueue(c, m, t, qos);
+    pthread_mutex_unlock(&c->write_lock);
+}
+
+struct inflight_lookup {
+    uint64_t id;
+    unsigned short pkt_id;
+};
+
+static void inflight_lookup_id(struct inflight_entry *e, void *arg) {
+    struct inflight_lookup *l = arg;
+    if (e->msg->id == l->id)
+        l->pkt_id = e->pkt_id;
+}
+
+/*
+ * A message acked before the restart leaves the session, from the window
+ * first, which the messages queued fill up again
+ */
+static void session_restore_ack(struct sol_client *c, uint64_t id) {
+    struct inflight_lookup l = { id, 0 };
+    pthread_mutex_lock(&c->write_lock);
+    if (c->inflight)
+        inflight_map(c->inflight, inflight_lookup_id, &l);
+    if (l.pkt_id != 0) {
+        inflight_ack(c->inflight, l.pkt_id);
+        struct queued_message *q;
+        while ((q = session_peek(c->session)) &&
+               inflight_add(c->inflight, q->msg, q->topic,
+                            q->qos, time(NULL))) {
+            info.messages_queued--;
+            info.bytes_queued -= q->msg->payloadlen;
+            session_dequeue(c->session);
+        }
+    } else {
+        size_t bytes = c->session->bytes;
+        if (session_remove(c->session, id)) {
+            info.messages_queued--;
+            info.bytes_queued -= bytes - c->session->bytes;
+        }
+    }
+    pthread_mutex_unlock(&c->write_lock);
+}
+
+/* Session subscribers of a message replayed get it again, offline */
+static void session_restore_publish(struct subscriber *sub, struct topic *t,
+                                    struct message *m) {
+    unsigned char qos = m->qos < sub->qos ? m->qos : sub->qos;
+    if (sub->client->session && qos > AT_MOST_ONCE)
+        session_restore(sub->client, m, t, qos);
+}
+
+static void wal_restore_message(struct wal_restore *restore,
+                                const struct wal_record *r) {
+    struct topic *t = sol_topic_intern(&sol, r->topic, r->topiclen);
+    unsigned char *payload = malloc(r->payloadlen);
+    if (r->payloadlen > 0)
+        memcpy(payload, r->payload, r->payloadlen);
+    struct message *m = message_create(r->qos, r->payloadlen, payload);
+    m->id = r->id;
+    if (r->type == WAL_RETAIN &&
+        sol_topic_retain(&sol, t, r->payloadlen > 0 ? m : NULL) == false)
+        sol_warning("Retained memory limit reached, message on %s not "
+                    "restored", t->name);
+    if (r->type == WAL_QUEUED && restore->session) {
+        session_restore(restore->session, m, t, r->qos);
+    } else if (r->type != WAL_QUEUED && r->id != 0) {
+        const struct match_set *set = sol_topic_match(&sol, t);
+        for (size_t i = 0; i < set->nsubscribers; i++)
+            session_restore_publish(set->subscribers[i], t, m);
+        for (size_t i = 0; i < set->ngroups; i++) {
+            struct subscriber *sub = share_group_select(set->groups[i]);
+            if (sub)
+                session_restore_publish(sub, t, m);
+        }
+    }
+    message_release(m);
+}
+
+/*
+ * Records are replayed in the order they were logged, before the first
+ * connection. A session starts from scratch on every WAL_SESSION record,
+ * the ones of a checkpoint are followed by its subscriptions and messages,
+ * whatever came before about the session is superseded. Publishes go to the
+ * sessions subscribed at the time, and leave them on their WAL_ACK.
+ */
+static void wal_replay(const struct wal_record *r, void *arg) {
+    struct wal_restore *restore = arg;
+    if (r->id > wal_message_id)
+        wal_message_id = r->id;
+    if (r->type == WAL_PUBLISH || r->type == WAL_RETAIN ||
+        r->type == WAL_QUEUED) {
+        wal_restore_message(restore, r);
+        return;
+    }
+    char cid[r->topiclen + 1];
+    memcpy(cid, r->topic, r->topiclen);
+    cid[r->topiclen] = '\0';
+    struct sol_client *c = sol_client_get(&sol, cid);
+    if (r->type == WAL_SESSION) {
+        if (c && sol_client_remove(&sol, c))
+            client_destroy(c);
+        restore->session = NULL;
+        if (r->qos > 0) {
+            restore->session = client_create(cid, false);
+            sol_client_takeover(&sol, restore->session);
+        }
+        return;
+    }
+    if (!c || !c->session)
+        return;
+    char filter[r->payloadlen + 1];
+    memcpy(filter, r->payload, r->payloadlen);
+    filter[r->payloadlen] = '\0';
+    if (r->type == WAL_SUBSCRIBE) {
+        client_subscribe(c, filter, r->payloadlen, r->qos, NULL);
+    } else if (r->type == WAL_UNSUBSCRIBE) {
+        pthread_mutex_lock(&sol.lock);
+        client_unsubscribe(c, filter, r->payloadlen);
+        pthread_mutex_unlock(&sol.lock);
+    } else if (r->type == WAL_ACK) {
+        session_restore_ack(c, r->id);
+    }
+}
+
+static void wal_queued_add(struct message *m, struct topic *t,
+                           unsigned char qos) {
+    struct wal_record r = {
+        .type = WAL_QUEUED,
+        .qos = qos,
+        .topiclen = t->len,
+        .payloadlen = m->payloadlen,
+        .id = m->id,
+        .topic = t->name,
+        .payload = m->payload
+    };
+    wal_append(&r, NULL);
+}
+
+static void wal_inflight_add(struct inflight_entry *e, void *arg) {
+    (void) arg;
+    wal_queued_add(e->msg, e->topic, e->qos);
+}
+
+static void wal_session_queued_add(struct queued_message *q, void *arg) {
+    (void) arg;
+    wal_queued_add(q->msg, q->topic, q->qos);
+}
+
+/* A persistent session, its subscriptions and the messages not yet acked */
+static void wal_session_add(struct sol_client *c, void *arg) {
+    (void) arg;
+    if (!c->session)
+        return;
+    wal_session_log(c->client_id, true);
+    for (struct subscriber *sub = c->subscribed; sub; sub = sub->client_next)
+        wal_subscription_log(c, WAL_SUBSCRIBE, sub->qos,
+                             sub->group ? sub->group->name : NULL,
+                             sub->topic->name, sub->topic->len,
+                             sub->wildcard);
+    pthread_mutex_lock(&c->write_lock);
+    if (c->inflight)
+        inflight_map(c->inflight, wal_inflight_add, NULL);
+    session_map(c->session, wal_session_queued_add, NULL);
+    pthread_mutex_unlock(&c->write_lock);
+}
+
+static void wal_retained_add(struct topic *t, struct message *m, void *arg) {
+    (void) arg;
+    struct wal_record r = {
+        .type = WAL_RETAIN,
+        .qos = m->qos,
+        .topiclen = t->len,
+        .payloadlen = m->payloadlen,
+        .topic = t->name,
+        .payload = m->payload
+    };
+    wal_append(&r, NULL);
+}
+
+/*
+ * The sessions and the retained store are written whole to the new segment,
+ * after the records it already got, the segments before it are deleted once
+ * it's synced. Publishes still queued to the fan-out workers would reach the
+ * sessions after their snapshot, the workers are let finish them first.
+ */
+static void wal_checkpoint_run(void) {
+    uint64_t segment = wal_checkpoint_due();
+    if (segment == 0)
+        return;
+    while (atomic_load(&fanout_inflight) > 0)
+        sched_yield();
+    sol_client_map(&sol, wal_session_add, NULL);
+    sol_retained_map(&sol, wal_retained_add, NULL);
+    wal_checkpoint(segment);
+}
+
+/*
+ * Id of the logged message in flight under a packet id, whose ack has to be
+ * logged for a persistent session, 0 if none. Called under the write lock.
+ */
+static uint64_t inflight_message_id(struct sol_client *c,
+                                    unsigned short pkt_id) {
+    if (!c->session || !c->inflight || !wal_enabled())
+        return 0;
+    struct inflight_entry *e = inflight_get(c->inflight, pkt_id);
+    return e ? e->msg->id : 0;
+}
+
+/*
+ * Acks of the outbound messages, an unknown packet id, e.g. the ack of a
+ * message sent again, is ignored. The inflight window is shared with the
+ * fan-out workers, it's updated under the write lock of the client.
+ */
 static int puback_handler(struct closure *cb, union mqtt_packet *pkt) {
-    sol_debug("Received PUBACK from %s",
-              ((struct sol_client *) cb->obj)->client_id);
-    // TODO Remove from pending PUBACK clients map
+    struct sol_client *c = cb->obj;
+    unsigned short pkt_id = pkt->ack.pkt_id;
+    sol_debug("Received PUBACK from %s (m%u)", c->client_id, pkt_id);
+    pthread_mutex_lock(&c->write_lock);
+    uint64_t id = inflight_message_id(c, pkt_id);
+    bool acked = c->inflight && inflight_ack(c->inflight, pkt_id);
+    pthread_mutex_unlock(&c->write_lock);
+    if (!acked)
+        sol_debug("PUBACK from %s for packet id %u not in flight",
+                  c->client_id, pkt_id);
+    else
+        session_flush(c);
+    if (acked && id != 0)
+        wal_ack_log(c, id);
     return REARM_R;
 }
 
+/*
+ * First ack of an outbound QoS 2 publish, the message is released and the
+ * id waits for the PUBCOMP, a PUBREL is sent back even for an unknown id so
+ * the client can complete its side
+ */
 static int pubrec_handler(struct closure *cb, union mqtt_packet *pkt) {
     struct sol_client *c = cb->obj;
-    sol_debug("Received PUBREC from %s", c->client_id);
-    mqtt_pubrel *pubrel = mqtt_packet_ack(PUBREL_BYTE, pkt->publish.pkt_id);
+    unsigned short pkt_id = pkt->ack.pkt_id;
+    sol_debug("Received PUBREC from %s (m%u)", c->client_id, pkt_id);
+    pthread_mutex_lock(&c->write_lock);
+    uint64_t id = inflight_message_id(c, pkt_id);
+    bool known = c->inflight && inflight_pubrec(c->inflight, pkt_id);
+    pthread_mutex_unlock(&c->write_lock);
+    if (!known)
+        sol_debug("PUBREC from %s for packet id %u not in flight",
+                  c->client_id, pkt_id);
+    else
+        session_flush(c);
+    if (known && id != 0)
+        wal_ack_log(c, id);
+    mqtt_pubrel *pubrel = mqtt_packet_ack(PUBREL_BYTE, pkt_id);
     pkt->ack = *pubrel;
-    unsigned char *packed = pack_mqtt_packet(pkt, PUBREC);
-    cb->payload = bytestring_create(MQTT_ACK_LEN);
-    memcpy(cb->payload->data, packed, MQTT_ACK_LEN);
-    free(packed);
+    unsigned char *packed = pack_mqtt_packet(pkt, PUBREL, &scratch);
+    reply_send(cb, packed, MQTT_ACK_LEN);
     sol_debug("Sending PUBREL to %s", c->client_id);
     return REARM_W;
 }
 
+/*
+ * Release of an inbound QoS 2 publish, its id can be used again by the
+ * client for a new message
+ */
 static int pubrel_handler(struct closure *cb, union mqtt_packet *pkt) {
-    sol_debug("Received PUBREL from %s",
-              ((struct sol_client *) cb->obj)->client_id);
-    mqtt_pubcomp *pubcomp = mqtt_packet_ack(PUBCOMP_BYTE, pkt->publish.pkt_id);
+    struct sol_client *c = cb->obj;
+    unsigned short pkt_id = pkt->ack.pkt_id;
+    sol_debug("Received PUBREL from %s (m%u)", c->client_id, pkt_id);
+    if (c->pubrec_ids)
+        pkt_id_clear(c->pubrec_ids, pkt_id);
+    mqtt_pubcomp *pubcomp = mqtt_packet_ack(PUBCOMP_BYTE, pkt_id);
     pkt->ack = *pubcomp;
-    unsigned char *packed = pack_mqtt_packet(pkt, PUBCOMP);
-    cb->payload = bytestring_create(MQTT_ACK_LEN);
-    memcpy(cb->payload->data, packed, MQTT_ACK_LEN);
-    free(packed);
+    unsigned char *packed = pack_mqtt_packet(pkt, PUBCOMP, &scratch);
+    reply_send(cb, packed, MQTT_ACK_LEN);
     sol_debug("Sending PUBCOMP to %s",
               ((struct sol_client *) cb->obj)->client_id);
     return REARM_W;
 }
 
 static int pubcomp_handler(struct closure *cb, union mqtt_packet *pkt) {
-    sol_debug("Received PUBCOMP from %s",
-              ((struct sol_client *) cb->obj)->client_id);
-    // TODO Remove from pending PUBACK clients map
+    struct sol_client *c = cb->obj;
+    unsigned short pkt_id = pkt->ack.pkt_id;
+    sol_debug("Received PUBCOMP from %s (m%u)", c->client_id, pkt_id);
+    pthread_mutex_lock(&c->write_lock);
+    bool completed = c->inflight && inflight_pubcomp(c->inflight, pkt_id);
+    pthread_mutex_unlock(&c->write_lock);
+    if (!completed)
+        sol_debug("PUBCOMP from %s for packet id %u not released",
+                  c->client_id, pkt_id);
     return REARM_R;
 }
 
@@ -857,10 +2522,8 @@ static int pingreq_handler(struct closure *cb, union mqtt_packet *pkt) {
     sol_debug("Received PINGREQ from %s",
               ((struct sol_client *) cb->obj)->client_id);
     pkt->header = *mqtt_packet_header(PINGRESP_BYTE);
-    unsigned char *packed = pack_mqtt_packet(pkt, PINGRESP);
-    cb->payload = bytestring_create(MQTT_HEADER_LEN);
-    memcpy(cb->payload->data, packed, MQTT_HEADER_LEN);
-    free(packed);
+    unsigned char *packed = pack_mqtt_packet(pkt, PINGRESP, &scratch);
+    reply_send(cb, packed, MQTT_HEADER_LEN);
     sol_debug("Sending PINGRESP to %s",
               ((struct sol_client *) cb->obj)->client_id);
     return REARM_W;
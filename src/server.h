@@ -1,6 +1,8 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <stdatomic.h>
+
 /*
  * Epoll default settings for concurrent events monitored and timeout, -1
  * means no timeout at all, blocking undefinitely
@@ -13,10 +15,18 @@
  * - error reading packet
  * - error packet sent exceeds size defined by configuration (generally default
  *   to 2MB)
+ * - no memory left for the packet buffer
  */
 #define ERRCLIENTDC         1
 #define ERRPACKETERR        2
 #define ERRMAXREQSIZE       3
+#define ERRNOMEM            4
+
+/*
+ * Milliseconds the rest of a packet is waited for once its first byte was
+ * read, a client stalling longer in the middle of a packet is dropped
+ */
+#define RECV_TIMEOUT        1000
 
 /* Return code of handler functions, signaling if there's payload data to be
  * sent out or if the server just need to re-arm closure for reading incoming
@@ -25,6 +35,12 @@
 #define REARM_R             0
 #define REARM_W             1
 
+/*
+ * Bytes stored inline in the output queue of a client, enough for every ack
+ * and most SUBACKs, longer output gets a buffer of its own
+ */
+#define REPLY_INLINE        32
+
 int start_server(const char *, const char *);
 
 /* Global informations statistics structure */
@@ -37,12 +53,21 @@ struct sol_info {
     long long start_time;
     /* Total number of bytes received */
     long long bytes_recv;
-    /* Total number of bytes sent out */
-    long long bytes_sent;
+    /* Total number of bytes sent out, fan-out workers update it as well */
+    atomic_llong bytes_sent;
     /* Total number of sent messages */
-    long long messages_sent;
+    atomic_llong messages_sent;
     /* Total number of received messages */
     long long messages_recv;
+    /* Total number of bytes reclaimed by collecting unused topics */
+    long long bytes_reclaimed;
+    /* QoS 0 messages dropped to slow consumers over max_memory */
+    atomic_llong messages_dropped;
+    /* Bytes of retained messages evicted over max_memory */
+    long long bytes_evicted;
+    /* Messages and payload bytes waiting on the queues of the sessions */
+    atomic_llong messages_queued;
+    atomic_llong bytes_queued;
 };
 
 /* Add periodic task for publishing stats on SYS topics */
@@ -1,35 +1,14 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
 #include "list.h"
 #include "trie.h"
+#include "memory.h"
 
-static struct list_node *merge_tnode_list(struct list_node *list1,
-                                          struct list_node *list2) {
-    struct list_node dummy_head = { NULL, NULL }, *tail = &dummy_head;
-    while (list1 && list2) {
-
-        /* cast to cluster_node */
-        char chr1 = ((struct trie_node *) list1->data)->chr;
-        char chr2 = ((struct trie_node *) list2->data)->chr;
-
-        struct list_node **min = chr1 <= chr2 ? &list1 : &list2;
-        struct list_node *next = (*min)->next;
-        tail = tail->next = *min;
-        *min = next;
-    }
-    tail->next = list1 ? list1 : list2;
-    return dummy_head.next;
-}
-
-struct list_node *merge_sort_tnode(struct list_node *head) {
-    struct list_node *list1 = head;
-    if (!list1 || !list1->next)
-        return list1;
-    /* find the middle */
-    struct list_node *list2 = bisect_list(list1);
-    return merge_tnode_list(merge_sort_tnode(list1), merge_sort_tnode(list2));
-}
+/* Memory accounted for a node, its children list and its link in the parent */
+#define TRIE_NODE_SIZE \
+    (sizeof(struct trie_node) + sizeof(List) + sizeof(struct list_node))
 
 /* Search for a given node based on a comparison of char stored in structure
  * and a value, O(n) at worst
@@ -46,18 +25,6 @@ static struct list_node *linear_search(const List *list, int value) {
     return NULL;
 }
 
-/* Auxiliary comparison function, uses on list searches, this one compare the
- * char field stored in each struct trie_node structure contained in each node of the
- * list.
- */
-static int with_char(void *arg1, void *arg2) {
-    struct trie_node *tn1 = ((struct list_node *) arg1)->data;
-    struct trie_node *tn2 = ((struct list_node *) arg2)->data;
-    if (tn1->chr == tn2->chr)
-        return 0;
-    return -1;
-}
-
 // Check for children in a struct trie_node, if a node has no children is considered
 // free
 static bool trie_is_free_node(const struct trie_node *node) {
@@ -82,10 +49,65 @@ static struct trie_node *trie_node_find(const struct trie_node *node,
     return retnode;
 }
 
+/*
+ * Link a new child into the sorted children list of a node. The list node is
+ * completely set up before being made reachable, so a concurrent reader walking
+ * the list sees either the old chain or the new one, never a partial node.
+ */
+static void trie_link_child(List *children, struct trie_node *child) {
+    struct list_node *new_node = list_node_alloc();
+    new_node->data = child;
+    struct list_node **link = &children->head;
+    while (*link && ((struct trie_node *) (*link)->data)->chr < child->chr)
+        link = &(*link)->next;
+    new_node->next = *link;
+    if (!new_node->next)
+        children->tail = new_node;
+    atomic_thread_fence(memory_order_release);
+    *link = new_node;
+    children->len++;
+}
+
+/*
+ * Unlink the child storing a given char from the children list of a node,
+ * returning the list node removed without releasing it.
+ */
+static struct list_node *trie_unlink_child(List *children, char chr) {
+    struct list_node **link = &children->head, *prev = NULL;
+    for (; *link; prev = *link, link = &(*link)->next) {
+        if (((struct trie_node *) (*link)->data)->chr != chr)
+            continue;
+        struct list_node *node = *link;
+        *link = node->next;
+        if (children->tail == node)
+            children->tail = prev;
+        children->len--;
+        return node;
+    }
+    return NULL;
+}
+
+/* Release a trie node already emptied of data and children */
+static void trie_leaf_free(void *ptr) {
+    struct trie_node *node = ptr;
+    list_release(node->children, 0);
+    memory_sub(MEMORY_TRIE, TRIE_NODE_SIZE);
+    free(node);
+}
+
+/* Release a pointer through the retire function of the trie, if any */
+static void trie_retire(Trie *trie, void *ptr, void (*release)(void *)) {
+    if (trie->retire)
+        trie->retire(ptr, release);
+    else
+        release(ptr);
+}
+
 // Returns new trie node (initialized to NULL)
 struct trie_node *trie_create_node(char c) {
     struct trie_node *new_node = malloc(sizeof(*new_node));
     if (new_node) {
+        memory_add(MEMORY_TRIE, TRIE_NODE_SIZE);
         new_node->chr = c;
         new_node->data = NULL;
         new_node->children = list_create(NULL);
@@ -103,6 +125,7 @@ Trie *trie_create(void) {
 void trie_init(Trie *trie) {
     trie->root = trie_create_node(' ');
     trie->size = 0;
+    trie->retire = NULL;
 }
 
 size_t trie_size(const Trie *trie) {
@@ -143,11 +166,10 @@ static void *trie_node_insert(struct trie_node *root, const char *key,
          */
         tmp = linear_search(cursor->children, *key);
 
-        // No match, we add a new node and sort the list with the new added link
+        // No match, we add a new node linking it in the sorted position
         if (!tmp) {
             cur_node = trie_create_node(*key);
-            cursor->children = list_push(cursor->children, cur_node);
-            cursor->children->head = merge_sort_tnode(cursor->children->head);
+            trie_link_child(cursor->children, cur_node);
         } else {
             // Match found, no need to sort the list, the child already exists
             cur_node = tmp->data;
@@ -168,10 +190,11 @@ static void *trie_node_insert(struct trie_node *root, const char *key,
 
 /*
  * Private function, iterate recursively through the trie structure starting
- * from a given node, deleting the target value
+ * from a given node, deleting the target value. Unlinked nodes and data are
+ * released through the retire function of the trie.
  */
-static bool trie_node_recursive_delete(struct trie_node *node, const char *key,
-                                       size_t *size, bool *found) {
+static bool trie_node_recursive_delete(Trie *trie, struct trie_node *node,
+                                       const char *key, bool *found) {
     if (!node)
         return false;
 
@@ -183,14 +206,10 @@ static bool trie_node_recursive_delete(struct trie_node *node, const char *key,
             *found = true;
 
             // Free resources, covering the case of a sub-prefix
-            if (node->data) {
-                free(node->data);
-                node->data = NULL;
-            }
-            free(node->data);
+            trie_retire(trie, node->data, free);
             node->data = NULL;
-            if (*size > 0)
-                (*size)--;
+            if (trie->size > 0)
+                trie->size--;
 
             // If empty, node to be deleted
             return trie_is_free_node(node);
@@ -202,15 +221,13 @@ static bool trie_node_recursive_delete(struct trie_node *node, const char *key,
         if (!cur)
             return false;
         struct trie_node *child = cur->data;
-        if (trie_node_recursive_delete(child, key + 1, size, found)) {
-
-            // Messy solution, requiring probably avoidable allocations
-            struct trie_node t = {*key, NULL, NULL};
-            struct list_node tmp = {&t, NULL};
-            list_remove(node->children, &tmp, with_char);
+        if (trie_node_recursive_delete(trie, child, key + 1, found)) {
 
-            // last node marked, delete it
-            trie_node_free(child, size);
+            // Unlink the child first, then retire it as readers could still
+            // be walking it
+            struct list_node *link = trie_unlink_child(node->children, *key);
+            trie_retire(trie, link, list_node_free);
+            trie_retire(trie, child, trie_leaf_free);
 
             // recursively climb up, and delete eligible nodes
             return (!node->data && trie_is_free_node(node));
@@ -248,7 +265,7 @@ bool trie_delete(Trie *trie, const char *key) {
     assert(trie && key);
     bool found = false;
     if (strlen(key) > 0)
-        trie_node_recursive_delete(trie->root, key, &(trie->size), &found);
+        trie_node_recursive_delete(trie, trie->root, key, &found);
     return found;
 }
 
@@ -359,6 +376,7 @@ void trie_node_free(struct trie_node *node, size_t *size) {
     }
 
     // Release the node itself
+    memory_sub(MEMORY_TRIE, TRIE_NODE_SIZE);
     free(node);
 }
 
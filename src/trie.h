@@ -20,11 +20,18 @@ struct trie_node {
 
 /*
  * Trie ADT, it is formed by a root struct trie_node, and the total size of the
- * Trie
+ * Trie.
+ *
+ * Lookups can run concurrently with a single writer at a time: new nodes are
+ * linked only after being fully initialized and unlinked nodes are handed to
+ * the `retire` function, which is in charge of releasing them with the
+ * function passed once no reader can reach them anymore. A NULL `retire`
+ * releases them immediately.
  */
 struct trie {
     struct trie_node *root;
     size_t size;
+    void (*retire)(void *, void (*)(void *));
 };
 
 // Returns new trie node (initialized to NULLs)
@@ -1,5 +1,6 @@
 #include <time.h>
 #include <ctype.h>
+#include <limits.h>
 #include <errno.h>
 #include <assert.h>
 #include <string.h>
@@ -71,13 +72,22 @@ int number_len(size_t number) {
 
 /* Parse the integer part of a string, by effectively iterate through it and
    converting the numbers found */
+/* Leading '-' allowed, saturating at INT_MIN and INT_MAX */
 int parse_int(const char *string) {
-    int n = 0;
+    int sign = 1;
+    if (*string == '-') {
+        sign = -1;
+        string++;
+    }
+    long long n = 0;
     while (*string && isdigit(*string)) {
-        n = (n * 10) + (*string - '0');
+        if (n <= INT_MAX)
+            n = (n * 10) + (*string - '0');
         string++;
     }
-    return n;
+    if (n > INT_MAX)
+        n = INT_MAX;
+    return sign * (int) n;
 }
 
 char *remove_occur(char *str, char c) {
@@ -0,0 +1,616 @@
+#define _DEFAULT_SOURCE
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include "util.h"
+#include "config.h"
+#include "memory.h"
+#include "wal.h"
+
+/* Records written by a single writev, the iovec limit of Linux */
+#define WAL_IOV_MAX 1024
+
+/*
+ * Header of a record on disk, followed by the topic and the payload. The
+ * checksum covers everything after itself, a record torn by a crash while
+ * being written fails it and ends the log. Fields are in host byte order,
+ * the log isn't meant to move across architectures.
+ */
+struct wal_header {
+    uint32_t crc;
+    /* Bytes of topic and payload */
+    uint32_t len;
+    unsigned char type;
+    unsigned char qos;
+    unsigned short topiclen;
+    uint64_t id;
+};
+
+/* A record queued to the I/O thread */
+struct wal_entry {
+    struct wal_entry *next;
+    struct wal_ack ack;
+    bool has_ack;
+    /* Segments before this one can be deleted, 0 for a plain record */
+    uint64_t checkpoint;
+    /* Time of the append, for the latency */
+    struct timespec queued;
+    /* Bytes of the record, header included, 0 if nothing is written */
+    size_t len;
+    unsigned char data[];
+};
+
+static struct wal {
+    bool enabled;
+    char dir[0xFF];
+    int fd;
+    int eventfd;
+    /* Current segment, the oldest one still on disk and the bytes written */
+    uint64_t segment;
+    uint64_t oldest;
+    size_t segment_bytes;
+    /*
+     * Bytes of the segment up to the end of its checkpoint, the snapshot
+     * doesn't count towards the size of the segment or a large one would
+     * start a new segment right away, again and again
+     */
+    size_t checkpoint_bytes;
+    pthread_t thread;
+    /* Guards the queue, the acks durable and the stop flag */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct wal_entry *head;
+    struct wal_entry *tail;
+    struct wal_entry *acks;
+    struct wal_entry *acks_tail;
+    bool stop;
+    /*
+     * A sync failed and no new segment could be started, nothing can be
+     * made durable anymore, the records queued are dropped with their acks
+     */
+    bool failed;
+    /* Segment started and not yet checkpointed */
+    atomic_ullong rotated;
+    atomic_ullong records;
+    atomic_ullong bytes;
+    atomic_ullong syncs;
+    atomic_ullong latency_sum;
+    atomic_ullong latency_max;
+    atomic_ullong latency_count;
+} wal = { .fd = -1, .eventfd = -1 };
+
+static uint32_t crc_table[256];
+
+/* CRC-32C (Castagnoli), the table is filled once by wal_open */
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32c(const unsigned char *buf, size_t len) {
+    uint32_t crc = 0xFFFFFFFF;
+    while (len--)
+        crc = crc_table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t record_crc(const unsigned char *record, size_t len) {
+    size_t offset = sizeof(uint32_t);
+    return crc32c(record + offset, len - offset);
+}
+
+static void segment_path(uint64_t seq, char *path, size_t size) {
+    snprintf(path, size, "%s/wal-%016llx.log", wal.dir,
+             (unsigned long long) seq);
+}
+
+static uint64_t time_us(const struct timespec *ts) {
+    return (uint64_t) ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+/* A new file is durable once the directory listing it is synced too */
+static void sync_dir(void) {
+    int fd = open(wal.dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return;
+    fsync(fd);
+    close(fd);
+}
+
+static int segment_open(uint64_t seq) {
+    char path[PATH_MAX];
+    segment_path(seq, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_TRUNC, 0644);
+    if (fd < 0) {
+        sol_error("Error opening WAL segment %s: %s", path, strerror(errno));
+        return -1;
+    }
+    sync_dir();
+    wal.fd = fd;
+    wal.segment = seq;
+    wal.segment_bytes = 0;
+    wal.checkpoint_bytes = 0;
+    return 0;
+}
+
+/* Wake up the event loop, acks are durable or a checkpoint is due */
+static void wal_notify(void) {
+    uint64_t one = 1;
+    (void) write(wal.eventfd, &one, sizeof(one));
+}
+
+/*
+ * Move on to a new segment, the current one is synced already. The event
+ * loop is asked to write a checkpoint to the new one.
+ */
+static int wal_rotate(void) {
+    int fd = wal.fd;
+    if (segment_open(wal.segment + 1) < 0)
+        return -1;
+    close(fd);
+    atomic_store(&wal.rotated, wal.segment);
+    wal_notify();
+    return 0;
+}
+
+/* Delete the segments made useless by a checkpoint */
+static void wal_prune(uint64_t seq) {
+    char path[PATH_MAX];
+    for (; wal.oldest < seq; wal.oldest++) {
+        segment_path(wal.oldest, path, sizeof(path));
+        if (unlink(path) < 0 && errno != ENOENT)
+            sol_warning("Error deleting WAL segment %s: %s",
+                        path, strerror(errno));
+    }
+    sync_dir();
+}
+
+static void entry_free(struct wal_entry *e) {
+    memory_free(MEMORY_QUEUED, e, sizeof(*e) + e->len);
+}
+
+/* Write every iovec, resuming after short writes */
+static int write_all(int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t written = writev(fd, iov, n);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (n > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (unsigned char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Write a batch of records to the current segment, WAL_IOV_MAX of them at a
+ * time. On error the segment is cut back to where the batch started, so it
+ * ends with a whole record.
+ */
+static int wal_write(struct wal_entry *batch) {
+    struct iovec iov[WAL_IOV_MAX];
+    int n = 0;
+    size_t bytes = 0;
+    size_t checkpoint_bytes = wal.checkpoint_bytes;
+    for (struct wal_entry *e = batch; e; e = e->next) {
+        if (e->checkpoint > 0)
+            checkpoint_bytes = wal.segment_bytes + bytes;
+        if (e->len == 0)
+            continue;
+        struct wal_header *h = (struct wal_header *) e->data;
+        h->crc = record_crc(e->data, e->len);
+        iov[n].iov_base = e->data;
+        iov[n].iov_len = e->len;
+        bytes += e->len;
+        if (++n == WAL_IOV_MAX) {
+            if (write_all(wal.fd, iov, n) < 0)
+                goto err;
+            n = 0;
+        }
+    }
+    if (n > 0 && write_all(wal.fd, iov, n) < 0)
+        goto err;
+    wal.segment_bytes += bytes;
+    wal.checkpoint_bytes = checkpoint_bytes;
+    atomic_fetch_add(&wal.bytes, bytes);
+    return 0;
+
+err:
+    sol_error("Error writing to the WAL: %s", strerror(errno));
+    if (ftruncate(wal.fd, wal.segment_bytes) < 0)
+        sol_error("Error truncating the WAL: %s", strerror(errno));
+    return -1;
+}
+
+/*
+ * Records of a batch are durable, acks go to the event loop and the
+ * checkpoints delete their segments. A batch which couldn't be written or
+ * synced is dropped along with its acks, the clients will send their
+ * publishes again.
+ */
+static void wal_complete(struct wal_entry *batch, bool durable) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct wal_entry *acks = NULL, *last = NULL;
+    while (batch) {
+        struct wal_entry *e = batch;
+        batch = e->next;
+        if (durable && e->checkpoint > 0)
+            wal_prune(e->checkpoint);
+        if (durable && e->len > 0) {
+            uint64_t latency = time_us(&now) - time_us(&e->queued);
+            atomic_fetch_add(&wal.records, 1);
+            atomic_fetch_add(&wal.latency_sum, latency);
+            atomic_fetch_add(&wal.latency_count, 1);
+            uint64_t max = atomic_load(&wal.latency_max);
+            while (latency > max &&
+                   !atomic_compare_exchange_weak(&wal.latency_max,
+                                                 &max, latency))
+                ;
+        }
+        if (durable && e->has_ack) {
+            e->next = NULL;
+            if (last)
+                last->next = e;
+            else
+                acks = e;
+            last = e;
+        } else {
+            entry_free(e);
+        }
+    }
+    if (!acks)
+        return;
+    pthread_mutex_lock(&wal.lock);
+    if (wal.acks_tail)
+        wal.acks_tail->next = acks;
+    else
+        wal.acks = acks;
+    wal.acks_tail = last;
+    pthread_mutex_unlock(&wal.lock);
+    wal_notify();
+}
+
+static void *wal_run(void *arg) {
+    (void) arg;
+
+    /* Written and waiting for the next sync of the interval policy */
+    struct wal_entry *written = NULL, **written_tail = &written;
+    struct timespec next_sync;
+    clock_gettime(CLOCK_MONOTONIC, &next_sync);
+    for (;;) {
+        pthread_mutex_lock(&wal.lock);
+        while (!wal.head && !wal.stop) {
+            if (!written) {
+                pthread_cond_wait(&wal.cond, &wal.lock);
+            } else if (pthread_cond_timedwait(&wal.cond, &wal.lock,
+                                              &next_sync) == ETIMEDOUT) {
+                break;
+            }
+        }
+        struct wal_entry *batch = wal.head;
+        wal.head = wal.tail = NULL;
+        bool stop = wal.stop;
+        pthread_mutex_unlock(&wal.lock);
+
+        if (batch && (wal.failed || wal_write(batch) < 0)) {
+            wal_complete(batch, false);
+        } else if (batch) {
+            *written_tail = batch;
+            while (*written_tail)
+                written_tail = &(*written_tail)->next;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        bool due = now.tv_sec > next_sync.tv_sec ||
+            (now.tv_sec == next_sync.tv_sec &&
+             now.tv_nsec >= next_sync.tv_nsec);
+        if (written && (conf->wal_fsync != WAL_FSYNC_INTERVAL || due || stop)) {
+            bool durable = true;
+            if (conf->wal_fsync != WAL_FSYNC_NEVER) {
+                if (fdatasync(wal.fd) < 0) {
+                    sol_error("Error syncing the WAL: %s", strerror(errno));
+                    durable = false;
+                }
+                atomic_fetch_add(&wal.syncs, 1);
+            }
+            wal_complete(written, durable);
+
+            /*
+             * After a failed sync the kernel may have dropped the dirty pages
+             * of the segment and a second sync can report success, a sync is
+             * never retried on it: the records go on in a new segment, the
+             * checkpoint of which snapshots sessions and retained messages
+             * again
+             */
+            if (!durable && wal_rotate() < 0) {
+                sol_error("Unable to start a new WAL segment, records are "
+                          "not logged anymore and QoS 1 and 2 publishes not "
+                          "acked");
+                wal.failed = true;
+            }
+            written = NULL;
+            written_tail = &written;
+            unsigned long long ns = now.tv_nsec +
+                (unsigned long long) conf->wal_fsync_interval * 1000000;
+            next_sync.tv_sec = now.tv_sec + ns / 1000000000;
+            next_sync.tv_nsec = ns % 1000000000;
+        }
+
+        /* A segment is closed once all of its records are synced */
+        if (!written && !wal.failed && wal.segment_bytes -
+            wal.checkpoint_bytes >= conf->wal_segment_size)
+            wal_rotate();
+        if (stop && !batch && !written)
+            break;
+    }
+    return NULL;
+}
+
+/*
+ * Replay the records of a segment, stopping at the first one incomplete or
+ * corrupted. The last segment is cut there, a crash can leave a record torn
+ * at its end, new records are appended after the last whole one.
+ */
+static int segment_replay(uint64_t seq, bool last,
+                          void (*replay)(const struct wal_record *, void *),
+                          void *arg) {
+    char path[PATH_MAX];
+    segment_path(seq, path, sizeof(path));
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        sol_error("Error opening WAL segment %s: %s", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size, offset = 0;
+    unsigned char *buf = malloc(size > 0 ? size : 1);
+    size_t nread = 0;
+    while (nread < size) {
+        ssize_t n = read(fd, buf + nread, size - nread);
+        if (n <= 0)
+            break;
+        nread += n;
+    }
+    size_t records = 0;
+    while (offset + sizeof(struct wal_header) <= nread) {
+        struct wal_header h;
+        memcpy(&h, buf + offset, sizeof(h));
+        size_t len = sizeof(h) + h.len;
+        if (h.topiclen > h.len || offset + len > nread ||
+            record_crc(buf + offset, len) != h.crc)
+            break;
+        struct wal_record r = {
+            .type = h.type,
+            .qos = h.qos,
+            .topiclen = h.topiclen,
+            .payloadlen = h.len - h.topiclen,
+            .id = h.id,
+            .topic = (const char *) buf + offset + sizeof(h),
+            .payload = buf + offset + sizeof(h) + h.topiclen
+        };
+        replay(&r, arg);
+        offset += len;
+        records++;
+    }
+    if (offset < size) {
+        sol_warning("WAL segment %s ends with %zu bytes not valid%s", path,
+                    size - offset, last ? ", truncated" : "");
+        if (last && ftruncate(fd, offset) < 0)
+            sol_error("Error truncating WAL segment %s: %s",
+                      path, strerror(errno));
+    }
+    sol_info("Replayed %zu records from WAL segment %s", records, path);
+    free(buf);
+    close(fd);
+    return 0;
+}
+
+static int seq_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Sequence numbers of the segments in the directory, sorted */
+static uint64_t *segment_list(size_t *len) {
+    DIR *dir = opendir(wal.dir);
+    if (!dir)
+        return NULL;
+    size_t capacity = 16;
+    uint64_t *seqs = malloc(capacity * sizeof(*seqs));
+    struct dirent *d;
+    *len = 0;
+    while ((d = readdir(dir))) {
+        unsigned long long seq;
+        char tail;
+        if (sscanf(d->d_name, "wal-%16llx.lo%c", &seq, &tail) != 2 ||
+            tail != 'g' || seq == 0)
+            continue;
+        if (*len == capacity) {
+            capacity *= 2;
+            seqs = realloc(seqs, capacity * sizeof(*seqs));
+        }
+        seqs[(*len)++] = seq;
+    }
+    closedir(dir);
+    qsort(seqs, *len, sizeof(*seqs), seq_cmp);
+    return seqs;
+}
+
+int wal_open(const char *dir,
+             void (*replay)(const struct wal_record *, void *), void *arg) {
+    crc32c_init();
+    snprintf(wal.dir, sizeof(wal.dir), "%s", dir);
+    if (mkdir(wal.dir, 0755) < 0 && errno != EEXIST) {
+        sol_error("Error creating WAL directory %s: %s",
+                  wal.dir, strerror(errno));
+        return -1;
+    }
+    size_t nsegments = 0;
+    uint64_t *segments = segment_list(&nsegments);
+    if (!segments) {
+        sol_error("Error reading WAL directory %s: %s",
+                  wal.dir, strerror(errno));
+        return -1;
+    }
+    for (size_t i = 0; i < nsegments; i++) {
+        if (segment_replay(segments[i], i == nsegments - 1, replay, arg) < 0) {
+            free(segments);
+            return -1;
+        }
+    }
+
+    /*
+     * Records go to a new segment, the ones replayed are deleted by the
+     * first checkpoint
+     */
+    uint64_t last = nsegments > 0 ? segments[nsegments - 1] : 0;
+    wal.oldest = nsegments > 0 ? segments[0] : last + 1;
+    free(segments);
+    if (segment_open(last + 1) < 0)
+        return -1;
+    if (nsegments > 0)
+        atomic_store(&wal.rotated, wal.segment);
+    wal.eventfd = eventfd(0, EFD_NONBLOCK);
+    if (wal.eventfd < 0) {
+        sol_error("Error creating WAL eventfd: %s", strerror(errno));
+        close(wal.fd);
+        return -1;
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wal.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&wal.lock, NULL);
+    wal.enabled = true;
+    pthread_create(&wal.thread, NULL, wal_run, NULL);
+    return wal.eventfd;
+}
+
+void wal_close(void) {
+    if (!wal.enabled)
+        return;
+    pthread_mutex_lock(&wal.lock);
+    wal.stop = true;
+    pthread_cond_signal(&wal.cond);
+    pthread_mutex_unlock(&wal.lock);
+    pthread_join(wal.thread, NULL);
+    wal.enabled = false;
+
+    /* Acks of connections being closed anyway */
+    wal_acks_map(NULL, NULL);
+    close(wal.fd);
+    close(wal.eventfd);
+}
+
+bool wal_enabled(void) {
+    return wal.enabled;
+}
+
+static void wal_enqueue(struct wal_entry *e) {
+    clock_gettime(CLOCK_MONOTONIC, &e->queued);
+    e->next = NULL;
+    pthread_mutex_lock(&wal.lock);
+    if (wal.tail)
+        wal.tail->next = e;
+    else
+        wal.head = e;
+    wal.tail = e;
+    pthread_cond_signal(&wal.cond);
+    pthread_mutex_unlock(&wal.lock);
+}
+
+void wal_append(const struct wal_record *r, const struct wal_ack *ack) {
+    size_t len = 0;
+    if (r)
+        len = sizeof(struct wal_header) + r->topiclen + r->payloadlen;
+    struct wal_entry *e = memory_alloc(MEMORY_QUEUED, sizeof(*e) + len);
+    e->has_ack = ack != NULL;
+    if (ack)
+        e->ack = *ack;
+    e->checkpoint = 0;
+    e->len = len;
+    if (r) {
+
+        /* The padding of the header is covered by the checksum as well */
+        struct wal_header h;
+        memset(&h, 0, sizeof(h));
+        h.len = r->topiclen + r->payloadlen;
+        h.type = r->type;
+        h.qos = r->qos;
+        h.topiclen = r->topiclen;
+        h.id = r->id;
+        memcpy(e->data, &h, sizeof(h));
+        memcpy(e->data + sizeof(h), r->topic, r->topiclen);
+        if (r->payloadlen > 0)
+            memcpy(e->data + sizeof(h) + r->topiclen,
+                   r->payload, r->payloadlen);
+    }
+    wal_enqueue(e);
+}
+
+void wal_acks_map(void (*func)(const struct wal_ack *, void *), void *arg) {
+    pthread_mutex_lock(&wal.lock);
+    struct wal_entry *e = wal.acks;
+    wal.acks = wal.acks_tail = NULL;
+    pthread_mutex_unlock(&wal.lock);
+    while (e) {
+        struct wal_entry *next = e->next;
+        if (func)
+            func(&e->ack, arg);
+        entry_free(e);
+        e = next;
+    }
+}
+
+uint64_t wal_checkpoint_due(void) {
+    return atomic_exchange(&wal.rotated, 0);
+}
+
+void wal_checkpoint(uint64_t seq) {
+    struct wal_entry *e = memory_alloc(MEMORY_QUEUED, sizeof(*e));
+    e->has_ack = false;
+    e->checkpoint = seq;
+    e->len = 0;
+    wal_enqueue(e);
+}
+
+void wal_stats(struct wal_stats *stats) {
+    stats->records = atomic_load(&wal.records);
+    stats->bytes = atomic_load(&wal.bytes);
+    stats->syncs = atomic_load(&wal.syncs);
+    uint64_t sum = atomic_exchange(&wal.latency_sum, 0);
+    uint64_t count = atomic_exchange(&wal.latency_count, 0);
+    stats->latency_avg = count > 0 ? sum / count : 0;
+    stats->latency_max = atomic_exchange(&wal.latency_max, 0);
+}
@@ -0,0 +1,129 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Write-ahead log of what has to survive a restart of the broker, the QoS 1
+ * and 2 publishes, the retained messages and the persistent sessions the
+ * publishes are delivered to.
+ *
+ * The event loop appends records to an in-memory queue, a dedicated I/O
+ * thread takes everything queued at each pass and writes it with a single
+ * writev, followed by a single fdatasync depending on the fsync policy:
+ * under load, the publishes of many clients share the cost of a sync (group
+ * commit). The log is a sequence of segment files, a new one is started once
+ * the current one grows over `wal_segment_size`.
+ *
+ * A record can carry the ack of its publish, handed back to the event loop
+ * through an eventfd only once the record is durable. Acks without a record,
+ * e.g. of duplicate publishes, go through the queue too, so a client gets
+ * its acks in the order it published.
+ *
+ * The state is restored replaying the segments at start: retained messages,
+ * persistent sessions with their subscriptions, and the QoS 1 and 2 messages
+ * the sessions were not done with. Once a new segment is started, the event
+ * loop writes a snapshot of the sessions and of the retained store to it,
+ * after which the older segments are deleted (checkpoint).
+ */
+
+enum wal_record_type {
+    /* Nothing written, an ack or a checkpoint waiting for the records ahead */
+    WAL_NONE,
+    /* QoS 1 or 2 publish, delivered to the sessions subscribed on replay */
+    WAL_PUBLISH,
+    /*
+     * Retained message, an empty payload clears the one of the topic, a QoS
+     * 1 or 2 publish with an id is delivered like a WAL_PUBLISH
+     */
+    WAL_RETAIN,
+    /*
+     * Persistent session of a client, the topic being its id, started empty,
+     * or discarded with QoS 0
+     */
+    WAL_SESSION,
+    /* Subscription of a session, the payload being the filter */
+    WAL_SUBSCRIBE,
+    WAL_UNSUBSCRIBE,
+    /* Message delivered and acked by the client of a session */
+    WAL_ACK,
+    /*
+     * Message not yet acked by the session of the last WAL_SESSION record,
+     * written by checkpoints
+     */
+    WAL_QUEUED
+};
+
+/*
+ * A record, the topic and the payload are copied on append. Session records
+ * carry the client id as topic.
+ */
+struct wal_record {
+    unsigned char type;
+    unsigned char qos;
+    unsigned short topiclen;
+    uint32_t payloadlen;
+    /* Id of the message, 0 for records not about a logged message */
+    uint64_t id;
+    const char *topic;
+    const unsigned char *payload;
+};
+
+/* Ack of a publish, sent once its record is durable */
+struct wal_ack {
+    /* Handle of the connection the publish came from */
+    uint64_t conn;
+    unsigned short pkt_id;
+    /* PUBACK or PUBREC */
+    unsigned char type;
+};
+
+/*
+ * Counters of the log, the latency goes from the append of a record to its
+ * sync, average and max are over the records synced since the previous read
+ */
+struct wal_stats {
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t syncs;
+    uint64_t latency_avg;
+    uint64_t latency_max;
+};
+
+/*
+ * Open the log in a directory, created if missing, calling a function on
+ * every record found, oldest first, and start the I/O thread. Return the
+ * eventfd signaled once acks are durable or a checkpoint is due, -1 on error.
+ */
+int wal_open(const char *, void (*)(const struct wal_record *, void *), void *);
+
+/* Write the records still queued and stop the I/O thread */
+void wal_close(void);
+
+bool wal_enabled(void);
+
+/*
+ * Queue a record, copied, and the ack to send once it's durable. The record
+ * can be NULL for an ack alone, the ack for a record alone.
+ */
+void wal_append(const struct wal_record *, const struct wal_ack *);
+
+/* Call a function on every ack durable so far */
+void wal_acks_map(void (*)(const struct wal_ack *, void *), void *);
+
+/*
+ * Return the segment started since the last call if a checkpoint is due, 0
+ * otherwise. The caller appends the sessions and the retained messages and
+ * then calls wal_checkpoint with the segment.
+ */
+uint64_t wal_checkpoint_due(void);
+
+/* Delete the segments before the given one, once the records ahead are synced */
+void wal_checkpoint(uint64_t);
+
+/* Read the counters, resetting the latency ones */
+void wal_stats(struct wal_stats *);
+
+#endif